@@ -0,0 +1,46 @@
+/*
+ * Heap allocation counters for the benchmark binaries in bench/
+ *
+ * Replaces global operator new / delete, include it in one translation unit
+ * of a benchmark binary only. Counters are process wide, allocations of
+ * driver threads are counted too.
+ */
+
+#ifndef BENCH_ALLOC_H
+#define BENCH_ALLOC_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <new>
+
+struct BenchAllocStats {
+    uint64_t Allocs;
+    uint64_t Bytes;
+};
+
+static BenchAllocStats BenchAllocCounters;
+
+//! Return: allocations and bytes allocated since program start
+static inline BenchAllocStats BenchGetAllocs() {
+    BenchAllocStats res;
+    res.Allocs = __atomic_load_n(&BenchAllocCounters.Allocs, __ATOMIC_RELAXED);
+    res.Bytes = __atomic_load_n(&BenchAllocCounters.Bytes, __ATOMIC_RELAXED);
+    return res;
+}
+
+static inline void * BenchAlloc(size_t size) {
+    __atomic_add_fetch(&BenchAllocCounters.Allocs, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&BenchAllocCounters.Bytes, size, __ATOMIC_RELAXED);
+    void * p = malloc(size ? size : 1);
+    if( p == NULL ) throw std::bad_alloc();
+    return p;
+}
+
+void * operator new(size_t size) { return BenchAlloc(size); }
+void * operator new[](size_t size) { return BenchAlloc(size); }
+void operator delete(void * p) noexcept { free(p); }
+void operator delete[](void * p) noexcept { free(p); }
+void operator delete(void * p, size_t) noexcept { free(p); }
+void operator delete[](void * p, size_t) noexcept { free(p); }
+
+#endif
@@ -0,0 +1,45 @@
+/*
+ * Shared helpers for the benchmark binaries in bench/
+ */
+
+#ifndef BENCH_UTIL_H
+#define BENCH_UTIL_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+//! Return: monotonic time, nsec
+static inline uint64_t BenchNowNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+//! Fixed-seed xorshift32, benchmark inputs must be the same on every run
+struct BenchRng {
+    uint32_t State;
+
+    BenchRng(uint32_t seed = 0x12345678) { State = seed ? seed : 1; }
+
+    uint32_t Next() {
+        State ^= State << 13;
+        State ^= State >> 17;
+        State ^= State << 5;
+        return State;
+    }
+
+    //! Return: value in [lo, hi]
+    int Range(int lo, int hi) { return lo + (int)(Next() % (uint32_t)(hi - lo + 1)); }
+
+    //! Return: true with probability permille / 1000
+    bool Chance(int permille) { return (int)(Next() % 1000) < permille; }
+};
+
+//! Return: integer value of argv[idx] or def if absent
+static inline long BenchArg(int argc, char ** argv, int idx, long def) {
+    if( idx >= argc ) return def;
+    return strtol(argv[idx], NULL, 0);
+}
+
+#endif
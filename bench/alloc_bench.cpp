@@ -0,0 +1,134 @@
+/*
+ * Heap allocations of the send and receive hot paths in steady state
+ *
+ * Usage: alloc_bench [ops]
+ *
+ * Every path is warmed up, then run ops times while operator new is counted,
+ * allocations of the driver threads included. Exits with 1 if any path
+ * allocates.
+ */
+
+#include <stdio.h>
+
+#include "BenchUtil.h"
+#include "BenchAlloc.h"
+#include "TiqiaaUsb.h"
+#include "TiqiaaEmu.h"
+#include "TiqiaaPacketBuilder.h"
+#include "TiqiaaReassembler.h"
+#include "ctqirsignal.h"
+
+static const int WarmupOps = 100;
+static const int MaxNecSize = 128;
+
+typedef bool PathFn(int i);
+
+static TiqiaaUsbIrEmulator Emu;
+static TiqiaaUsbIr Ir;
+static CTqIrSignal Sig;
+static CTqIrSignal RecvSig;
+static TiqiaaUsbIrPacketBuilder Builder;
+static TiqiaaUsbIrReassembler Reasm(TiqiaaUsbIr_WriteReportId);
+static uint8_t NecBuf[MaxNecSize];
+static int NecSize;
+static volatile bool Received;
+static volatile uint16_t ReceivedCode;
+
+static uint16_t GetCode(int i) {
+    return 0x8002 + 2 * (i % 3);
+}
+
+static void RecvCallback(uint8_t * data, int size, TiqiaaUsbIr * /*IrCls*/, void * /*context*/) {
+    uint16_t Code = 0;
+    uint32_t RawCode;
+
+    if( RecvSig.FromTiqiaa(data, size) && RecvSig.DecodeIrNecSignal(&Code, &RawCode) ) ReceivedCode = Code;
+    Received = true;
+}
+
+static bool PathEncode(int i) {
+    Sig.WriteIrNecSignal(GetCode(i));
+    return Sig.ToTiqiaa(NecBuf, sizeof(NecBuf)) <= sizeof(NecBuf);
+}
+
+static bool PathDriverEncode(int i) {
+    return TiqiaaUsbIr::WriteIrNecSignal(GetCode(i), NecBuf) > 0;
+}
+
+static bool PathBuildPacket(int i) {
+    TiqiaaUsbIr_IrSegment Seg = {NecBuf, NecSize};
+
+    return Builder.BuildIR(TiqiaaUsbIr::GetIrFreqId(38000), &Seg, 1, (i & 0x7F) + 1);
+}
+
+static bool PathReassemble(int i) {
+    int res = 0;
+
+    Builder.SetPacketIdx((i % 15) + 1);
+    for( int f = 0; f < Builder.GetFragmCount(); f++ ) res = Reasm.PushFragment(Builder.GetFragm(f), Builder.GetFragmSize(f));
+    return res == TiqiaaUsbIrReassembler::PacketComplete;
+}
+
+static bool PathDecode(int /*i*/) {
+    uint16_t Code;
+    uint32_t RawCode;
+
+    return Sig.FromTiqiaa(NecBuf, NecSize) && Sig.DecodeIrNecSignal(&Code, &RawCode);
+}
+
+static bool PathSend(int i) {
+    return Ir.SendNecSignal(GetCode(i));
+}
+
+static bool PathReceive(int /*i*/) {
+    uint64_t Deadline;
+
+    Received = false;
+    ReceivedCode = 0;
+    if( !Ir.StartRecvIR() || !Emu.InjectIrSignal(NecBuf, NecSize) ) return false;
+    Deadline = BenchNowNs() + 1000000000ull;
+    while( !Received && (BenchNowNs() < Deadline) ) {}
+    return Received && (ReceivedCode == 0x8002);
+}
+
+// Return: true - no allocations
+static bool Run(const char * name, PathFn * fn, int ops) {
+    BenchAllocStats Start, End;
+    int Fails = 0;
+
+    for( int i = 0; i < WarmupOps; i++ ) fn(i);
+    Start = BenchGetAllocs();
+    for( int i = 0; i < ops; i++ ) {
+        if( !fn(i) ) Fails++;
+    }
+    End = BenchGetAllocs();
+    printf("%-14s %8d %12.3f %12.3f %8d  %s\n", name, ops, (double)(End.Allocs - Start.Allocs) / ops,
+           (double)(End.Bytes - Start.Bytes) / ops, Fails, (End.Allocs == Start.Allocs) ? "ok" : "ALLOCATES");
+    return End.Allocs == Start.Allocs;
+}
+
+int main(int argc, char ** argv) {
+    int Ops = BenchArg(argc, argv, 1, 1000);
+    bool res = true;
+
+    if( Ops <= 0 ) return 1;
+    NecSize = TiqiaaUsbIr::WriteIrNecSignal(0x8002, NecBuf);
+    Emu.AirtimeScale = 0;
+    Ir.IrRecvCallback = RecvCallback;
+    if( !Ir.Open(&Emu) ) {
+        printf("could not open emulated device\n");
+        return 1;
+    }
+
+    printf("%-14s %8s %12s %12s %8s\n", "path", "ops", "allocs/op", "bytes/op", "failed");
+    res = Run("encode", PathEncode, Ops) && res;
+    res = Run("driver encode", PathDriverEncode, Ops) && res;
+    NecSize = TiqiaaUsbIr::WriteIrNecSignal(0x8002, NecBuf);
+    res = Run("build packet", PathBuildPacket, Ops) && res;
+    res = Run("reassemble", PathReassemble, Ops) && res;
+    res = Run("decode", PathDecode, Ops) && res;
+    res = Run("send", PathSend, Ops) && res;
+    res = Run("receive", PathReceive, Ops) && res;
+    Ir.Close();
+    return res ? 0 : 1;
+}
@@ -0,0 +1,87 @@
+/*
+ * SendNecSignal per code vs one SendIRBatch for a macro, and a held button sent
+ * as full frames vs SendNecHold, on the emulated device
+ *
+ * Usage: batch_bench [repeats] [airtime_scale_permille] [reply_latency_us] [write_latency_us]
+ */
+
+#include <stdio.h>
+
+#include "BenchUtil.h"
+#include "TiqiaaUsb.h"
+#include "TiqiaaEmu.h"
+
+// power on, input 2, volume down x5
+static const uint16_t Macro[] = {0x8002, 0x8004, 0x8010, 0x8010, 0x8010, 0x8010, 0x8010};
+static const int MacroSize = sizeof(Macro) / sizeof(Macro[0]);
+// NEC frames already end with a 40.5 ms space, same airtime as separate sends
+static const uint32_t MacroGap = 0;
+static const uint32_t HoldMs = 1000;
+
+int main(int argc, char ** argv) {
+    int Repeats = BenchArg(argc, argv, 1, 10);
+    TiqiaaUsbIrEmulator Emu;
+    TiqiaaUsbIr Ir;
+    uint8_t Bufs[MacroSize][128];
+    TiqiaaUsbIr_IrFrame Frames[MacroSize];
+    uint64_t SingleNs = 0;
+    uint64_t BatchNs = 0;
+    uint64_t FullNs = 0;
+    uint64_t HoldNs = 0;
+    TiqiaaUsbIr_OpStats FullStats, HoldStats;
+    int Fails = 0;
+
+    Emu.AirtimeScale = BenchArg(argc, argv, 2, 100) / 1000.0;
+    Emu.ReplyLatency = BenchArg(argc, argv, 3, 1000);
+    Emu.FragmWriteLatency = BenchArg(argc, argv, 4, 125);
+    for( int i = 0; i < MacroSize; i++ ) {
+        Frames[i].Data = Bufs[i];
+        Frames[i].Size = TiqiaaUsbIr::WriteIrNecSignal(Macro[i], Bufs[i]);
+        Frames[i].Gap = MacroGap;
+    }
+    if( !Ir.Open(&Emu) ) {
+        printf("could not open emulator\n");
+        return 1;
+    }
+
+    for( int r = 0; r < Repeats; r++ ) {
+        uint64_t start = BenchNowNs();
+        for( int i = 0; i < MacroSize; i++ ) {
+            if( !Ir.SendNecSignal(Macro[i]) ) Fails++;
+        }
+        SingleNs += BenchNowNs() - start;
+
+        start = BenchNowNs();
+        if( !Ir.SendIRBatch(38000, Frames, MacroSize) ) Fails++;
+        BatchNs += BenchNowNs() - start;
+    }
+
+    // full frames take 108.5 ms each, as many as fit into the hold time
+    Ir.ResetOpStats();
+    for( int r = 0; r < Repeats; r++ ) {
+        uint64_t start = BenchNowNs();
+        for( uint32_t t = 0; t < HoldMs; t += 108 ) {
+            if( !Ir.SendNecSignal(0x8010) ) Fails++;
+        }
+        FullNs += BenchNowNs() - start;
+    }
+    Ir.GetOpStats(TiqiaaUsbIr::OpSendIR, &FullStats);
+    for( int r = 0; r < Repeats; r++ ) {
+        uint64_t start = BenchNowNs();
+        if( !Ir.SendNecHold(0x8010, HoldMs) ) Fails++;
+        HoldNs += BenchNowNs() - start;
+    }
+    Ir.GetOpStats(TiqiaaUsbIr::OpSendIRBatch, &HoldStats);
+    Ir.Close();
+
+    printf("macro of %d codes, %d repeats, airtime scale %.3f, reply latency %d us\n",
+           MacroSize, Repeats, Emu.AirtimeScale, Emu.ReplyLatency);
+    printf("SendNecSignal x%d: %.2f ms per macro\n", MacroSize, SingleNs / 1e6 / Repeats);
+    printf("SendIRBatch:      %.2f ms per macro\n", BatchNs / 1e6 / Repeats);
+    printf("hold %u ms, SendNecSignal: %.2f ms, %.1f packets\n", HoldMs, FullNs / 1e6 / Repeats,
+           (double)FullStats.Packets / Repeats);
+    printf("hold %u ms, SendNecHold:   %.2f ms, %.1f packets\n", HoldMs, HoldNs / 1e6 / Repeats,
+           (double)HoldStats.Packets / Repeats);
+    printf("failures:         %d\n", Fails);
+    return Fails ? 1 : 0;
+}
@@ -0,0 +1,110 @@
+/*
+ * Joining and splitting of captured signals, on the emulated device
+ *
+ * Usage: capture_bench [reply_latency_us]
+ *
+ * The driver joins CmdData packets on the assumption that the device sends
+ * full TiqiaaUsbIr_MaxRecvDataSize packets while a signal goes on and a
+ * shorter packet at its end. The emulator splits a capture the same way.
+ * Checks, with the default CaptureIdleGap:
+ * - one capture split across 3 packets is delivered as one signal;
+ * - two NEC frames captured back to back are delivered as two signals;
+ * - a capture ending exactly at a full packet is delivered after the gap.
+ * Prints the delivery latency of every case. Exits with 1 on a failed check.
+ */
+
+#include <stdio.h>
+
+#include "BenchUtil.h"
+#include "TiqiaaUsb.h"
+#include "TiqiaaEmu.h"
+#include "ctqirsignal.h"
+
+static const int MaxSignals = 8;
+static const int SplitSize = 2 * TiqiaaUsbIr_MaxRecvDataSize + TiqiaaUsbIr_MaxRecvDataSize / 2;
+
+static volatile int SignalCount;
+static int SignalSizes[MaxSignals];
+static uint16_t SignalCodes[MaxSignals];
+static uint64_t SignalNs[MaxSignals];
+
+static void RecvCallback(uint8_t * data, int size, TiqiaaUsbIr * /*IrCls*/, void * /*context*/) {
+    CTqIrSignal Sig;
+    uint16_t Code = 0;
+    uint32_t RawCode;
+    int n = SignalCount;
+
+    if( n >= MaxSignals ) return;
+    if( !Sig.FromTiqiaa(data, size) || !Sig.DecodeIrNecSignal(&Code, &RawCode) ) Code = 0;
+    SignalSizes[n] = size;
+    SignalCodes[n] = Code;
+    SignalNs[n] = BenchNowNs();
+    __atomic_store_n(&SignalCount, n + 1, __ATOMIC_RELEASE);
+}
+
+// Short marks and spaces, starts and ends with a mark
+static void FillPulses(uint8_t * buf, int size) {
+    for( int i = 0; i < size; i++ ) buf[i] = (i & 1) ? 0x20 : 0xA0;
+    buf[size - 1] = 0xA0;
+}
+
+// Inject signal and wait for expected signals or 1 s
+// Return: latency of the last delivered signal, ms
+static double Capture(TiqiaaUsbIr * Ir, TiqiaaUsbIrEmulator * Emu, const uint8_t * data, int size, int expected) {
+    uint64_t StartNs, Deadline;
+
+    SignalCount = 0;
+    if( !Ir->StartRecvIR() ) return -1;
+    StartNs = BenchNowNs();
+    if( !Emu->InjectIrSignal(data, size) ) return -1;
+    Deadline = StartNs + 1000000000ull;
+    while( (__atomic_load_n(&SignalCount, __ATOMIC_ACQUIRE) < expected) && (BenchNowNs() < Deadline) ) {}
+    // a signal delivered past the expected count is a failure too
+    while( BenchNowNs() < StartNs + 200000000ull ) {}
+    if( SignalCount == 0 ) return -1;
+    return (SignalNs[SignalCount - 1] - StartNs) / 1e6;
+}
+
+static bool Check(const char * name, bool ok, double latencyMs) {
+    printf("%-24s %8.2f ms  %s\n", name, latencyMs, ok ? "ok" : "FAILED");
+    return ok;
+}
+
+int main(int argc, char ** argv) {
+    TiqiaaUsbIrEmulator Emu;
+    TiqiaaUsbIr Ir;
+    uint8_t Buf[TiqiaaUsbIrEmulator::MaxCaptureSize];
+    int Size;
+    double Ms;
+    bool res = true;
+
+    Emu.ReplyLatency = BenchArg(argc, argv, 1, 1000);
+    Ir.IrRecvCallback = RecvCallback;
+    if( !Ir.Open(&Emu) ) {
+        printf("could not open emulator\n");
+        return 1;
+    }
+    printf("CaptureIdleGap %u ms, packet %d bytes, reply latency %d us\n", Ir.CaptureIdleGap,
+           TiqiaaUsbIr_MaxRecvDataSize, Emu.ReplyLatency);
+
+    FillPulses(Buf, SplitSize);
+    Ms = Capture(&Ir, &Emu, Buf, SplitSize, 1);
+    res = Check("split across 3 packets", (SignalCount == 1) && (SignalSizes[0] == SplitSize), Ms) && res;
+
+    Size = TiqiaaUsbIr::WriteIrNecSignal(0x8002, Buf);
+    Size += TiqiaaUsbIr::WriteIrNecSignal(0x8004, Buf + Size);
+    Ms = Capture(&Ir, &Emu, Buf, Size, 2);
+    res = Check("two frames back to back", (SignalCount == 2) && (SignalCodes[0] == 0x8002) && (SignalCodes[1] == 0x8004), Ms) && res;
+
+    FillPulses(Buf, TiqiaaUsbIr_MaxRecvDataSize);
+    Ms = Capture(&Ir, &Emu, Buf, TiqiaaUsbIr_MaxRecvDataSize, 1);
+    res = Check("ends at a full packet", (SignalCount == 1) && (SignalSizes[0] == TiqiaaUsbIr_MaxRecvDataSize), Ms) && res;
+
+    Ir.CaptureIdleGap = 0;
+    FillPulses(Buf, SplitSize);
+    Ms = Capture(&Ir, &Emu, Buf, SplitSize, 3);
+    res = Check("split, CaptureIdleGap 0", SignalCount == 3, Ms) && res;
+
+    Ir.Close();
+    return res ? 0 : 1;
+}
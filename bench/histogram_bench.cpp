@@ -0,0 +1,116 @@
+/*
+ * Cost and accuracy of TiqiaaUsbIrHistogram, and the driver histograms on
+ * the emulated device
+ *
+ * Usage: histogram_bench [records] [threads] [ops] [reply_jitter_us]
+ *
+ * Recording cost is measured on one thread and on several threads sharing
+ * one histogram. Percentiles are compared with exact ones of the same
+ * fixed-seed samples, spread over 1 us .. 1 s.
+ */
+
+#include <stdio.h>
+#include <pthread.h>
+#include <algorithm>
+#include <vector>
+
+#include "BenchUtil.h"
+#include "TiqiaaHistogram.h"
+#include "TiqiaaUsb.h"
+#include "TiqiaaEmu.h"
+
+struct RecordJob {
+    TiqiaaUsbIrHistogram * Hist;
+    const std::vector<uint64_t> * Values;
+};
+
+static void * RecordThread(void * arg) {
+    RecordJob * Job = (RecordJob *)arg;
+    for( size_t i = 0; i < Job->Values->size(); i++ ) Job->Hist->Record((*Job->Values)[i]);
+    return NULL;
+}
+
+// Return: record cost, nsec per value over all threads
+static double MeasureRecord(TiqiaaUsbIrHistogram * Hist, const std::vector<uint64_t> & Values, int Threads) {
+    std::vector<pthread_t> Ids(Threads);
+    RecordJob Job = {Hist, &Values};
+    uint64_t StartNs;
+
+    Hist->Reset();
+    StartNs = BenchNowNs();
+    for( int i = 0; i < Threads; i++ ) pthread_create(&Ids[i], NULL, RecordThread, &Job);
+    for( int i = 0; i < Threads; i++ ) pthread_join(Ids[i], NULL);
+    return (double)(BenchNowNs() - StartNs) / ((double)Values.size() * Threads);
+}
+
+static void PrintHist(const char * Name, const TiqiaaUsbIrHistogram * Hist) {
+    if( (Hist == NULL) || (Hist->GetCount() == 0) ) return;
+    printf("%-12s %8llu %8llu %8llu %8llu %8llu %8llu\n", Name, (unsigned long long)Hist->GetCount(),
+           (unsigned long long)Hist->GetMin(), (unsigned long long)Hist->GetPercentile(50),
+           (unsigned long long)Hist->GetPercentile(90), (unsigned long long)Hist->GetPercentile(99),
+           (unsigned long long)Hist->GetMax());
+}
+
+int main(int argc, char ** argv) {
+    int Records = BenchArg(argc, argv, 1, 1000000);
+    int Threads = BenchArg(argc, argv, 2, 4);
+    int Ops = BenchArg(argc, argv, 3, 50);
+    static const double Percentiles[] = {50, 90, 99, 99.9};
+    std::vector<uint64_t> Values;
+    std::vector<uint64_t> Sorted;
+    TiqiaaUsbIrHistogram Hist;
+    BenchRng Rng;
+    uint64_t Exact, Got;
+    double RecordNs;
+    double Err, MaxErr = 0;
+
+    if( (Records <= 0) || (Threads <= 0) ) return 1;
+    for( int i = 0; i < Records; i++ ) Values.push_back((uint64_t)1 << Rng.Range(0, 19) | (Rng.Next() & 0xFFFFF) >> Rng.Range(0, 20));
+
+    printf("record, 1 thread:   %.2f ns/value\n", MeasureRecord(&Hist, Values, 1));
+    RecordNs = MeasureRecord(&Hist, Values, Threads);
+    printf("record, %d threads: %.2f ns/value (wall), count %llu of %llu\n", Threads, RecordNs,
+           (unsigned long long)Hist.GetCount(), (unsigned long long)Values.size() * Threads);
+
+    Hist.Reset();
+    for( size_t i = 0; i < Values.size(); i++ ) Hist.Record(Values[i]);
+    Sorted = Values;
+    std::sort(Sorted.begin(), Sorted.end());
+    printf("percentile      exact     hist    error\n");
+    for( size_t i = 0; i < sizeof(Percentiles) / sizeof(Percentiles[0]); i++ ) {
+        size_t Idx = (size_t)(Percentiles[i] / 100.0 * Sorted.size() + 0.5);
+        if( Idx > 0 ) Idx--;
+        Exact = Sorted[Idx];
+        Got = Hist.GetPercentile(Percentiles[i]);
+        Err = Exact ? (double)((Got > Exact) ? Got - Exact : Exact - Got) / Exact : 0;
+        if( Err > MaxErr ) MaxErr = Err;
+        printf("p%-9g %10llu %8llu %7.2f%%\n", Percentiles[i], (unsigned long long)Exact, (unsigned long long)Got, Err * 100);
+    }
+    printf("max error %.2f%%, bound %.2f%%\n", MaxErr * 100, 100.0 / 16);
+
+    // driver histograms, NEC frames with jittered replies on the emulated device
+    TiqiaaUsbIrEmulator Emu;
+    TiqiaaUsbIr Ir;
+
+    Emu.AirtimeScale = 0;
+    Emu.ReplyLatency = 1000;
+    Emu.ReplyJitter = BenchArg(argc, argv, 4, 500);
+    if( !Ir.Open(&Emu) ) {
+        printf("could not open emulated device\n");
+        return 1;
+    }
+    for( int i = 0; i < Ops; i++ ) {
+        Ir.SendNecSignal(0x8002);
+        if( (i % 10) == 9 ) Ir.SetIdleMode();
+    }
+    printf("\n%d NEC frames, reply latency %d us, jitter %d us\n", Ops, Emu.ReplyLatency, Emu.ReplyJitter);
+    printf("latency, us     count      min      p50      p90      p99      max\n");
+    PrintHist("SendMode", Ir.GetCmdLatency(TiqiaaUsbIr_CmdSendMode));
+    PrintHist("IdleMode", Ir.GetCmdLatency(TiqiaaUsbIr_CmdIdleMode));
+    PrintHist("Data", Ir.GetCmdLatency(TiqiaaUsbIr_CmdData));
+    PrintHist("FragmWrite", Ir.GetFragmWriteLatency());
+    PrintHist("ReplyWait", Ir.GetReplyWaitLatency());
+    PrintHist("ModeSwitch", Ir.GetModeSwitchLatency());
+    Ir.Close();
+    return 0;
+}
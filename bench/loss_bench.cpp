@@ -0,0 +1,80 @@
+/*
+ * Operation latency under simulated reply loss on the emulated device
+ *
+ * Usage: loss_bench [ops] [loss_permille] [reply_latency_us] [reply_jitter_us]
+ *
+ * Runs the same seeded workload twice: with fixed timeouts and without
+ * probing/retries, and with the driver defaults (adaptive timeouts, probing).
+ * A short raw signal is sent instead of a NEC frame, the driver waits for the
+ * computed airtime of the signal and the emulator plays instantly.
+ */
+
+#include <stdio.h>
+#include <algorithm>
+#include <vector>
+
+#include "BenchUtil.h"
+#include "TiqiaaUsb.h"
+#include "TiqiaaEmu.h"
+
+static void PrintRtt(TiqiaaUsbIr * Ir) {
+    static const uint8_t Cmds[] = {'V', 'L', 'S', 'R', 'O', 'C', 'H'};
+    TiqiaaUsbIr_RttStats Rtt;
+
+    printf("  cmd  samples   last ms   max ms   srtt ms   var ms   rto ms  timeouts\n");
+    for( size_t i = 0; i < sizeof(Cmds); i++ ) {
+        if( !Ir->GetRttStats(Cmds[i], &Rtt) || (Rtt.Samples + Rtt.Timeouts == 0) ) continue;
+        printf("  %c   %8u  %8.2f %8.2f  %8.2f %8.2f %8.2f  %8u\n", Cmds[i], Rtt.Samples, Rtt.LastUs / 1e3, Rtt.MaxUs / 1e3,
+               Rtt.SrttUs / 1e3, Rtt.RttVarUs / 1e3, Rtt.RtoUs / 1e3, Rtt.Timeouts);
+    }
+}
+
+static void Run(const char * Name, int Ops, int LossPm, int Latency, int Jitter, bool Adaptive, int Retries) {
+    TiqiaaUsbIrEmulator Emu;
+    TiqiaaUsbIr Ir;
+    TiqiaaUsbIrEmulator_Stats EmuStats;
+    std::vector<uint64_t> Lat;
+    uint8_t Signal[16];
+    int Fails = 0;
+
+    for( int i = 0; i < (int)sizeof(Signal); i++ ) Signal[i] = (i & 1) ? 20 : (0x80 | 20); // 5 ms
+
+    Emu.AirtimeScale = 0;
+    Emu.ReplyLatency = Latency;
+    Emu.ReplyJitter = Jitter;
+    Ir.AdaptiveTimeouts = Adaptive;
+    Ir.MaxCmdRetries = Retries;
+    Ir.FlightDumpFd = -1; // timeouts are expected here
+    if( !Ir.Open(&Emu) ) {
+        printf("%s: could not open emulator\n", Name);
+        return;
+    }
+    Emu.ReplyLossPermille = LossPm;
+    Lat.reserve(Ops);
+    for( int i = 0; i < Ops; i++ ) {
+        uint64_t start = BenchNowNs();
+        bool ok = (i % 4 == 3) ? Ir.StartRecvIR() : Ir.SendIR(38000, Signal, sizeof(Signal));
+        Lat.push_back(BenchNowNs() - start);
+        if( !ok ) Fails++;
+    }
+    Emu.GetStats(&EmuStats);
+    Emu.ReplyLossPermille = 0;
+    Ir.Close();
+
+    std::sort(Lat.begin(), Lat.end());
+    printf("%-16s ops %d, replies lost %u, failures %d, p50 %.2f ms, p99 %.2f ms, max %.2f ms\n",
+           Name, Ops, EmuStats.RepliesLost, Fails, Lat[Ops / 2] / 1e6, Lat[Ops * 99 / 100] / 1e6, Lat[Ops - 1] / 1e6);
+    if( Adaptive ) PrintRtt(&Ir);
+}
+
+int main(int argc, char ** argv) {
+    int Ops = BenchArg(argc, argv, 1, 500);
+    int LossPm = BenchArg(argc, argv, 2, 10);
+    int Latency = BenchArg(argc, argv, 3, 1000);
+    int Jitter = BenchArg(argc, argv, 4, 500);
+
+    if( Ops <= 0 ) return 1;
+    Run("fixed timeouts:", Ops, LossPm, Latency, Jitter, false, 0);
+    Run("adaptive:", Ops, LossPm, Latency, Jitter, true, 3);
+    return 0;
+}
@@ -0,0 +1,169 @@
+/*
+ * Micro-benchmarks of the signal encoders, decoders, conversions and packet
+ * build / reassembly
+ *
+ * Usage: micro_bench [min_ms] [filter]
+ *
+ * Every benchmark runs over the same fixed-seed inputs and doubles its op
+ * count until it runs for min_ms (default 200). Only benchmarks whose name
+ * contains filter are run. Prints JSON:
+ *
+ * {"benchmarks": [
+ *   {"name": "...", "ops": N, "ns_per_op": x, "bytes_per_op": y, "allocs_per_op": z},
+ *   ...
+ * ]}
+ *
+ * bytes_per_op and allocs_per_op count heap allocations made by the op.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#include "BenchUtil.h"
+#include "BenchAlloc.h"
+#include "TiqiaaUsb.h"
+#include "TiqiaaPacketBuilder.h"
+#include "TiqiaaReassembler.h"
+#include "ctqirsignal.h"
+
+static const int InputCount = 1024;
+static const int MaxNecSize = 128;
+
+typedef void BenchFn(int i);
+
+static uint16_t Codes[InputCount];
+static std::vector<uint8_t> TiqiaaInputs[InputCount];
+static std::vector<uint32_t> LircInputs[InputCount];
+static TiqiaaUsbIrPacketBuilder Packets[InputCount]; // fragments for the reassembler
+static TiqiaaUsbIrPacketBuilder Builder;
+static CTqIrSignal Signals[InputCount]; // decoded from TiqiaaInputs
+static CTqIrSignal Sig;
+static TiqiaaUsbIrReassembler Reasm(TiqiaaUsbIr_WriteReportId);
+static uint8_t OutBuf[MaxNecSize];
+static uint32_t LircBuf[MaxNecSize];
+static volatile uint32_t Sink;
+
+static void BenchUsbWriteNec(int i) {
+    Sink = TiqiaaUsbIr::WriteIrNecSignal(Codes[i], OutBuf);
+}
+
+static void BenchSignalWriteNecToTiqiaa(int i) {
+    Sig.WriteIrNecSignal(Codes[i]);
+    Sink = Sig.ToTiqiaa().size();
+}
+
+static void BenchSignalWriteNecToTiqiaaBuf(int i) {
+    Sig.WriteIrNecSignal(Codes[i]);
+    Sink = Sig.ToTiqiaa(OutBuf, sizeof(OutBuf));
+}
+
+static void BenchFromTiqiaa(int i) {
+    Sink = Sig.FromTiqiaa(TiqiaaInputs[i].data(), TiqiaaInputs[i].size());
+}
+
+static void BenchFromTiqiaaVector(int i) {
+    Sink = Sig.FromTiqiaa(TiqiaaInputs[i]);
+}
+
+static void BenchFromLirc(int i) {
+    Sink = Sig.FromLirc(LircInputs[i].data(), LircInputs[i].size());
+}
+
+static void BenchToLirc(int i) {
+    Sink = Signals[i].ToLirc().size();
+}
+
+static void BenchToLircBuf(int i) {
+    Sink = Signals[i].ToLirc(LircBuf, MaxNecSize);
+}
+
+static void BenchDecodeNec(int i) {
+    uint16_t Code;
+    uint32_t RawCode;
+
+    Sink = Signals[i].DecodeIrNecSignal(&Code, &RawCode) ? Code : 0;
+}
+
+static void BenchBuildIR(int i) {
+    TiqiaaUsbIr_IrSegment Seg = {TiqiaaInputs[i].data(), (int)TiqiaaInputs[i].size()};
+
+    Sink = Builder.BuildIR(TiqiaaUsbIr::GetIrFreqId(38000), &Seg, 1, i & 0x7F);
+}
+
+static void BenchReassemble(int i) {
+    TiqiaaUsbIrPacketBuilder * Pack = &Packets[i];
+    int res = 0;
+
+    for( int f = 0; f < Pack->GetFragmCount(); f++ ) res = Reasm.PushFragment(Pack->GetFragm(f), Pack->GetFragmSize(f));
+    Sink = res;
+}
+
+static void Prepare() {
+    BenchRng rng;
+    TiqiaaUsbIr_IrSegment Seg;
+
+    for( int i = 0; i < InputCount; i++ ) {
+        Codes[i] = rng.Next();
+        Sig.WriteIrNecSignal(Codes[i]);
+        TiqiaaInputs[i] = Sig.ToTiqiaa();
+        LircInputs[i] = Sig.ToLirc();
+        Signals[i].FromTiqiaa(TiqiaaInputs[i].data(), TiqiaaInputs[i].size());
+        Seg.Data = TiqiaaInputs[i].data();
+        Seg.Size = TiqiaaInputs[i].size();
+        Packets[i].BuildIR(TiqiaaUsbIr::GetIrFreqId(38000), &Seg, 1, i & 0x7F);
+        Packets[i].SetPacketIdx((i % 15) + 1);
+    }
+}
+
+static void Run(const char * name, BenchFn * fn, uint64_t minNs, bool * first) {
+    BenchAllocStats StartAllocs, EndAllocs;
+    uint64_t StartNs, ElapsedNs;
+    long Ops = InputCount;
+
+    for( int i = 0; i < InputCount; i++ ) fn(i); // warm up, first-use allocations are not counted
+    while( true ) {
+        StartAllocs = BenchGetAllocs();
+        StartNs = BenchNowNs();
+        for( long i = 0; i < Ops; i++ ) fn(i % InputCount);
+        ElapsedNs = BenchNowNs() - StartNs;
+        EndAllocs = BenchGetAllocs();
+        if( ElapsedNs >= minNs ) break;
+        Ops *= 2;
+    }
+    printf("%s  {\"name\": \"%s\", \"ops\": %ld, \"ns_per_op\": %.2f, \"bytes_per_op\": %.2f, \"allocs_per_op\": %.2f}",
+           *first ? "" : ",\n", name, Ops, (double)ElapsedNs / Ops,
+           (double)(EndAllocs.Bytes - StartAllocs.Bytes) / Ops, (double)(EndAllocs.Allocs - StartAllocs.Allocs) / Ops);
+    *first = false;
+    fflush(stdout);
+}
+
+int main(int argc, char ** argv) {
+    static const struct {
+        const char * Name;
+        BenchFn * Fn;
+    } Benchmarks[] = {
+        {"TiqiaaUsbIr::WriteIrNecSignal", BenchUsbWriteNec},
+        {"CTqIrSignal::WriteIrNecSignal+ToTiqiaa", BenchSignalWriteNecToTiqiaa},
+        {"CTqIrSignal::WriteIrNecSignal+ToTiqiaa(buf)", BenchSignalWriteNecToTiqiaaBuf},
+        {"CTqIrSignal::FromTiqiaa", BenchFromTiqiaa},
+        {"CTqIrSignal::FromTiqiaa(vector)", BenchFromTiqiaaVector},
+        {"CTqIrSignal::FromLirc", BenchFromLirc},
+        {"CTqIrSignal::ToLirc", BenchToLirc},
+        {"CTqIrSignal::ToLirc(buf)", BenchToLircBuf},
+        {"CTqIrSignal::DecodeIrNecSignal", BenchDecodeNec},
+        {"TiqiaaUsbIrPacketBuilder::BuildIR", BenchBuildIR},
+        {"TiqiaaUsbIrReassembler::PushFragment(packet)", BenchReassemble},
+    };
+    uint64_t MinNs = BenchArg(argc, argv, 1, 200) * 1000000ull;
+    const char * Filter = (argc > 2) ? argv[2] : "";
+    bool First = true;
+
+    Prepare();
+    printf("{\"benchmarks\": [\n");
+    for( const auto & b : Benchmarks ) {
+        if( strstr(b.Name, Filter) ) Run(b.Name, b.Fn, MinNs, &First);
+    }
+    printf("\n]}\n");
+    return 0;
+}
@@ -0,0 +1,60 @@
+/*
+ * Round trips and time of alternating send/receive on the emulated device
+ *
+ * Usage: mode_bench [cycles] [reply_latency_us] [write_latency_us]
+ */
+
+#include <stdio.h>
+
+#include "BenchUtil.h"
+#include "TiqiaaUsb.h"
+#include "TiqiaaEmu.h"
+
+static volatile bool Received;
+
+static void RecvCallback(uint8_t * /*data*/, int /*size*/, TiqiaaUsbIr * /*IrCls*/, void * /*context*/) {
+    Received = true;
+}
+
+int main(int argc, char ** argv) {
+    int Cycles = BenchArg(argc, argv, 1, 50);
+    TiqiaaUsbIrEmulator Emu;
+    TiqiaaUsbIr Ir;
+    TiqiaaUsbIr_OpStats Stats;
+    uint8_t Frame[128];
+    int FrameSize = TiqiaaUsbIr::WriteIrNecSignal(0x8002, Frame);
+    int Fails = 0;
+
+    Emu.AirtimeScale = 0;
+    Emu.ReplyLatency = BenchArg(argc, argv, 2, 1000);
+    Emu.FragmWriteLatency = BenchArg(argc, argv, 3, 125);
+    Ir.IrRecvCallback = RecvCallback;
+    if( !Ir.Open(&Emu) ) {
+        printf("could not open emulator\n");
+        return 1;
+    }
+
+    uint64_t start = BenchNowNs();
+    for( int i = 0; i < Cycles; i++ ) {
+        if( !Ir.SendNecSignal(0x8004) ) Fails++;
+        Received = false;
+        if( !Ir.StartRecvIR() ) Fails++;
+        Emu.InjectIrSignal(Frame, FrameSize);
+        uint64_t deadline = BenchNowNs() + 1000000000ull;
+        while( !Received && (BenchNowNs() < deadline) ) {}
+        if( !Received ) Fails++;
+    }
+    uint64_t elapsed = BenchNowNs() - start;
+    Ir.Close();
+
+    printf("%d send/receive cycles, reply latency %d us: %.2f ms per cycle, %d failures\n",
+           Cycles, Emu.ReplyLatency, elapsed / 1e6 / Cycles, Fails);
+    printf("%-14s %8s %12s %12s %10s\n", "op", "count", "packets/op", "rtrips/op", "elided");
+    for( int op = 0; op < TiqiaaUsbIr::OpCount; op++ ) {
+        Ir.GetOpStats(op, &Stats);
+        if( Stats.Count == 0 ) continue;
+        printf("%-14s %8u %12.2f %12.2f %10u\n", TiqiaaUsbIr::GetOpName(op), Stats.Count,
+               (double)Stats.Packets / Stats.Count, (double)Stats.RoundTrips / Stats.Count, Stats.ElidedSwitches);
+    }
+    return Fails ? 1 : 0;
+}
@@ -0,0 +1,96 @@
+/*
+ * NEC encoders: per-pulse loop, table-driven and compile-time frames
+ *
+ * Usage: necframe_bench [ops]
+ *
+ * Checks at compile time that TiqiaaNecFrame<0x8002> matches a recorded
+ * frame. Checks that the table-driven TiqiaaUsbIr::WriteIrNecSignal produces
+ * the bytes of TiqiaaNecFrame<code> for a few codes and of the per-pulse
+ * loop TiqiaaNecFrame_Encode (both are built with TiqiaaNecFrame_WritePulse)
+ * for all 65536 codes, then compares the cost of the loop, the tables and
+ * copying a TiqiaaNecFrame<> array. Exits with 1 on a mismatch.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "BenchUtil.h"
+#include "TiqiaaUsb.h"
+#include "TiqiaaNecFrame.h"
+
+static const int MaxNecSize = 128;
+
+static volatile uint32_t Sink;
+
+// WriteIrNecSignal(0x8002) output, pins the pulse timing of TiqiaaNecFrame_WritePulse
+static constexpr uint8_t NecFrame8002[] = {
+    0xFF, 0xFF, 0xFF, 0xFF, 0xB6, 0x7F, 0x7F, 0x1B, 0xA3, 0x24, 0xA3, 0x23, 0xA3, 0x23, 0xA3, 0x24,
+    0xA3, 0x23, 0xA3, 0x23, 0xA3, 0x23, 0xA4, 0x69, 0xA3, 0x6A, 0xA3, 0x69, 0xA3, 0x6A, 0xA3, 0x6A,
+    0xA3, 0x69, 0xA3, 0x6A, 0xA3, 0x69, 0xA4, 0x23, 0xA3, 0x23, 0xA3, 0x6A, 0xA3, 0x23, 0xA3, 0x23,
+    0xA3, 0x24, 0xA3, 0x23, 0xA3, 0x23, 0xA3, 0x24, 0xA3, 0x69, 0xA3, 0x24, 0xA3, 0x69, 0xA3, 0x6A,
+    0xA3, 0x69, 0xA4, 0x69, 0xA3, 0x6A, 0xA3, 0x69, 0xA3, 0x7F, 0x7F, 0x7F, 0x7F, 0x7F, 0x7F, 0x7F,
+    0x7F, 0x7F, 0x7F, 0x7F, 0x7F, 0x7F, 0x7F, 0x7F, 0x7F, 0x7F, 0x7F, 0x7F, 0x77
+};
+static_assert(TiqiaaNecFrame_Equal(TiqiaaNecFrame<0x8002>::Frame, NecFrame8002, sizeof(NecFrame8002)),
+              "TiqiaaNecFrame differs from WriteIrNecSignal");
+static_assert(TiqiaaNecFrame<0x8004>::Size == TiqiaaNecFrame_MaxSize, "NEC frame size is fixed");
+
+// Return: 1 - TiqiaaNecFrame<IrCode> differs from WriteIrNecSignal(IrCode), 0 - equal
+template<uint16_t IrCode> static int CheckFrame() {
+    uint8_t Buf[MaxNecSize];
+    int Size = TiqiaaUsbIr::WriteIrNecSignal(IrCode, Buf);
+
+    if( TiqiaaNecFrame_Equal(TiqiaaNecFrame<IrCode>::Frame, Buf, Size) ) return 0;
+    printf("TiqiaaNecFrame<0x%04X> differs from WriteIrNecSignal\n", IrCode);
+    return 1;
+}
+
+int main(int argc, char ** argv) {
+    int Ops = BenchArg(argc, argv, 1, 10000000);
+    uint8_t Buf[MaxNecSize];
+    TiqiaaNecFrame_Data Frame;
+    uint64_t StartNs;
+    double LoopNs, EncodeNs, CopyNs;
+    int Size;
+    int Mismatches = 0;
+    int FrameMismatches;
+
+    if( Ops <= 0 ) return 1;
+    FrameMismatches = CheckFrame<0x0000>() + CheckFrame<0x8002>() + CheckFrame<0x8004>() +
+                      CheckFrame<0x00FF>() + CheckFrame<0x1234>() + CheckFrame<0xFFFF>();
+    printf("TiqiaaNecFrame<code> vs WriteIrNecSignal: %d mismatches\n", FrameMismatches);
+    for( int Code = 0; Code <= 0xFFFF; Code++ ) {
+        Size = TiqiaaUsbIr::WriteIrNecSignal(Code, Buf);
+        Frame = TiqiaaNecFrame_Encode(Code);
+        if( !TiqiaaNecFrame_Equal(Frame, Buf, Size) ) {
+            if( Mismatches == 0 ) printf("code 0x%04X differs from WriteIrNecSignal\n", Code);
+            Mismatches++;
+        }
+    }
+    printf("65536 codes: %d mismatches\n", Mismatches);
+
+    StartNs = BenchNowNs();
+    for( int i = 0; i < Ops; i++ ) {
+        Frame = TiqiaaNecFrame_Encode(0x8002 + 2 * (i % 3));
+        Sink = Frame.Data[i % TiqiaaNecFrame_MaxSize];
+    }
+    LoopNs = (double)(BenchNowNs() - StartNs) / Ops;
+
+    StartNs = BenchNowNs();
+    for( int i = 0; i < Ops; i++ ) Sink = TiqiaaUsbIr::WriteIrNecSignal(0x8002 + 2 * (i % 3), Buf);
+    EncodeNs = (double)(BenchNowNs() - StartNs) / Ops;
+
+    StartNs = BenchNowNs();
+    for( int i = 0; i < Ops; i++ ) {
+        switch( i % 3 ) {
+            case 0: memcpy(Buf, TiqiaaNecFrame<0x8002>::Data, TiqiaaNecFrame<0x8002>::Size); break;
+            case 1: memcpy(Buf, TiqiaaNecFrame<0x8004>::Data, TiqiaaNecFrame<0x8004>::Size); break;
+            default: memcpy(Buf, TiqiaaNecFrame<0x8006>::Data, TiqiaaNecFrame<0x8006>::Size); break;
+        }
+        Sink = Buf[i % TiqiaaNecFrame_MaxSize];
+    }
+    CopyNs = (double)(BenchNowNs() - StartNs) / Ops;
+    printf("pulse loop: %.2f ns, WriteIrNecSignal tables: %.2f ns (%.1fx), TiqiaaNecFrame copy: %.2f ns\n",
+           LoopNs, EncodeNs, LoopNs / EncodeNs, CopyNs);
+    return (Mismatches || FrameMismatches) ? 1 : 0;
+}
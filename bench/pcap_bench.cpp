@@ -0,0 +1,77 @@
+/*
+ * Cost of usbmon pcap capture on the USB threads
+ *
+ * Usage: pcap_bench [ops] [pcap_file]
+ *
+ * Measures AddBulk on the calling thread while the writer thread writes the
+ * file, then the driver write path on the emulated device without and with
+ * capture. The emulated device takes fragments at full speed USB pace, a
+ * producer outrunning the writer only adds to the dropped count. The capture is written to pcap_file, default /tmp/pcap_bench.pcap.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+
+#include "BenchUtil.h"
+#include "TiqiaaPcap.h"
+#include "TiqiaaUsb.h"
+#include "TiqiaaEmu.h"
+
+// Return: nsec per fire-and-forget command, reply wait excluded
+static double MeasureSendCmd(TiqiaaUsbIr * Ir, int Ops) {
+    uint64_t StartNs = BenchNowNs();
+
+    for( int i = 0; i < Ops; i++ ) Ir->SendCmd(TiqiaaUsbIr_CmdUnknown, Ir->GetCmdId());
+    return (double)(BenchNowNs() - StartNs) / Ops;
+}
+
+int main(int argc, char ** argv) {
+    int Ops = BenchArg(argc, argv, 1, 10000);
+    const char * FileName = (argc > 2) ? argv[2] : "/tmp/pcap_bench.pcap";
+    uint8_t Fragm[TiqiaaUsbIr_MaxUsbReadSize];
+    TiqiaaUsbIrPcap Pcap;
+    TiqiaaUsbIrEmulator Emu;
+    TiqiaaUsbIr Ir;
+    uint64_t StartNs;
+    uint64_t AddNs = 0;
+    int Done = 0;
+    int Round;
+    double Plain, Captured;
+
+    if( Ops <= 0 ) return 1;
+    if( !Pcap.Open(FileName) ) {
+        printf("could not create %s\n", FileName);
+        return 1;
+    }
+    for( int i = 0; i < (int)sizeof(Fragm); i++ ) Fragm[i] = i;
+    // rounds of one queue, the writer drains the queue between rounds
+    while( Done < Ops ) {
+        Round = Ops - Done;
+        if( Round > TiqiaaUsbIrPcap::QueueSize ) Round = TiqiaaUsbIrPcap::QueueSize;
+        StartNs = BenchNowNs();
+        for( int i = 0; i < Round; i++ ) Pcap.AddBulk(Pcap.NewUrbId(), 'C', 1, 2, 0x81, Fragm, sizeof(Fragm), sizeof(Fragm), 0);
+        AddNs += BenchNowNs() - StartNs;
+        Done += Round;
+        while( Pcap.GetWritten() + Pcap.GetDropped() < (uint64_t)Done ) usleep(100);
+    }
+    printf("AddBulk: %.1f ns/record, dropped %llu of %d\n", (double)AddNs / Ops,
+           (unsigned long long)Pcap.GetDropped(), Ops);
+
+    // USB 1.1 full speed pace, a fragment per 125 usec
+    Emu.AirtimeScale = 0;
+    Emu.FragmWriteLatency = 125;
+    if( !Ir.Open(&Emu) ) {
+        printf("could not open emulated device\n");
+        return 1;
+    }
+    Plain = MeasureSendCmd(&Ir, Ops);
+    Ir.Pcap = &Pcap;
+    Captured = MeasureSendCmd(&Ir, Ops);
+    Ir.Close();
+    Ir.Pcap = NULL;
+    Pcap.Close();
+    printf("SendCmd: %.1f ns without capture, %.1f ns with capture\n", Plain, Captured);
+    printf("%llu records written to %s, dropped %llu\n", (unsigned long long)Pcap.GetWritten(), FileName,
+           (unsigned long long)Pcap.GetDropped());
+    return 0;
+}
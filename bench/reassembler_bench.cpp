@@ -0,0 +1,117 @@
+/*
+ * Throughput of TiqiaaUsbIrReassembler on a synthetic fragment stream
+ *
+ * Usage: reassembler_bench [fragments] [drop_permille] [dup_permille] [interleave_permille]
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "BenchUtil.h"
+#include "TiqiaaReassembler.h"
+
+static const int PoolSize = 1 << 16;
+static const int MaxFragmPayload = TiqiaaUsbIr_MaxUsbReadSize - sizeof(TiqiaaUsbIr_Report2Header);
+
+struct Fragm {
+    uint8_t Data[TiqiaaUsbIr_MaxUsbReadSize];
+    int Size;
+};
+
+static Fragm Pool[PoolSize];
+static int PoolLen;
+
+static void PutFragm(const uint8_t * pack, int packSize, uint8_t packetIdx, int fragmIdx) {
+    int fragmCount = (packSize + MaxFragmPayload - 1) / MaxFragmPayload;
+    int offs = (fragmIdx - 1) * MaxFragmPayload;
+    int size = packSize - offs;
+    if( size > MaxFragmPayload ) size = MaxFragmPayload;
+
+    if( PoolLen >= PoolSize ) return;
+    Fragm * f = &Pool[PoolLen++];
+    TiqiaaUsbIr_Report2Header * hdr = (TiqiaaUsbIr_Report2Header *)f->Data;
+    hdr->ReportId = TiqiaaUsbIr_ReadReportId;
+    hdr->FragmSize = size + 3;
+    hdr->PacketIdx = packetIdx;
+    hdr->FragmCount = fragmCount;
+    hdr->FragmIdx = fragmIdx;
+    memcpy(f->Data + sizeof(TiqiaaUsbIr_Report2Header), pack + offs, size);
+    f->Size = size + sizeof(TiqiaaUsbIr_Report2Header);
+}
+
+static int MakePacket(BenchRng * rng, uint8_t * pack) {
+    int size = rng->Range(7, TiqiaaUsbIr_MaxUsbPacketSize);
+    *(uint16_t *)pack = TiqiaaUsbIr_PackStartSign;
+    for( int i = 2; i < size - 2; i++ ) pack[i] = rng->Next();
+    *(uint16_t *)(pack + size - 2) = TiqiaaUsbIr_PackEndSign;
+    return size;
+}
+
+//! Fill Pool with fragments of random packets, randomly dropping, duplicating and
+//! interleaving fragments of another packet
+static int BuildPool(int dropPm, int dupPm, int interleavePm) {
+    BenchRng rng;
+    uint8_t pack[TiqiaaUsbIr_MaxUsbPacketSize];
+    uint8_t other[TiqiaaUsbIr_MaxUsbPacketSize];
+    uint8_t packetIdx = 0;
+    int packets = 0;
+
+    PoolLen = 0;
+    while( PoolLen < PoolSize ) {
+        int size = MakePacket(&rng, pack);
+        int fragmCount = (size + MaxFragmPayload - 1) / MaxFragmPayload;
+        packetIdx = (packetIdx % 15) + 1;
+        packets++;
+        for( int i = 1; i <= fragmCount; i++ ) {
+            if( rng.Chance(interleavePm) ) {
+                int otherSize = MakePacket(&rng, other);
+                PutFragm(other, otherSize, (packetIdx % 15) + 1, 1);
+            }
+            if( rng.Chance(dropPm) ) continue;
+            PutFragm(pack, size, packetIdx, i);
+            if( rng.Chance(dupPm) ) PutFragm(pack, size, packetIdx, i);
+        }
+    }
+    return packets;
+}
+
+int main(int argc, char ** argv) {
+    long total = BenchArg(argc, argv, 1, 10000000);
+    int dropPm = BenchArg(argc, argv, 2, 10);
+    int dupPm = BenchArg(argc, argv, 3, 10);
+    int interleavePm = BenchArg(argc, argv, 4, 10);
+    uint64_t results[TiqiaaUsbIrReassembler::PacketComplete + 1];
+    uint64_t bytes = 0;
+    uint64_t checksum = 0;
+    TiqiaaUsbIrReassembler Reasm;
+
+    int packets = BuildPool(dropPm, dupPm, interleavePm);
+    memset(results, 0, sizeof(results));
+
+    uint64_t start = BenchNowNs();
+    for( long n = 0; n < total; n++ ) {
+        const Fragm * f = &Pool[n & (PoolSize - 1)];
+        int res = Reasm.PushFragment(f->Data, f->Size);
+        results[res]++;
+        bytes += f->Size;
+        if( res == TiqiaaUsbIrReassembler::PacketComplete ) checksum += Reasm.GetPacketData()[0] + Reasm.GetPacketSize();
+    }
+    uint64_t elapsed = BenchNowNs() - start;
+
+    printf("fragments:      %ld (pool %d fragments / %d packets)\n", total, PoolSize, packets);
+    printf("drop/dup/intl:  %d/%d/%d permille\n", dropPm, dupPm, interleavePm);
+    printf("time:           %.3f ms\n", elapsed / 1e6);
+    printf("per fragment:   %.2f ns\n", (double)elapsed / total);
+    printf("throughput:     %.1f Mfragm/s, %.1f MB/s\n", total * 1e3 / elapsed, bytes * 1e3 / elapsed);
+    printf("complete:       %llu\n", (unsigned long long)results[TiqiaaUsbIrReassembler::PacketComplete]);
+    printf("accepted:       %llu\n", (unsigned long long)results[TiqiaaUsbIrReassembler::FragmAccepted]);
+    printf("restarted:      %llu\n", (unsigned long long)results[TiqiaaUsbIrReassembler::FragmRestarted]);
+    printf("out of order:   %llu\n", (unsigned long long)results[TiqiaaUsbIrReassembler::FragmOutOfOrder]);
+    printf("duplicate:      %llu\n", (unsigned long long)results[TiqiaaUsbIrReassembler::FragmDuplicate]);
+    printf("bad fragment:   %llu\n", (unsigned long long)results[TiqiaaUsbIrReassembler::FragmBad]);
+    printf("wrong report:   %llu\n", (unsigned long long)results[TiqiaaUsbIrReassembler::FragmWrongReport]);
+    printf("overflow:       %llu\n", (unsigned long long)results[TiqiaaUsbIrReassembler::PacketOverflow]);
+    printf("bad signature:  %llu\n", (unsigned long long)results[TiqiaaUsbIrReassembler::PacketBadSign]);
+    printf("checksum:       %llu\n", (unsigned long long)checksum);
+    return 0;
+}
@@ -0,0 +1,52 @@
+/*
+ * Capture to emit latency of TiqiaaUsbIrRepeater between two emulated devices
+ *
+ * Usage: repeater_bench [signals] [reply_latency_us] [write_latency_us]
+ *
+ * The sending device plays in real time, a NEC frame is captured every
+ * 120 ms.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+
+#include "BenchUtil.h"
+#include "TiqiaaRepeater.h"
+#include "TiqiaaEmu.h"
+
+int main(int argc, char ** argv) {
+    int Signals = BenchArg(argc, argv, 1, 20);
+    TiqiaaUsbIrEmulator RxEmu, TxEmu;
+    TiqiaaUsbIr Rx, Tx;
+    TiqiaaUsbIrRepeater Repeater;
+    TiqiaaUsbIrRepeater_Stats Stats;
+    TiqiaaUsbIrEmulator_Stats TxStats;
+    uint8_t Nec[128];
+    int NecSize = TiqiaaUsbIr::WriteIrNecSignal(0x8002, Nec);
+
+    if( Signals <= 0 ) return 1;
+    RxEmu.ReplyLatency = TxEmu.ReplyLatency = BenchArg(argc, argv, 2, 1000);
+    RxEmu.FragmWriteLatency = TxEmu.FragmWriteLatency = BenchArg(argc, argv, 3, 125);
+    if( !Rx.Open(&RxEmu) || !Tx.Open(&TxEmu) || !Repeater.Start(&Rx, &Tx) ) {
+        printf("could not start repeater\n");
+        return 1;
+    }
+    printf("%d NEC frames (%u us airtime), reply latency %d us, write latency %d us\n", Signals,
+           TiqiaaUsbIr_GetIrAirtime(Nec, NecSize), TxEmu.ReplyLatency, TxEmu.FragmWriteLatency);
+    for( int i = 0; i < Signals; i++ ) {
+        RxEmu.InjectIrSignal(Nec, NecSize);
+        usleep(120000);
+    }
+    Repeater.Stop();
+    Repeater.GetStats(&Stats);
+    TxEmu.GetStats(&TxStats);
+    printf("captured %u, sent %u, played %u, dropped %u, failed %u\n",
+           Stats.Captures, Stats.Sent, TxStats.PacketsPlayed, Stats.Dropped, Stats.Failed);
+    if( Stats.Sent ) {
+        printf("capture to emit: min %.2f ms, avg %.2f ms, max %.2f ms\n", Stats.LatencyMinUs / 1e3,
+               Stats.LatencySumUs / 1e3 / Stats.Sent, Stats.LatencyMaxUs / 1e3);
+    }
+    Rx.Close();
+    Tx.Close();
+    return 0;
+}
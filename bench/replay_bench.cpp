@@ -0,0 +1,117 @@
+/*
+ * Driver operations replayed from a recorded USB session
+ *
+ * Usage: replay_bench [cycles] [time_scale_permille] [session_file]
+ *
+ * Records one Open, SendNecSignal, StartRecvIR, Close session on the
+ * emulated device to session_file (default /tmp/replay_bench.txt), then
+ * replays it cycles times on the same driver object. A session recorded
+ * on a real device with TiqiaaUsb-cli --record is replayed the same way.
+ */
+
+#include <stdio.h>
+
+#include "BenchUtil.h"
+#include "TiqiaaUsb.h"
+#include "TiqiaaEmu.h"
+#include "TiqiaaReplay.h"
+
+static const int OpCount = 4;
+static const char * OpNames[OpCount] = {"Open", "SendNecSignal", "StartRecvIR", "Close"};
+
+static volatile bool Received;
+
+static void RecvCallback(uint8_t * /*data*/, int /*size*/, TiqiaaUsbIr * /*IrCls*/, void * /*context*/) {
+    Received = true;
+}
+
+// One session: Open, send, receive a signal, Close
+// Emu: emulator to inject the received signal into, NULL - replay
+// Return: true - all operations succeeded
+static bool RunSession(TiqiaaUsbIr * Ir, TiqiaaUsbTransport * Transport, TiqiaaUsbIrEmulator * Emu, uint64_t * OpNs) {
+    uint8_t Frame[128];
+    int FrameSize = TiqiaaUsbIr::WriteIrNecSignal(0x8004, Frame);
+    uint64_t StartNs, Deadline;
+    bool res;
+
+    StartNs = BenchNowNs();
+    if( !Ir->Open(Transport) ) return false;
+    OpNs[0] = BenchNowNs() - StartNs;
+
+    StartNs = BenchNowNs();
+    res = Ir->SendNecSignal(0x8002);
+    OpNs[1] = BenchNowNs() - StartNs;
+
+    Received = false;
+    StartNs = BenchNowNs();
+    res = Ir->StartRecvIR() && res;
+    if( Emu ) Emu->InjectIrSignal(Frame, FrameSize);
+    Deadline = BenchNowNs() + 1000000000ull;
+    while( !Received && (BenchNowNs() < Deadline) ) {}
+    OpNs[2] = BenchNowNs() - StartNs;
+
+    StartNs = BenchNowNs();
+    res = Ir->Close() && Received && res;
+    OpNs[3] = BenchNowNs() - StartNs;
+    return res;
+}
+
+int main(int argc, char ** argv) {
+    int Cycles = BenchArg(argc, argv, 1, 20);
+    double TimeScale = BenchArg(argc, argv, 2, 1000) / 1000.0;
+    const char * FileName = (argc > 3) ? argv[3] : "/tmp/replay_bench.txt";
+    TiqiaaUsbIrEmulator Emu;
+    TiqiaaUsbIrRecorder Rec;
+    TiqiaaUsbIrReplay Replay;
+    TiqiaaUsbIrReplay_Stats Stats;
+    TiqiaaUsbIr Ir;
+    uint64_t OpNs[OpCount];
+    uint64_t SumNs[OpCount] = {0};
+    uint64_t MaxNs[OpCount] = {0};
+    int Fails = 0;
+    int Mismatches = 0;
+
+    if( Cycles <= 0 ) return 1;
+    if( !Rec.Open(FileName) ) {
+        printf("could not create %s\n", FileName);
+        return 1;
+    }
+    Emu.AirtimeScale = 1.0;
+    Emu.ReplyLatency = 1000;
+    Emu.FragmWriteLatency = 125;
+    Ir.IrRecvCallback = RecvCallback;
+    {
+        TiqiaaUsbIr RecIr;
+        RecIr.IrRecvCallback = RecvCallback;
+        RecIr.Recorder = &Rec;
+        if( !RunSession(&RecIr, &Emu, &Emu, OpNs) ) {
+            printf("recording failed\n");
+            return 1;
+        }
+    }
+    Rec.Close();
+    printf("recorded: Open %.2f ms, SendNecSignal %.2f ms, StartRecvIR %.2f ms, Close %.2f ms\n",
+           OpNs[0] / 1e6, OpNs[1] / 1e6, OpNs[2] / 1e6, OpNs[3] / 1e6);
+
+    if( !Replay.Load(FileName) ) {
+        printf("could not load %s\n", FileName);
+        return 1;
+    }
+    Replay.TimeScale = TimeScale;
+    for( int i = 0; i < Cycles; i++ ) {
+        if( !RunSession(&Ir, &Replay, NULL, OpNs) ) Fails++;
+        Replay.GetStats(&Stats);
+        Mismatches += Stats.Mismatches + Stats.ExtraWrites + Stats.MissingWrites;
+        for( int op = 0; op < OpCount; op++ ) {
+            SumNs[op] += OpNs[op];
+            if( OpNs[op] > MaxNs[op] ) MaxNs[op] = OpNs[op];
+        }
+    }
+
+    printf("%d replays of %d written / %d read fragments, time scale %.3f: %d failures, %d mismatched writes\n",
+           Cycles, Replay.GetWriteCount(), Replay.GetReadCount(), TimeScale, Fails, Mismatches);
+    printf("%-14s %10s %10s\n", "op", "avg, ms", "max, ms");
+    for( int op = 0; op < OpCount; op++ )
+        printf("%-14s %10.3f %10.3f\n", OpNames[op], SumNs[op] / 1e6 / Cycles, MaxNs[op] / 1e6);
+    return (Fails || Mismatches) ? 1 : 0;
+}
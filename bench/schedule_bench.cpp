@@ -0,0 +1,76 @@
+/*
+ * Frame rate and inter-frame gaps of SendIR against the emulated device,
+ * waiting for every reply vs open-loop transmit scheduled from airtime
+ *
+ * Usage: schedule_bench [frames] [frame_airtime_us] [reply_latency_us] [write_latency_us] [reply_jitter_us] [lead_us]
+ *
+ * The emulator plays in real time: open-loop scheduling predicts playback
+ * end from the airtime of the signal.
+ */
+
+#include <stdio.h>
+
+#include "BenchUtil.h"
+#include "TiqiaaUsb.h"
+#include "TiqiaaEmu.h"
+
+static void Run(TiqiaaUsbIr * Ir, TiqiaaUsbIrEmulator * Emu, const uint8_t * Frame, int Size, int Frames, bool OpenLoop) {
+    TiqiaaUsbIrEmulator_Stats Stats;
+    TiqiaaUsbIr_IrScheduleStats Sched;
+    int Fails = 0;
+
+    Ir->IrOpenLoop = OpenLoop;
+    Ir->ResetIrScheduleStats();
+    Emu->ResetStats();
+    uint64_t start = BenchNowNs();
+    for( int i = 0; i < Frames; i++ ) {
+        if( !Ir->SendIR(38000, (void *)Frame, Size) ) Fails++;
+    }
+    if( !Ir->FlushIR() ) Fails++;
+    uint64_t elapsed = BenchNowNs() - start;
+    Emu->GetStats(&Stats);
+    Ir->GetIrScheduleStats(&Sched);
+
+    printf("%-11s %.1f frames/s (airtime limit %.1f), gaps %u, avg gap %.1f us, max gap %.1f us, failures %d\n",
+           OpenLoop ? "open loop:" : "wait reply:", Frames / (elapsed / 1e9), Stats.PacketsPlayed / (Stats.AirtimeNs / 1e9),
+           Stats.Gaps, Stats.PacketsPlayed > 1 ? Stats.GapSumNs / 1e3 / (Stats.PacketsPlayed - 1) : 0.0,
+           Stats.GapMaxNs / 1e3, Fails);
+    if( OpenLoop ) {
+        printf("            end prediction error avg %.1f us, max %u us, max in flight %u, stalls %u\n",
+               Sched.Completed ? (double)Sched.EndErrSumUs / Sched.Completed : 0.0, Sched.EndErrMaxUs,
+               Sched.MaxInFlight, Sched.Stalls);
+    }
+}
+
+int main(int argc, char ** argv) {
+    int Frames = BenchArg(argc, argv, 1, 200);
+    int FrameUs = BenchArg(argc, argv, 2, 8000);
+    TiqiaaUsbIrEmulator Emu;
+    TiqiaaUsbIr Ir;
+    BenchRng rng;
+    uint8_t Frame[TiqiaaUsbIrPacketBuilder::MaxIrDataSize];
+    int Size = 0;
+    uint32_t Airtime = 0;
+
+    if( (Frames <= 0) || (FrameUs <= 0) ) return 1;
+    while( (Airtime < (uint32_t)FrameUs) && (Size < (int)sizeof(Frame)) ) {
+        Frame[Size] = (Size & 1) ? rng.Range(35, 106) : (0x80 | 35);
+        Airtime += (Frame[Size] & 0x7F) * TiqiaaUsbIr_IrTickUs;
+        Size++;
+    }
+    Emu.ReplyLatency = BenchArg(argc, argv, 3, 1000);
+    Emu.FragmWriteLatency = BenchArg(argc, argv, 4, 125);
+    Emu.ReplyJitter = BenchArg(argc, argv, 5, 500);
+    Ir.IrScheduleLead = BenchArg(argc, argv, 6, 5000);
+
+    if( !Ir.Open(&Emu) ) {
+        printf("could not open emulator\n");
+        return 1;
+    }
+    printf("%d frames of %u us (%d bytes), reply latency %d us, jitter %d us, write latency %d us, lead %u us\n",
+           Frames, Airtime, Size, Emu.ReplyLatency, Emu.ReplyJitter, Emu.FragmWriteLatency, Ir.IrScheduleLead);
+    Run(&Ir, &Emu, Frame, Size, Frames, false);
+    Run(&Ir, &Emu, Frame, Size, Frames, true);
+    Ir.Close();
+    return 0;
+}
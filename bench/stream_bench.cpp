@@ -0,0 +1,54 @@
+/*
+ * Inter-chunk gap of SendIRStream against the emulated device
+ *
+ * Usage: stream_bench [signal_bytes] [airtime_scale] [reply_latency_us] [write_latency_us]
+ */
+
+#include <stdio.h>
+
+#include "BenchUtil.h"
+#include "TiqiaaUsb.h"
+#include "TiqiaaEmu.h"
+
+static void RunStream(TiqiaaUsbIr * Ir, TiqiaaUsbIrEmulator * Emu, uint8_t * Buf, int Size, bool Pipeline) {
+    TiqiaaUsbIrEmulator_Stats Stats;
+
+    Ir->IrStreamPipeline = Pipeline;
+    Emu->ResetStats();
+    uint64_t start = BenchNowNs();
+    bool ok = Ir->SendIRStream(38000, Buf, Size);
+    uint64_t elapsed = BenchNowNs() - start;
+    Emu->GetStats(&Stats);
+
+    printf("%-12s %s packets %u, time %.2f ms, airtime %.2f ms, gaps %u, avg gap %.1f us, max gap %.1f us\n",
+           Pipeline ? "pipelined:" : "sequential:", ok ? "ok" : "FAIL", Stats.PacketsPlayed,
+           elapsed / 1e6, Stats.AirtimeNs / 1e6, Stats.Gaps,
+           Stats.PacketsPlayed > 1 ? Stats.GapSumNs / 1e3 / (Stats.PacketsPlayed - 1) : 0.0,
+           Stats.GapMaxNs / 1e3);
+}
+
+int main(int argc, char ** argv) {
+    int Size = BenchArg(argc, argv, 1, 8192);
+    double Scale = BenchArg(argc, argv, 2, 100) / 1000.0;
+    TiqiaaUsbIrEmulator Emu;
+    TiqiaaUsbIr Ir;
+    BenchRng rng;
+    static uint8_t Buf[1 << 20];
+
+    if( (Size <= 0) || (Size > (int)sizeof(Buf)) ) return 1;
+    Emu.AirtimeScale = Scale;
+    Emu.ReplyLatency = BenchArg(argc, argv, 3, 1000);
+    Emu.FragmWriteLatency = BenchArg(argc, argv, 4, 125);
+    for( int i = 0; i < Size; i++ ) Buf[i] = (i & 1) ? rng.Range(35, 106) : (0x80 | 35);
+
+    if( !Ir.Open(&Emu) ) {
+        printf("could not open emulator\n");
+        return 1;
+    }
+    printf("signal %d bytes, airtime scale %.3f, reply latency %d us, write latency %d us\n",
+           Size, Scale, Emu.ReplyLatency, Emu.FragmWriteLatency);
+    RunStream(&Ir, &Emu, Buf, Size, false);
+    RunStream(&Ir, &Emu, Buf, Size, true);
+    Ir.Close();
+    return 0;
+}
@@ -0,0 +1,75 @@
+/*
+ * Cost of trace spans and a sample trace of NEC frames on the emulated device
+ *
+ * Usage: trace_bench [spans] [frames] [trace_file]
+ *
+ * Span cost is measured with tracing disabled and enabled, events are
+ * flushed between rounds so the buffer never fills. With trace_file the
+ * spans of the NEC frames are written there, open it in Perfetto.
+ */
+
+#include <stdio.h>
+
+#include "BenchUtil.h"
+#include "TiqiaaTrace.h"
+#include "TiqiaaUsb.h"
+#include "TiqiaaEmu.h"
+
+// Return: nsec per span
+static double MeasureSpans(int Spans, FILE * Null) {
+    uint64_t StartNs;
+    uint64_t Total = 0;
+    int Done = 0;
+    int Round;
+
+    while( Done < Spans ) {
+        Round = Spans - Done;
+        if( Round > TiqiaaUsbIrTrace::BufferSize ) Round = TiqiaaUsbIrTrace::BufferSize;
+        StartNs = BenchNowNs();
+        for( int i = 0; i < Round; i++ ) {
+            TiqiaaUsbIrTraceSpan Span("bench", "i", i);
+        }
+        Total += BenchNowNs() - StartNs;
+        TiqiaaUsbIrTrace::WriteJson(Null);
+        Done += Round;
+    }
+    return (double)Total / Spans;
+}
+
+int main(int argc, char ** argv) {
+    int Spans = BenchArg(argc, argv, 1, 1000000);
+    int Frames = BenchArg(argc, argv, 2, 5);
+    const char * TraceFile = (argc > 3) ? argv[3] : NULL;
+    FILE * Null = fopen("/dev/null", "w");
+    TiqiaaUsbIrEmulator Emu;
+    TiqiaaUsbIr Ir;
+    int Events;
+
+    if( (Spans <= 0) || (Null == NULL) ) return 1;
+    TiqiaaUsbIrTrace::Enable(false);
+    printf("span, tracing disabled: %.2f ns\n", MeasureSpans(Spans, Null));
+    TiqiaaUsbIrTrace::Enable(true);
+    printf("span, tracing enabled:  %.2f ns, dropped %llu\n", MeasureSpans(Spans, Null),
+           (unsigned long long)TiqiaaUsbIrTrace::GetDropped());
+    fclose(Null);
+
+    Emu.AirtimeScale = 0.1;
+    Emu.ReplyLatency = 1000;
+    Emu.FragmWriteLatency = 125;
+    if( !Ir.Open(&Emu) ) {
+        printf("could not open emulated device\n");
+        return 1;
+    }
+    for( int i = 0; i < Frames; i++ ) Ir.SendNecSignal(0x8002 + i);
+    Ir.Close();
+    TiqiaaUsbIrTrace::Enable(false);
+    if( TraceFile ) {
+        Events = TiqiaaUsbIrTrace::WriteJson(TraceFile);
+        if( Events < 0 ) {
+            printf("could not write %s\n", TraceFile);
+            return 1;
+        }
+        printf("%d NEC frames: %d events written to %s\n", Frames, Events, TraceFile);
+    }
+    return 0;
+}
@@ -0,0 +1,106 @@
+/*
+ * Receive-blind time per transmit against the emulated device: the
+ * application switching modes itself vs transceive mode
+ *
+ * Usage: transceive_bench [rounds] [burst] [airtime_scale] [reply_latency_us] [write_latency_us]
+ *
+ * Every round a remote signal is captured and answered with a burst of
+ * NEC frames, then the device has to receive again.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+
+#include "BenchUtil.h"
+#include "TiqiaaUsb.h"
+#include "TiqiaaEmu.h"
+
+static volatile int Captures;
+
+static void RecvCallback(uint8_t * /*data*/, int /*size*/, TiqiaaUsbIr * /*IrCls*/, void * /*context*/) {
+    __sync_fetch_and_add(&Captures, 1);
+}
+
+static bool WaitCapture(int Count) {
+    for( int i = 0; i < 2000; i++ ) {
+        if( Captures >= Count ) return true;
+        usleep(500);
+    }
+    return false;
+}
+
+int main(int argc, char ** argv) {
+    int Rounds = BenchArg(argc, argv, 1, 50);
+    int Burst = BenchArg(argc, argv, 2, 2);
+    TiqiaaUsbIrEmulator Emu;
+    TiqiaaUsbIr Ir;
+    TiqiaaUsbIr_TransceiveStats Stats;
+    TiqiaaUsbIrEmulator_Stats EmuStats;
+    uint8_t Nec[128];
+    int NecSize = TiqiaaUsbIr::WriteIrNecSignal(0x8002, Nec);
+    uint64_t BlindNs = 0;
+    uint64_t BlindMaxNs = 0;
+    int Fails = 0;
+
+    if( (Rounds <= 0) || (Burst <= 0) ) return 1;
+    Emu.AirtimeScale = BenchArg(argc, argv, 3, 100) / 1000.0;
+    Emu.ReplyLatency = BenchArg(argc, argv, 4, 1000);
+    Emu.FragmWriteLatency = BenchArg(argc, argv, 5, 125);
+    Ir.IrRecvCallback = &RecvCallback;
+    if( !Ir.Open(&Emu) ) {
+        printf("could not open emulator\n");
+        return 1;
+    }
+    printf("%d rounds, %d NEC frames per burst, airtime scale %.3f, reply latency %d us, write latency %d us\n",
+           Rounds, Burst, Emu.AirtimeScale, Emu.ReplyLatency, Emu.FragmWriteLatency);
+
+    // application switches modes: send, then start receiving again
+    Captures = 0;
+    Emu.ResetStats();
+    if( !Ir.StartRecvIR() ) Fails++;
+    for( int i = 0; i < Rounds; i++ ) {
+        Emu.InjectIrSignal(Nec, NecSize);
+        if( !WaitCapture(i + 1) ) Fails++;
+        uint64_t start = BenchNowNs();
+        for( int j = 0; j < Burst; j++ ) {
+            if( !Ir.SendIR(38000, Nec, NecSize) ) Fails++;
+        }
+        if( !Ir.StartRecvIR() ) Fails++;
+        uint64_t blind = BenchNowNs() - start;
+        BlindNs += blind;
+        if( blind > BlindMaxNs ) BlindMaxNs = blind;
+    }
+    Emu.GetStats(&EmuStats);
+    printf("application: blind %.2f ms per transmit, max %.2f ms per burst, airtime %.2f ms per transmit, failures %d\n",
+           BlindNs / 1e6 / (Rounds * Burst), BlindMaxNs / 1e6, EmuStats.AirtimeNs / 1e6 / EmuStats.PacketsPlayed, Fails);
+
+    // transceive mode: the callback thread only queues, the driver switches back by itself
+    Fails = 0;
+    Captures = 0;
+    Emu.ResetStats();
+    Ir.ResetTransceiveStats();
+    if( !Ir.StartTransceive() ) Fails++;
+    for( int i = 0; i < Rounds; i++ ) {
+        Emu.InjectIrSignal(Nec, NecSize);
+        if( !WaitCapture(i + 1) ) Fails++;
+        for( int j = 0; j < Burst; j++ ) {
+            if( !Ir.QueueTransmit(38000, Nec, NecSize) ) Fails++;
+        }
+        // next capture only after the device receives again
+        for( int k = 0; k < 2000; k++ ) {
+            Ir.GetTransceiveStats(&Stats);
+            if( Stats.BlindPeriods > (uint32_t)i ) break;
+            usleep(200);
+        }
+    }
+    Ir.StopTransceive();
+    Ir.GetTransceiveStats(&Stats);
+    Emu.GetStats(&EmuStats);
+    printf("transceive:  blind %.2f ms per transmit, max %.2f ms per burst, airtime %.2f ms per transmit, failures %u\n",
+           Stats.Transmits ? Stats.BlindSumUs / 1e3 / Stats.Transmits : 0.0, Stats.BlindMaxUs / 1e3,
+           EmuStats.PacketsPlayed ? EmuStats.AirtimeNs / 1e6 / EmuStats.PacketsPlayed : 0.0, Fails + Stats.Failed);
+    printf("             transmits %u, blind periods %u, rearms after capture %u, dropped %u\n",
+           Stats.Transmits, Stats.BlindPeriods, Stats.Rearms, Stats.Dropped);
+    Ir.Close();
+    return 0;
+}
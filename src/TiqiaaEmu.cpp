@@ -0,0 +1,298 @@
+/*
+ * Userspace driver for Tiqiaa Tview USB IR Transeiver
+ *
+ * Copyright (c) Xen xen-re[at]tutanota.com
+ */
+
+#include "TiqiaaEmu.h"
+#include "TiqiaaTime.h"
+#include <cstring>
+#include <unistd.h>
+
+TiqiaaUsbIrEmulator::TiqiaaUsbIrEmulator() : Reasm(TiqiaaUsbIr_WriteReportId) {
+    pthread_condattr_t CondAttr;
+
+    AirtimeScale = 1.0;
+    ReplyLatency = 0;
+    ReplyJitter = 0;
+    FragmWriteLatency = 0;
+    ReplyLossPermille = 0;
+    LossSeed = 1;
+    IsOpened = false;
+    RxHead = 0;
+    RxCount = 0;
+    RxPacketIdx = 0;
+    CaptureHead = 0;
+    CaptureCount = 0;
+    RecvArmed = false;
+    RecvCmdId = 0;
+    State = TiqiaaUsbIr_StateIdle;
+    PlayEndNs = 0;
+    PlayStarted = false;
+    memset(&Stats, 0, sizeof(Stats));
+
+    pthread_condattr_init(&CondAttr);
+    pthread_condattr_setclock(&CondAttr, CLOCK_MONOTONIC);
+    pthread_cond_init(&Cond, &CondAttr);
+    pthread_condattr_destroy(&CondAttr);
+    pthread_mutex_init(&Mutex, NULL);
+}
+
+TiqiaaUsbIrEmulator::~TiqiaaUsbIrEmulator() {
+    pthread_mutex_destroy(&Mutex);
+    pthread_cond_destroy(&Cond);
+}
+
+bool TiqiaaUsbIrEmulator::Open() {
+    pthread_mutex_lock(&Mutex);
+    IsOpened = true;
+    RxHead = 0;
+    RxCount = 0;
+    RecvArmed = false;
+    State = TiqiaaUsbIr_StateIdle;
+    LossRng = LossSeed ? LossSeed : 1;
+    Reasm.Reset();
+    pthread_mutex_unlock(&Mutex);
+    return true;
+}
+
+void TiqiaaUsbIrEmulator::Close() {
+    pthread_mutex_lock(&Mutex);
+    IsOpened = false;
+    pthread_cond_broadcast(&Cond);
+    pthread_mutex_unlock(&Mutex);
+}
+
+bool TiqiaaUsbIrEmulator::Write(const uint8_t * data, int size) {
+    if( FragmWriteLatency > 0 ) usleep(FragmWriteLatency);
+
+    pthread_mutex_lock(&Mutex);
+    if( !IsOpened ) {
+        pthread_mutex_unlock(&Mutex);
+        return false;
+    }
+    if( Reasm.PushFragment(data, size) == TiqiaaUsbIrReassembler::PacketComplete )
+        ProcessPacket(Reasm.GetPacketData(), Reasm.GetPacketSize());
+    pthread_mutex_unlock(&Mutex);
+    return true;
+}
+
+int TiqiaaUsbIrEmulator::Read(uint8_t * data, int size, unsigned int timeout) {
+    uint64_t Deadline = TiqiaaUsbIr_NowNs() + (uint64_t)timeout * 1000000;
+    uint64_t WaitUntil;
+    struct timespec ts;
+    int res;
+
+    pthread_mutex_lock(&Mutex);
+    while( true ) {
+        if( !IsOpened ) {
+            res = -1;
+            break;
+        }
+        uint64_t now = TiqiaaUsbIr_NowNs();
+        if( RxCount && (RxQueue[RxHead].DueNs <= now) ) {
+            RxFragm * Fragm = &RxQueue[RxHead];
+            res = (Fragm->Size < size) ? Fragm->Size : size;
+            memcpy(data, Fragm->Data, res);
+            RxHead = (RxHead + 1) % RxQueueSize;
+            RxCount--;
+            break;
+        }
+        if( (timeout != 0) && (now >= Deadline) ) {
+            res = 0;
+            break;
+        }
+        WaitUntil = (timeout != 0) ? Deadline : UINT64_MAX;
+        if( RxCount && (RxQueue[RxHead].DueNs < WaitUntil) ) WaitUntil = RxQueue[RxHead].DueNs;
+        if( WaitUntil == UINT64_MAX ) {
+            pthread_cond_wait(&Cond, &Mutex);
+        } else {
+            ts = TiqiaaUsbIr_NsToTimespec(WaitUntil);
+            pthread_cond_timedwait(&Cond, &Mutex, &ts);
+        }
+    }
+    pthread_mutex_unlock(&Mutex);
+    return res;
+}
+
+bool TiqiaaUsbIrEmulator::InjectIrSignal(const uint8_t * data, int size) {
+    bool res = false;
+
+    if( (size <= 0) || (size > MaxCaptureSize) ) return false;
+    pthread_mutex_lock(&Mutex);
+    if( CaptureCount < CaptureQueueSize ) {
+        Capture * Cap = &Captures[(CaptureHead + CaptureCount) % CaptureQueueSize];
+        memcpy(Cap->Data, data, size);
+        Cap->Size = size;
+        CaptureCount++;
+        if( RecvArmed ) DeliverCapture(TiqiaaUsbIr_NowNs() + (uint64_t)ReplyLatency * 1000);
+        res = true;
+    }
+    pthread_mutex_unlock(&Mutex);
+    return res;
+}
+
+uint8_t TiqiaaUsbIrEmulator::GetState() {
+    uint8_t res;
+
+    pthread_mutex_lock(&Mutex);
+    res = State;
+    pthread_mutex_unlock(&Mutex);
+    return res;
+}
+
+void TiqiaaUsbIrEmulator::GetStats(TiqiaaUsbIrEmulator_Stats * stats) {
+    pthread_mutex_lock(&Mutex);
+    *stats = Stats;
+    pthread_mutex_unlock(&Mutex);
+}
+
+void TiqiaaUsbIrEmulator::ResetStats() {
+    pthread_mutex_lock(&Mutex);
+    memset(&Stats, 0, sizeof(Stats));
+    PlayStarted = false;
+    pthread_mutex_unlock(&Mutex);
+}
+
+// Mutex is locked
+uint32_t TiqiaaUsbIrEmulator::NextRandom() {
+    LossRng ^= LossRng << 13;
+    LossRng ^= LossRng >> 17;
+    LossRng ^= LossRng << 5;
+    return LossRng;
+}
+
+// Mutex is locked
+void TiqiaaUsbIrEmulator::QueueReply(uint64_t DueNs, const uint8_t * data, int size) {
+    int PackSize = size + 2 * sizeof(uint16_t);
+    int FragmCount = (PackSize + MaxReadFragmSize - 1) / MaxReadFragmSize;
+    int Offs = 0;
+
+    if( (RxCount + FragmCount) > RxQueueSize ) return; // device buffer overflow, reply lost
+    if( (ReplyLossPermille > 0) && ((int)(NextRandom() % 1000) < ReplyLossPermille) ) {
+        Stats.RepliesLost++;
+        return;
+    }
+    if( ReplyJitter > 0 ) DueNs += (uint64_t)(NextRandom() % (ReplyJitter + 1)) * 1000;
+    RxPacketIdx = (RxPacketIdx % 15) + 1;
+    for( int i = 1; i <= FragmCount; i++ ) {
+        RxFragm * Fragm = &RxQueue[(RxHead + RxCount) % RxQueueSize];
+        TiqiaaUsbIr_Report2Header * ReportHdr = (TiqiaaUsbIr_Report2Header *)Fragm->Data;
+        uint8_t * Payload = Fragm->Data + sizeof(TiqiaaUsbIr_Report2Header);
+        int FragmSize = PackSize - Offs;
+        if( FragmSize > MaxReadFragmSize ) FragmSize = MaxReadFragmSize;
+
+        ReportHdr->ReportId = TiqiaaUsbIr_ReadReportId;
+        ReportHdr->FragmSize = FragmSize + 3;
+        ReportHdr->PacketIdx = RxPacketIdx;
+        ReportHdr->FragmCount = FragmCount;
+        ReportHdr->FragmIdx = i;
+        for( int j = 0; j < FragmSize; j++, Offs++ ) {
+            if( Offs < 2 ) Payload[j] = ((const uint8_t *)&TiqiaaUsbIr_PackStartSign)[Offs];
+            else if( Offs < size + 2 ) Payload[j] = data[Offs - 2];
+            else Payload[j] = ((const uint8_t *)&TiqiaaUsbIr_PackEndSign)[Offs - size - 2];
+        }
+        Fragm->Size = FragmSize + sizeof(TiqiaaUsbIr_Report2Header);
+        Fragm->DueNs = DueNs;
+        RxCount++;
+    }
+    pthread_cond_broadcast(&Cond);
+}
+
+// Mutex is locked
+void TiqiaaUsbIrEmulator::QueueStateReply(uint64_t DueNs, uint8_t cmdId, uint8_t cmdType) {
+    uint8_t Reply[3];
+
+    Reply[0] = cmdId;
+    Reply[1] = cmdType;
+    Reply[2] = State;
+    QueueReply(DueNs, Reply, sizeof(Reply));
+}
+
+// Mutex is locked
+void TiqiaaUsbIrEmulator::DeliverCapture(uint64_t DueNs) {
+    uint8_t Reply[2 + TiqiaaUsbIr_MaxRecvDataSize];
+    Capture * Cap = &Captures[CaptureHead];
+    int ChunkSize;
+
+    Reply[0] = RecvCmdId;
+    Reply[1] = TiqiaaUsbIr_CmdData;
+    for( int Offs = 0; Offs < Cap->Size; Offs += ChunkSize ) {
+        ChunkSize = Cap->Size - Offs;
+        if( ChunkSize > TiqiaaUsbIr_MaxRecvDataSize ) ChunkSize = TiqiaaUsbIr_MaxRecvDataSize;
+        memcpy(Reply + 2, Cap->Data + Offs, ChunkSize);
+        QueueReply(DueNs, Reply, ChunkSize + 2);
+    }
+    CaptureHead = (CaptureHead + 1) % CaptureQueueSize;
+    CaptureCount--;
+    RecvArmed = false;
+}
+
+// Mutex is locked
+void TiqiaaUsbIrEmulator::ProcessPacket(const uint8_t * pack, int size) {
+    uint64_t now = TiqiaaUsbIr_NowNs();
+    uint64_t DueNs = now + (uint64_t)ReplyLatency * 1000;
+    uint8_t cmdId = pack[0];
+    uint8_t cmdType = pack[1];
+
+    switch( cmdType ) {
+        case TiqiaaUsbIr_CmdVersion: {
+            uint8_t Reply[2 + sizeof(TiqiaaUsbIr_VersionPacket)];
+            TiqiaaUsbIr_VersionPacket * Version = (TiqiaaUsbIr_VersionPacket *)(Reply + 2);
+            memset(Reply, 0, sizeof(Reply));
+            Reply[0] = cmdId;
+            Reply[1] = cmdType;
+            Version->VersionChar = 'E';
+            Version->VersionInt = 1;
+            Version->State = State;
+            QueueReply(DueNs, Reply, sizeof(Reply));
+            break;
+        }
+        case TiqiaaUsbIr_CmdIdleMode:
+            State = TiqiaaUsbIr_StateIdle;
+            RecvArmed = false;
+            QueueStateReply(DueNs, cmdId, cmdType);
+            break;
+        case TiqiaaUsbIr_CmdSendMode:
+            State = TiqiaaUsbIr_StateSend;
+            RecvArmed = false;
+            QueueStateReply(DueNs, cmdId, cmdType);
+            break;
+        case TiqiaaUsbIr_CmdRecvMode:
+            State = TiqiaaUsbIr_StateRecv;
+            QueueStateReply(DueNs, cmdId, cmdType);
+            break;
+        case TiqiaaUsbIr_CmdCancel:
+            RecvArmed = false;
+            QueueStateReply(DueNs, cmdId, cmdType);
+            break;
+        case TiqiaaUsbIr_CmdOutput:
+            if( State == TiqiaaUsbIr_StateRecv ) {
+                RecvArmed = true;
+                RecvCmdId = cmdId;
+                if( CaptureCount ) DeliverCapture(DueNs);
+            } else {
+                QueueStateReply(DueNs, cmdId, cmdType);
+            }
+            break;
+        case TiqiaaUsbIr_CmdData: { // IR data: CmdId, 'D', IrFreqId, signal
+            uint64_t StartNs = (PlayStarted && (PlayEndNs > now)) ? PlayEndNs : now;
+            uint64_t AirtimeNs = (uint64_t)(TiqiaaUsbIr_GetIrAirtime(pack + 3, size - 3) * 1000.0 * AirtimeScale);
+            if( PlayStarted && (StartNs > PlayEndNs) ) {
+                uint64_t Gap = StartNs - PlayEndNs;
+                Stats.Gaps++;
+                Stats.GapSumNs += Gap;
+                if( Gap > Stats.GapMaxNs ) Stats.GapMaxNs = Gap;
+            }
+            PlayStarted = true;
+            PlayEndNs = StartNs + AirtimeNs;
+            Stats.PacketsPlayed++;
+            Stats.AirtimeNs += AirtimeNs;
+            QueueStateReply(PlayEndNs + (uint64_t)ReplyLatency * 1000, cmdId, TiqiaaUsbIr_CmdOutput);
+            break;
+        }
+        default:
+            QueueStateReply(DueNs, cmdId, cmdType);
+            break;
+    }
+}
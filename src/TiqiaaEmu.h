@@ -0,0 +1,133 @@
+/*
+ * Userspace driver for Tiqiaa Tview USB IR Transeiver
+ *
+ * Copyright (c) Xen xen-re[at]tutanota.com
+ *
+ * In-process emulation of the device for benchmarks without hardware.
+ *
+ * Modelled behaviour:
+ * - mode commands are answered with the new state after ReplyLatency
+ * - an IR data packet is played for its airtime (ticks * 16 mks * AirtimeScale),
+ *   a packet that arrives while another one plays is queued behind it and
+ *   CmdOutput is answered when playback ends
+ * - in Recv mode CmdOutput arms receiving, the next injected signal is sent
+ *   back as CmdData packets, all but the last one full
+ *
+ * Example:
+ *
+ * TiqiaaUsbIrEmulator Emu;
+ * Emu.AirtimeScale = 0.1;
+ * TiqiaaUsbIr Ir;
+ * Ir.Open(&Emu);
+ */
+
+#ifndef TIQIAA_EMU_H
+#define TIQIAA_EMU_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "TiqiaaUsbProto.h"
+#include "TiqiaaUsbTransport.h"
+#include "TiqiaaReassembler.h"
+
+struct TiqiaaUsbIrEmulator_Stats{
+    uint32_t PacketsPlayed;
+    uint32_t RepliesLost;
+    uint32_t Gaps; //!< packets that started after the previous one ended
+    uint64_t GapSumNs; //!< sum of idle time between consecutive packets
+    uint64_t GapMaxNs;
+    uint64_t AirtimeNs; //!< total scaled airtime played
+};
+
+class TiqiaaUsbIrEmulator : public TiqiaaUsbTransport {
+public:
+    //! IR playback time scale, 1 - real time, 0 - instant
+    double AirtimeScale;
+
+    //! Delay of every reply from the device, mksec
+    int ReplyLatency;
+
+    //! Max random extra delay of every reply, mksec, replies stay in order
+    int ReplyJitter;
+
+    //! Time spent in every Write call, mksec
+    int FragmWriteLatency;
+
+    //! Probability of losing a whole reply packet, 1/1000
+    int ReplyLossPermille;
+
+    //! Seed of reply loss and jitter, same seed - same replies lost and delayed
+    uint32_t LossSeed;
+
+    TiqiaaUsbIrEmulator();
+    virtual ~TiqiaaUsbIrEmulator();
+
+    virtual bool Open();
+    virtual void Close();
+    virtual bool Write(const uint8_t * data, int size);
+    virtual int Read(uint8_t * data, int size, unsigned int timeout);
+
+    //! Queue IR signal to be delivered on next receive
+    //! data: Tiqiaa signal data
+    //! size: size of data
+    //! Return: true - success, false - signal longer than MaxCaptureSize or capture queue full
+    bool InjectIrSignal(const uint8_t * data, int size);
+
+    static const int MaxCaptureSize = 4 * TiqiaaUsbIr_MaxRecvDataSize;
+
+    //! Return: current device state, one of TiqiaaUsbIr State* values
+    uint8_t GetState();
+
+    //! Get playback statistics since last ResetStats()
+    void GetStats(TiqiaaUsbIrEmulator_Stats * stats);
+
+    //! Reset playback statistics, next played packet starts a new sequence
+    void ResetStats();
+
+private:
+    static const int RxQueueSize = 256;
+    static const int CaptureQueueSize = 4;
+    static const int MaxReadFragmSize = TiqiaaUsbIr_MaxUsbReadSize - sizeof(TiqiaaUsbIr_Report2Header);
+
+    struct RxFragm {
+        uint64_t DueNs;
+        int Size;
+        uint8_t Data[TiqiaaUsbIr_MaxUsbReadSize];
+    };
+
+    struct Capture {
+        int Size;
+        uint8_t Data[MaxCaptureSize];
+    };
+
+    pthread_mutex_t Mutex;
+    pthread_cond_t Cond;
+    bool IsOpened;
+
+    RxFragm RxQueue[RxQueueSize];
+    int RxHead;
+    int RxCount;
+    uint8_t RxPacketIdx;
+
+    Capture Captures[CaptureQueueSize];
+    int CaptureHead;
+    int CaptureCount;
+    bool RecvArmed;
+    uint8_t RecvCmdId;
+
+    TiqiaaUsbIrReassembler Reasm;
+    uint8_t State;
+    uint64_t PlayEndNs;
+    bool PlayStarted;
+    uint32_t LossRng;
+    TiqiaaUsbIrEmulator_Stats Stats;
+
+    uint32_t NextRandom();
+    void ProcessPacket(const uint8_t * pack, int size);
+    void QueueReply(uint64_t DueNs, const uint8_t * data, int size);
+    void QueueStateReply(uint64_t DueNs, uint8_t cmdId, uint8_t cmdType);
+    void DeliverCapture(uint64_t DueNs);
+};
+
+#endif
@@ -0,0 +1,91 @@
+/*
+ * Userspace driver for Tiqiaa Tview USB IR Transeiver
+ *
+ * Copyright (c) Xen xen-re[at]tutanota.com
+ */
+
+#include "TiqiaaHistogram.h"
+#include <cstring>
+
+TiqiaaUsbIrHistogram::TiqiaaUsbIrHistogram() {
+    Reset();
+}
+
+// bucket = (shift + 1) * SubBucketCount + top SubBucketBits bits below the highest bit
+int TiqiaaUsbIrHistogram::GetBucket(uint64_t us) {
+    int Shift;
+
+    if( us >= 0xFFFFFFFFull ) us = 0xFFFFFFFFull;
+    if( us < (uint64_t)SubBucketCount ) return (int)us;
+    Shift = 63 - __builtin_clzll(us) - SubBucketBits;
+    return (Shift + 1) * SubBucketCount + (int)((us >> Shift) - SubBucketCount);
+}
+
+uint64_t TiqiaaUsbIrHistogram::GetBucketMax(int bucket) {
+    int Shift;
+
+    if( bucket < SubBucketCount ) return bucket;
+    Shift = bucket / SubBucketCount - 1;
+    return (((uint64_t)(SubBucketCount + bucket % SubBucketCount) + 1) << Shift) - 1;
+}
+
+void TiqiaaUsbIrHistogram::Record(uint64_t us) {
+    uint64_t Cur;
+
+    __atomic_fetch_add(&Counts[GetBucket(us)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&Sum, us, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&Count, 1, __ATOMIC_RELEASE);
+    Cur = __atomic_load_n(&Max, __ATOMIC_RELAXED);
+    while( (us > Cur) && !__atomic_compare_exchange_n(&Max, &Cur, us, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED) ) {}
+    Cur = __atomic_load_n(&Min, __ATOMIC_RELAXED);
+    while( (us < Cur) && !__atomic_compare_exchange_n(&Min, &Cur, us, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED) ) {}
+}
+
+void TiqiaaUsbIrHistogram::Reset() {
+    for( int i = 0; i < BucketCount; i++ ) __atomic_store_n(&Counts[i], 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&Count, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&Sum, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&Max, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&Min, UINT64_MAX, __ATOMIC_RELAXED);
+}
+
+uint64_t TiqiaaUsbIrHistogram::GetCount() const {
+    return __atomic_load_n(&Count, __ATOMIC_ACQUIRE);
+}
+
+uint64_t TiqiaaUsbIrHistogram::GetMin() const {
+    uint64_t res = __atomic_load_n(&Min, __ATOMIC_RELAXED);
+    return (res == UINT64_MAX) ? 0 : res;
+}
+
+uint64_t TiqiaaUsbIrHistogram::GetMax() const {
+    return __atomic_load_n(&Max, __ATOMIC_RELAXED);
+}
+
+double TiqiaaUsbIrHistogram::GetMean() const {
+    uint64_t Cnt = GetCount();
+    return Cnt ? (double)__atomic_load_n(&Sum, __ATOMIC_RELAXED) / Cnt : 0.0;
+}
+
+uint64_t TiqiaaUsbIrHistogram::GetPercentile(double p) const {
+    uint64_t Total = 0;
+    uint64_t Need;
+    uint64_t Seen = 0;
+    uint64_t res;
+
+    // counts are summed here, Count may be ahead of them while recording
+    for( int i = 0; i < BucketCount; i++ ) Total += __atomic_load_n(&Counts[i], __ATOMIC_RELAXED);
+    if( Total == 0 ) return 0;
+    if( p < 0 ) p = 0;
+    if( p > 100 ) p = 100;
+    Need = (uint64_t)(p / 100.0 * Total + 0.5);
+    if( Need == 0 ) Need = 1;
+    for( int i = 0; i < BucketCount; i++ ) {
+        Seen += __atomic_load_n(&Counts[i], __ATOMIC_RELAXED);
+        if( Seen >= Need ) {
+            res = GetBucketMax(i);
+            return (res > GetMax()) ? GetMax() : res;
+        }
+    }
+    return GetMax();
+}
@@ -0,0 +1,62 @@
+/*
+ * Userspace driver for Tiqiaa Tview USB IR Transeiver
+ *
+ * Copyright (c) Xen xen-re[at]tutanota.com
+ *
+ * Latency histogram with log-linear buckets (HDR style): 16 buckets per
+ * power of 2, values within 1/16 of the bucket bound, 1 mksec .. 71 min.
+ * Record is lock-free and can be called from any thread; queries read the
+ * counters without stopping recording.
+ */
+
+#ifndef TIQIAA_HISTOGRAM_H
+#define TIQIAA_HISTOGRAM_H
+
+#include <stdint.h>
+
+class TiqiaaUsbIrHistogram {
+public:
+    TiqiaaUsbIrHistogram();
+
+    //! Add value
+    //! us: latency, mksec
+    void Record(uint64_t us);
+
+    //! Add time between two TiqiaaUsbIr_NowNs() values
+    void RecordNs(uint64_t startNs, uint64_t endNs) { Record(endNs > startNs ? (endNs - startNs) / 1000 : 0); }
+
+    //! Remove all values
+    void Reset();
+
+    //! Return: number of values
+    uint64_t GetCount() const;
+
+    //! Return: smallest value, mksec, 0 - no values
+    uint64_t GetMin() const;
+
+    //! Return: largest value, mksec
+    uint64_t GetMax() const;
+
+    //! Return: average value, mksec
+    double GetMean() const;
+
+    //! Return: value at percentile, mksec, upper bound of its bucket
+    //! p: 0..100
+    uint64_t GetPercentile(double p) const;
+
+private:
+    static const int SubBucketBits = 4;
+    static const int SubBucketCount = 1 << SubBucketBits;
+    static const int BucketCount = (32 - SubBucketBits + 1) * SubBucketCount;
+
+    uint32_t Counts[BucketCount];
+    uint64_t Count;
+    uint64_t Sum;
+    uint64_t Min;
+    uint64_t Max;
+
+    static int GetBucket(uint64_t us);
+    static uint64_t GetBucketMax(int bucket);
+};
+
+#endif
@@ -0,0 +1,105 @@
+/*
+ * Userspace driver for Tiqiaa Tview USB IR Transeiver
+ *
+ * Copyright (c) Xen xen-re[at]tutanota.com
+ *
+ * NEC pulse writer and compile-time NEC encoder. TiqiaaNecFrame_WritePulse
+ * is the only NEC pulse writer: TiqiaaUsbIr builds its encoder tables with
+ * it at run time and TiqiaaNecFrame<IrCode> is built with it by the compiler,
+ * so sending a known code copies a static array.
+ *
+ * Example:
+ *
+ * Ir.SendNecSignal<0x8002>();
+ * Ir.SendIR(38000, (void *)TiqiaaNecFrame<0x8004>::Data, TiqiaaNecFrame<0x8004>::Size);
+ */
+
+#ifndef TIQIAA_NEC_FRAME_H
+#define TIQIAA_NEC_FRAME_H
+
+#include <stdint.h>
+
+//! Size of every NEC frame in Tiqiaa signal data
+static const int TiqiaaNecFrame_MaxSize = 93;
+
+static const int TiqiaaNecFrame_PulseSize = 1125; //562.5 mks
+static const int TiqiaaNecFrame_IrSendTickSize = 32; //16 mks
+static const int TiqiaaNecFrame_MaxIrSendBlockSize = 127; //ticks
+
+struct TiqiaaNecFrame_Data{
+    uint8_t Data[TiqiaaNecFrame_MaxSize];
+    int Size;
+};
+
+struct TqIrWriteData{
+    uint8_t * Buf;
+    int Size;
+    int PulseTime;
+    int SenderTime;
+};
+
+//! Write NEC pulses as Tiqiaa send blocks, the rounding remainder is carried to the next pulse
+//! IrWrData: output buffer and timing state
+//! PulseCount: duration, 562.5 mks pulses
+//! isSet: true - mark, false - space
+constexpr void TiqiaaNecFrame_WritePulse(TqIrWriteData * IrWrData, int PulseCount, bool isSet) {
+    int TickCount = 0;
+    int SendBlockSize = 0;
+
+    IrWrData->PulseTime += PulseCount * TiqiaaNecFrame_PulseSize;
+    TickCount = IrWrData->PulseTime - IrWrData->SenderTime;
+    TickCount /= TiqiaaNecFrame_IrSendTickSize;
+    IrWrData->SenderTime += TickCount * TiqiaaNecFrame_IrSendTickSize;
+    while( TickCount > 0 ) {
+        SendBlockSize = TickCount;
+        if( SendBlockSize > TiqiaaNecFrame_MaxIrSendBlockSize ) SendBlockSize = TiqiaaNecFrame_MaxIrSendBlockSize;
+        TickCount -= SendBlockSize;
+        if( isSet ) SendBlockSize |= 0x80;
+        IrWrData->Buf[IrWrData->Size] = SendBlockSize;
+        IrWrData->Size ++;
+    }
+}
+
+//! Return: Tiqiaa signal data of NEC IR code, same as TiqiaaUsbIr::WriteIrNecSignal
+constexpr TiqiaaNecFrame_Data TiqiaaNecFrame_Encode(uint16_t IrCode) {
+    TiqiaaNecFrame_Data Frame = {{0}, 0};
+    TqIrWriteData IrWrData = {Frame.Data, 0, 0, 0};
+    uint8_t Addr = IrCode >> 8;
+    uint8_t Cmd = IrCode & 0xFF;
+    // address, inverted address, command, inverted command; LSB first
+    uint32_t tcode = Addr | ((uint32_t)(uint8_t)~Addr << 8) | ((uint32_t)Cmd << 16) | ((uint32_t)(uint8_t)~Cmd << 24);
+
+    TiqiaaNecFrame_WritePulse(&IrWrData, 16, true);
+    TiqiaaNecFrame_WritePulse(&IrWrData, 8, false);
+    for( int i = 0; i < 32; i++ ) {
+        TiqiaaNecFrame_WritePulse(&IrWrData, 1, true);
+        TiqiaaNecFrame_WritePulse(&IrWrData, (tcode & 1) ? 3 : 1, false);
+        tcode >>= 1;
+    }
+    TiqiaaNecFrame_WritePulse(&IrWrData, 1, true);
+    TiqiaaNecFrame_WritePulse(&IrWrData, 72, false);
+    Frame.Size = IrWrData.Size;
+    return Frame;
+}
+
+//! Return: true - size and data of frame equal data[0..size)
+constexpr bool TiqiaaNecFrame_Equal(const TiqiaaNecFrame_Data & frame, const uint8_t * data, int size) {
+    if( frame.Size != size ) return false;
+    for( int i = 0; i < size; i++ ) {
+        if( frame.Data[i] != data[i] ) return false;
+    }
+    return true;
+}
+
+template<uint16_t IrCode>
+struct TiqiaaNecFrame {
+    static constexpr TiqiaaNecFrame_Data Frame = TiqiaaNecFrame_Encode(IrCode);
+    static constexpr const uint8_t * Data = Frame.Data;
+    static constexpr int Size = Frame.Size;
+};
+
+template<uint16_t IrCode> constexpr TiqiaaNecFrame_Data TiqiaaNecFrame<IrCode>::Frame;
+template<uint16_t IrCode> constexpr const uint8_t * TiqiaaNecFrame<IrCode>::Data;
+template<uint16_t IrCode> constexpr int TiqiaaNecFrame<IrCode>::Size;
+
+#endif
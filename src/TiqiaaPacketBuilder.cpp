@@ -0,0 +1,106 @@
+/*
+ * Userspace driver for Tiqiaa Tview USB IR Transeiver
+ *
+ * Copyright (c) Xen xen-re[at]tutanota.com
+ */
+
+#include "TiqiaaPacketBuilder.h"
+#include <cstring>
+
+TiqiaaUsbIrPacketBuilder::TiqiaaUsbIrPacketBuilder() {
+    FragmCount = 0;
+    PackSize = 0;
+}
+
+void TiqiaaUsbIrPacketBuilder::Start(int size) {
+    int FragmSize;
+
+    PackSize = size;
+    FragmCount = size / MaxFragmSize;
+    if( (size % MaxFragmSize) != 0 ) FragmCount ++;
+    for( int i = 0; i < FragmCount; i++ ) {
+        TiqiaaUsbIr_Report2Header * ReportHdr = (TiqiaaUsbIr_Report2Header *)Fragms[i];
+        FragmSize = size - i * MaxFragmSize;
+        if( FragmSize > MaxFragmSize ) FragmSize = MaxFragmSize;
+        ReportHdr->ReportId = TiqiaaUsbIr_WriteReportId;
+        ReportHdr->FragmSize = FragmSize + 3;
+        ReportHdr->PacketIdx = 0;
+        ReportHdr->FragmCount = FragmCount;
+        ReportHdr->FragmIdx = i + 1;
+    }
+}
+
+void TiqiaaUsbIrPacketBuilder::Append(int * pos, const void * data, int size) {
+    const uint8_t * src = (const uint8_t *)data;
+    int FragmOffs;
+    int CopySize;
+
+    while( size > 0 ) {
+        FragmOffs = *pos % MaxFragmSize;
+        CopySize = MaxFragmSize - FragmOffs;
+        if( CopySize > size ) CopySize = size;
+        memcpy(Fragms[*pos / MaxFragmSize] + sizeof(TiqiaaUsbIr_Report2Header) + FragmOffs, src, CopySize);
+        *pos += CopySize;
+        src += CopySize;
+        size -= CopySize;
+    }
+}
+
+bool TiqiaaUsbIrPacketBuilder::Build(const TiqiaaUsbIr_IrSegment * segs, int segCount) {
+    int size = 0;
+    int pos = 0;
+
+    for( int i = 0; i < segCount; i++ ) {
+        if( segs[i].Size < 0 ) return false;
+        size += segs[i].Size;
+        if( size > TiqiaaUsbIr_MaxUsbPacketSize ) return false;
+    }
+    if( size <= 0 ) return false;
+    Start(size);
+    for( int i = 0; i < segCount; i++ ) Append(&pos, segs[i].Data, segs[i].Size);
+    return true;
+}
+
+bool TiqiaaUsbIrPacketBuilder::BuildCmd(uint8_t cmdType, uint8_t cmdId) {
+    TiqiaaUsbIr_SendCmdPack Pack;
+    TiqiaaUsbIr_IrSegment Seg = {&Pack, sizeof(Pack)};
+
+    Pack.StartSign = TiqiaaUsbIr_PackStartSign;
+    Pack.CmdType = cmdType;
+    Pack.CmdId = cmdId;
+    Pack.EndSign = TiqiaaUsbIr_PackEndSign;
+    return Build(&Seg, 1);
+}
+
+bool TiqiaaUsbIrPacketBuilder::BuildIR(uint8_t IrFreqId, const TiqiaaUsbIr_IrSegment * segs, int segCount, uint8_t cmdId) {
+    TiqiaaUsbIr_SendIRPackHeader PackHeader;
+    uint16_t EndSign = TiqiaaUsbIr_PackEndSign;
+    int size = 0;
+    int pos = 0;
+
+    for( int i = 0; i < segCount; i++ ) {
+        if( segs[i].Size < 0 ) return false;
+        size += segs[i].Size;
+        if( size > MaxIrDataSize ) return false;
+    }
+    PackHeader.StartSign = TiqiaaUsbIr_PackStartSign;
+    PackHeader.CmdType = 'D';
+    PackHeader.CmdId = cmdId;
+    PackHeader.IrFreqId = IrFreqId;
+
+    Start(size + sizeof(PackHeader) + sizeof(EndSign));
+    Append(&pos, &PackHeader, sizeof(PackHeader));
+    for( int i = 0; i < segCount; i++ ) Append(&pos, segs[i].Data, segs[i].Size);
+    Append(&pos, &EndSign, sizeof(EndSign));
+    return true;
+}
+
+void TiqiaaUsbIrPacketBuilder::SetPacketIdx(uint8_t PacketIdx) {
+    for( int i = 0; i < FragmCount; i++ )
+        ((TiqiaaUsbIr_Report2Header *)Fragms[i])->PacketIdx = PacketIdx;
+}
+
+void TiqiaaUsbIrPacketBuilder::SetCmdId(uint8_t cmdId) {
+    // CmdId follows StartSign in both command and IR packets, always in first fragment
+    Fragms[0][sizeof(TiqiaaUsbIr_Report2Header) + sizeof(uint16_t)] = cmdId;
+}
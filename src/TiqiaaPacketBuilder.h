@@ -0,0 +1,88 @@
+/*
+ * Userspace driver for Tiqiaa Tview USB IR Transeiver
+ *
+ * Copyright (c) Xen xen-re[at]tutanota.com
+ *
+ * Builds a packet directly into ready-to-submit Report2 fragments. Data is
+ * passed as a list of segments and copied once, straight into the fragment
+ * that will be written to the device.
+ *
+ * Example:
+ *
+ * TiqiaaUsbIr_IrSegment Segs[2] = {{Head, HeadSize}, {Tail, TailSize}};
+ * TiqiaaUsbIrPacketBuilder Pack;
+ * Pack.BuildIR(IrFreqId, Segs, 2, CmdId);
+ * for( int i = 0; i < Pack.GetFragmCount(); i++ ) Write(Pack.GetFragm(i), Pack.GetFragmSize(i));
+ */
+
+#ifndef TIQIAA_PACKET_BUILDER_H
+#define TIQIAA_PACKET_BUILDER_H
+
+#include <stdint.h>
+
+#include "TiqiaaUsbProto.h"
+
+//! One piece of packet data, like struct iovec
+struct TiqiaaUsbIr_IrSegment{
+    const void * Data;
+    int Size;
+};
+
+class TiqiaaUsbIrPacketBuilder {
+public:
+    static const int MaxFragmSize = 56;
+    static const int MaxFragmCount = (TiqiaaUsbIr_MaxUsbPacketSize + MaxFragmSize - 1) / MaxFragmSize;
+    static const int FragmBufSize = sizeof(TiqiaaUsbIr_Report2Header) + MaxFragmSize;
+    //! Max size of IR signal data in one packet
+    static const int MaxIrDataSize = TiqiaaUsbIr_MaxUsbPacketSize - sizeof(TiqiaaUsbIr_SendIRPackHeader) - sizeof(uint16_t);
+
+    TiqiaaUsbIrPacketBuilder();
+
+    //! Build packet from raw data, no header or signatures are added
+    //! segs: packet data segments
+    //! segCount: number of segments
+    //! Return: true - success, false - size is 0 or exceeds MaxUsbPacketSize
+    bool Build(const TiqiaaUsbIr_IrSegment * segs, int segCount);
+
+    //! Build command packet
+    //! cmdType: Command type
+    //! cmdId: Command ID
+    //! Return: true - success, false - fail
+    bool BuildCmd(uint8_t cmdType, uint8_t cmdId);
+
+    //! Build IR data packet: TiqiaaUsbIr_SendIRPackHeader, segments, EndSign
+    //! IrFreqId: index of TiqiaaUsbIr_IrFreqTable
+    //! segs: IR signal data segments
+    //! segCount: number of segments
+    //! cmdId: Command ID
+    //! Return: true - success, false - signal is larger than MaxIrDataSize
+    bool BuildIR(uint8_t IrFreqId, const TiqiaaUsbIr_IrSegment * segs, int segCount, uint8_t cmdId);
+
+    //! Patch PacketIdx of all fragments
+    void SetPacketIdx(uint8_t PacketIdx);
+
+    //! Patch CmdId of built command or IR packet
+    void SetCmdId(uint8_t cmdId);
+
+    //! Return: number of fragments of the built packet
+    int GetFragmCount() const { return FragmCount; }
+
+    //! Return: fragment data, starting with TiqiaaUsbIr_Report2Header
+    uint8_t * GetFragm(int idx) { return Fragms[idx]; }
+
+    //! Return: size of fragment to write, including the header
+    int GetFragmSize(int idx) const { return ((const TiqiaaUsbIr_Report2Header *)Fragms[idx])->FragmSize + 2; }
+
+    //! Return: size of the built packet
+    int GetPacketSize() const { return PackSize; }
+
+private:
+    uint8_t Fragms[MaxFragmCount][FragmBufSize];
+    int FragmCount;
+    int PackSize;
+
+    void Start(int size);
+    void Append(int * pos, const void * data, int size);
+};
+
+#endif
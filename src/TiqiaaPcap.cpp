@@ -0,0 +1,198 @@
+/*
+ * Userspace driver for Tiqiaa Tview USB IR Transeiver
+ *
+ * Copyright (c) Xen xen-re[at]tutanota.com
+ */
+
+#include "TiqiaaPcap.h"
+#include <cstring>
+#include <time.h>
+
+static const uint32_t PcapMagic = 0xA1B2C3D4;
+static const uint32_t LinkTypeUsbLinuxMmapped = 220;
+
+static_assert(sizeof(TiqiaaUsbIrPcap_UsbmonHeader) == 64, "usbmon mmapped header is 64 bytes");
+
+struct PcapFileHeader {
+    uint32_t Magic;
+    uint16_t VersionMajor;
+    uint16_t VersionMinor;
+    int32_t ThisZone;
+    uint32_t SigFigs;
+    uint32_t SnapLen;
+    uint32_t LinkType;
+};
+
+TiqiaaUsbIrPcap::TiqiaaUsbIrPcap() {
+    pthread_condattr_t CondAttr;
+
+    File = NULL;
+    Active = false;
+    QueueHead = 0;
+    QueueCount = 0;
+    UrbId = 0;
+    Written = 0;
+    Dropped = 0;
+
+    pthread_condattr_init(&CondAttr);
+    pthread_condattr_setclock(&CondAttr, CLOCK_MONOTONIC);
+    pthread_cond_init(&Cond, &CondAttr);
+    pthread_condattr_destroy(&CondAttr);
+    pthread_mutex_init(&Mutex, NULL);
+}
+
+TiqiaaUsbIrPcap::~TiqiaaUsbIrPcap() {
+    Close();
+    pthread_mutex_destroy(&Mutex);
+    pthread_cond_destroy(&Cond);
+}
+
+bool TiqiaaUsbIrPcap::Open(const char * fileName) {
+    PcapFileHeader Hdr;
+
+    if( File ) return false;
+    File = fopen(fileName, "wb");
+    if( File == NULL ) return false;
+
+    Hdr.Magic = PcapMagic;
+    Hdr.VersionMajor = 2;
+    Hdr.VersionMinor = 4;
+    Hdr.ThisZone = 0;
+    Hdr.SigFigs = 0;
+    Hdr.SnapLen = sizeof(TiqiaaUsbIrPcap_UsbmonHeader) + TiqiaaUsbIr_MaxUsbReadSize;
+    Hdr.LinkType = LinkTypeUsbLinuxMmapped;
+    QueueHead = 0;
+    QueueCount = 0;
+    Written = 0;
+    Dropped = 0;
+    Active = true;
+    if( (fwrite(&Hdr, sizeof(Hdr), 1, File) == 1) && (pthread_create(&Thread, NULL, TiqiaaUsbIrPcap::RunThreadFn, (void*)this) == 0) ) return true;
+    Active = false;
+    fclose(File);
+    File = NULL;
+    return false;
+}
+
+void TiqiaaUsbIrPcap::Close() {
+    if( File == NULL ) return;
+    pthread_mutex_lock(&Mutex);
+    Active = false;
+    pthread_cond_broadcast(&Cond);
+    pthread_mutex_unlock(&Mutex);
+    pthread_join(Thread, NULL);
+    fclose(File);
+    File = NULL;
+}
+
+bool TiqiaaUsbIrPcap::IsOpen() {
+    return File != NULL;
+}
+
+uint64_t TiqiaaUsbIrPcap::NewUrbId() {
+    return __atomic_add_fetch(&UrbId, 1, __ATOMIC_RELAXED);
+}
+
+void TiqiaaUsbIrPcap::AddBulk(uint64_t urbId, char type, uint16_t busNum, uint8_t devNum, uint8_t ep,
+                              const uint8_t * data, int size, int length, int status) {
+    struct timespec ts;
+    Record * Rec;
+
+    if( (data == NULL) || (size < 0) ) size = 0;
+    if( size > TiqiaaUsbIr_MaxUsbReadSize ) size = TiqiaaUsbIr_MaxUsbReadSize;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    pthread_mutex_lock(&Mutex);
+    if( !Active ) {
+        pthread_mutex_unlock(&Mutex);
+        return;
+    }
+    if( QueueCount >= QueueSize ) {
+        Dropped++;
+        pthread_mutex_unlock(&Mutex);
+        return;
+    }
+    Rec = &Queue[(QueueHead + QueueCount) % QueueSize];
+    memset(&Rec->Hdr, 0, sizeof(Rec->Hdr));
+    Rec->Hdr.Id = urbId;
+    Rec->Hdr.Type = type;
+    Rec->Hdr.XferType = 3;
+    Rec->Hdr.EpNum = ep;
+    Rec->Hdr.DevNum = devNum;
+    Rec->Hdr.BusNum = busNum;
+    Rec->Hdr.FlagSetup = '-';
+    Rec->Hdr.FlagData = size ? 0 : ((ep & 0x80) ? '<' : '>');
+    Rec->Hdr.TsSec = ts.tv_sec;
+    Rec->Hdr.TsUsec = ts.tv_nsec / 1000;
+    Rec->Hdr.Status = status;
+    Rec->Hdr.Length = length;
+    Rec->Hdr.LenCap = size;
+    if( size ) memcpy(Rec->Data, data, size);
+    Rec->PcapHdr[0] = ts.tv_sec;
+    Rec->PcapHdr[1] = ts.tv_nsec / 1000;
+    Rec->PcapHdr[2] = sizeof(Rec->Hdr) + size;
+    Rec->PcapHdr[3] = Rec->PcapHdr[2];
+    QueueCount++;
+    if( QueueCount == 1 ) pthread_cond_broadcast(&Cond);
+    pthread_mutex_unlock(&Mutex);
+}
+
+uint64_t TiqiaaUsbIrPcap::GetWritten() {
+    uint64_t res;
+
+    pthread_mutex_lock(&Mutex);
+    res = Written;
+    pthread_mutex_unlock(&Mutex);
+    return res;
+}
+
+uint64_t TiqiaaUsbIrPcap::GetDropped() {
+    uint64_t res;
+
+    pthread_mutex_lock(&Mutex);
+    res = Dropped;
+    pthread_mutex_unlock(&Mutex);
+    return res;
+}
+
+void *TiqiaaUsbIrPcap::RunThreadFn(void *pcls)
+{
+    if( pcls == NULL ) return NULL;
+    TiqiaaUsbIrPcap* cls = static_cast<TiqiaaUsbIrPcap*>(pcls);
+    cls->ThreadFn();
+    return 0;
+}
+
+void TiqiaaUsbIrPcap::ThreadFn() {
+    Record * Rec;
+    bool Flushed = true;
+    int Count;
+
+    pthread_mutex_lock(&Mutex);
+    while( Active || QueueCount ) {
+        if( QueueCount == 0 ) {
+            if( !Flushed ) { // idle, make the file readable while capturing
+                pthread_mutex_unlock(&Mutex);
+                fflush(File);
+                pthread_mutex_lock(&Mutex);
+                Flushed = true;
+                continue;
+            }
+            pthread_cond_wait(&Cond, &Mutex);
+            continue;
+        }
+        // slots stay queued while written, AddBulk only writes free slots
+        Count = QueueCount;
+        pthread_mutex_unlock(&Mutex);
+
+        for( int i = 0; i < Count; i++ ) {
+            Rec = &Queue[(QueueHead + i) % QueueSize];
+            fwrite(Rec, sizeof(Rec->PcapHdr) + Rec->PcapHdr[2], 1, File);
+        }
+        Flushed = false;
+
+        pthread_mutex_lock(&Mutex);
+        QueueHead = (QueueHead + Count) % QueueSize;
+        QueueCount -= Count;
+        Written += Count;
+    }
+    pthread_mutex_unlock(&Mutex);
+}
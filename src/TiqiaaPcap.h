@@ -0,0 +1,110 @@
+/*
+ * Userspace driver for Tiqiaa Tview USB IR Transeiver
+ *
+ * Copyright (c) Xen xen-re[at]tutanota.com
+ *
+ * Capture of driver USB traffic to a pcap file with usbmon framing
+ * (LINKTYPE_USB_LINUX_MMAPPED, 64 byte headers), readable by Wireshark.
+ * Fragments written by the driver are recorded as bulk OUT submit and
+ * complete, fragments read as bulk IN complete. USB threads only copy
+ * records into a queue, a background thread writes the file.
+ *
+ * Example:
+ *
+ * TiqiaaUsbIrPcap Pcap;
+ * Pcap.Open("ir.pcap");
+ * Ir.Pcap = &Pcap;
+ * ...
+ * Ir.Pcap = NULL;
+ * Pcap.Close();
+ */
+
+#ifndef TIQIAA_PCAP_H
+#define TIQIAA_PCAP_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#include "TiqiaaUsbProto.h"
+
+//! usbmon event header, host byte order, see Documentation/usb/usbmon.rst
+struct TiqiaaUsbIrPcap_UsbmonHeader{
+    uint64_t Id; //!< URB id, same in submit and complete
+    uint8_t Type; //!< 'S' - submit, 'C' - complete, 'E' - error
+    uint8_t XferType; //!< 3 - bulk
+    uint8_t EpNum; //!< endpoint, 0x80 - IN
+    uint8_t DevNum;
+    uint16_t BusNum;
+    char FlagSetup; //!< '-' - no setup packet
+    char FlagData; //!< 0 - data follows, '<' / '>' - no data
+    int64_t TsSec;
+    int32_t TsUsec;
+    int32_t Status; //!< 0 or -errno
+    uint32_t Length; //!< URB length
+    uint32_t LenCap; //!< bytes of data captured
+    uint8_t Setup[8];
+    int32_t Interval;
+    int32_t StartFrame;
+    uint32_t XferFlags;
+    uint32_t NDesc;
+};
+
+class TiqiaaUsbIrPcap {
+public:
+    //! Records queued for the writer thread, more are dropped
+    static const int QueueSize = 1024;
+
+    TiqiaaUsbIrPcap();
+    virtual ~TiqiaaUsbIrPcap();
+
+    //! Create pcap file and start writer thread
+    //! Return: true - success, false - fail
+    bool Open(const char * fileName);
+
+    //! Write queued records and close file
+    void Close();
+
+    //! Return: true - capture is open
+    bool IsOpen();
+
+    //! Return: new URB id
+    uint64_t NewUrbId();
+
+    //! Queue bulk URB event, never waits for file I/O, can be called from any thread
+    //! urbId: from NewUrbId(), the same for submit and complete
+    //! type: 'S' - submit, 'C' - complete
+    //! busNum, devNum: device address; ep: endpoint number, 0x80 - IN
+    //! data: captured data, NULL - none; size: size of data
+    //! length: URB length; status: 0 - success, -errno - fail
+    void AddBulk(uint64_t urbId, char type, uint16_t busNum, uint8_t devNum, uint8_t ep,
+                 const uint8_t * data, int size, int length, int status);
+
+    //! Return: number of records written to file / dropped because the queue was full
+    uint64_t GetWritten();
+    uint64_t GetDropped();
+
+private:
+    struct Record {
+        uint32_t PcapHdr[4]; // pcap record header: ts_sec, ts_usec, incl_len, orig_len
+        TiqiaaUsbIrPcap_UsbmonHeader Hdr;
+        uint8_t Data[TiqiaaUsbIr_MaxUsbReadSize];
+    };
+
+    FILE * File;
+    pthread_t Thread;
+    pthread_mutex_t Mutex;
+    pthread_cond_t Cond;
+    bool Active;
+    Record Queue[QueueSize];
+    int QueueHead;
+    int QueueCount;
+    uint64_t UrbId;
+    uint64_t Written;
+    uint64_t Dropped;
+
+    static void *RunThreadFn(void *pcls);
+    void ThreadFn();
+};
+
+#endif
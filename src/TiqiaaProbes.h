@@ -0,0 +1,56 @@
+/*
+ * Userspace driver for Tiqiaa Tview USB IR Transeiver
+ *
+ * Copyright (c) Xen xen-re[at]tutanota.com
+ *
+ * USDT (SystemTap SDT) probes of provider "tiqiaa". A probe is a single nop
+ * in the code and a note in the binary, perf and bpftrace attach to it in a
+ * running process:
+ *
+ * bpftrace -l 'usdt:bin/TiqiaaUsb-cli:tiqiaa:*'
+ * perf buildid-cache --add bin/TiqiaaUsb-cli && perf list sdt
+ *
+ * Probes are compiled in when <sys/sdt.h> is found (systemtap-sdt-dev,
+ * systemtap-sdt-devel). The Makefile checks for it, defines TIQIAA_HAVE_SDT
+ * or TIQIAA_NO_SDT and says when the probes are left out; other builds
+ * fall back to __has_include. Define TIQIAA_NO_SDT to leave them out.
+ *
+ * Probes and arguments:
+ * fragm_send(cmdType, cmdId, packetIdx, fragmIdx, size) - USB fragment is written
+ * fragm_recv(packetIdx, fragmIdx, fragmCount, size, result) - USB fragment is read,
+ *     result: TiqiaaUsbIrReassembler::PushFragment result
+ * packet_recv(cmdId, cmdType, state, size, packetIdx) - complete packet is dispatched,
+ *     packetIdx: PacketIdx of its fragments, as in fragm_recv
+ * reply_matched(cmdType, cmdId, waitUs) - awaited reply arrived
+ * reply_lost(cmdType, cmdId, waitUs) - a later reply arrived instead
+ * reply_timeout(cmdType, cmdId, waitUs) - wait expired
+ * state_change(oldState, newState) - device reported another state
+ * callback_entry(size), callback_exit(size) - IrRecvCallback is called
+ */
+
+#ifndef TIQIAA_PROBES_H
+#define TIQIAA_PROBES_H
+
+#if !defined(TIQIAA_NO_SDT) && !defined(TIQIAA_HAVE_SDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define TIQIAA_HAVE_SDT 1
+#endif
+#endif
+
+#if defined(TIQIAA_HAVE_SDT) && !defined(TIQIAA_NO_SDT)
+#include <sys/sdt.h>
+#define TIQIAA_PROBE1(name, a1) STAP_PROBE1(tiqiaa, name, a1)
+#define TIQIAA_PROBE2(name, a1, a2) STAP_PROBE2(tiqiaa, name, a1, a2)
+#define TIQIAA_PROBE3(name, a1, a2, a3) STAP_PROBE3(tiqiaa, name, a1, a2, a3)
+#define TIQIAA_PROBE4(name, a1, a2, a3, a4) STAP_PROBE4(tiqiaa, name, a1, a2, a3, a4)
+#define TIQIAA_PROBE5(name, a1, a2, a3, a4, a5) STAP_PROBE5(tiqiaa, name, a1, a2, a3, a4, a5)
+#else
+// arguments are type checked but never evaluated
+#define TIQIAA_PROBE1(name, a1) do { if( 0 ) { (void)(a1); } } while( 0 )
+#define TIQIAA_PROBE2(name, a1, a2) do { if( 0 ) { (void)(a1); (void)(a2); } } while( 0 )
+#define TIQIAA_PROBE3(name, a1, a2, a3) do { if( 0 ) { (void)(a1); (void)(a2); (void)(a3); } } while( 0 )
+#define TIQIAA_PROBE4(name, a1, a2, a3, a4) do { if( 0 ) { (void)(a1); (void)(a2); (void)(a3); (void)(a4); } } while( 0 )
+#define TIQIAA_PROBE5(name, a1, a2, a3, a4, a5) do { if( 0 ) { (void)(a1); (void)(a2); (void)(a3); (void)(a4); (void)(a5); } } while( 0 )
+#endif
+
+#endif
@@ -0,0 +1,69 @@
+/*
+ * Userspace driver for Tiqiaa Tview USB IR Transeiver
+ *
+ * Copyright (c) Xen xen-re[at]tutanota.com
+ */
+
+#include "TiqiaaReassembler.h"
+#include <cstring>
+
+TiqiaaUsbIrReassembler::TiqiaaUsbIrReassembler(uint8_t ReportId) {
+    this->ReportId = ReportId;
+    Reset();
+}
+
+void TiqiaaUsbIrReassembler::Reset() {
+    FragmCount = 0;
+    PackSize = 0;
+    PacketIdx = 0;
+    LastFragmIdx = 0;
+}
+
+int TiqiaaUsbIrReassembler::PushFragment(const uint8_t * fragm, int size) {
+    const TiqiaaUsbIr_Report2Header * ReportHdr = (const TiqiaaUsbIr_Report2Header *)fragm;
+    int FragmSize;
+    int res = FragmAccepted;
+
+    // FragmSize counts PacketIdx, FragmCount and FragmIdx
+    if( size <= (int)sizeof(TiqiaaUsbIr_Report2Header) ) return FragmBad;
+    if( ReportHdr->ReportId != ReportId ) return FragmWrongReport;
+    if( (ReportHdr->FragmSize < 3) || ((ReportHdr->FragmSize + 2) > size) ) return FragmBad;
+
+    if( FragmCount ) { // adding data to existing packet
+        if( (ReportHdr->PacketIdx == PacketIdx) && (ReportHdr->FragmCount == FragmCount) ) {
+            if( ReportHdr->FragmIdx == (LastFragmIdx + 1) ) {
+                LastFragmIdx++;
+            } else if( ReportHdr->FragmIdx == LastFragmIdx ) {
+                return FragmDuplicate;
+            } else { // wrong fragment - drop packet
+                FragmCount = 0;
+                res = FragmRestarted;
+            }
+        } else {
+            FragmCount = 0;
+            res = FragmRestarted;
+        }
+    }
+    if( FragmCount == 0 ) { // new packet
+        if( (ReportHdr->FragmCount == 0) || (ReportHdr->FragmIdx != 1) ) return FragmOutOfOrder;
+        PacketIdx = ReportHdr->PacketIdx;
+        FragmCount = ReportHdr->FragmCount;
+        PackSize = 0;
+        LastFragmIdx = 1;
+    }
+
+    FragmSize = ReportHdr->FragmSize + 2 - sizeof(TiqiaaUsbIr_Report2Header);
+    if( (PackSize + FragmSize) > TiqiaaUsbIr_MaxUsbPacketSize ) { // buffer overflow - drop packet
+        FragmCount = 0;
+        return PacketOverflow;
+    }
+    memcpy(PackBuf + PackSize, fragm + sizeof(TiqiaaUsbIr_Report2Header), FragmSize);
+    PackSize += FragmSize;
+    if( LastFragmIdx != FragmCount ) return res;
+
+    FragmCount = 0;
+    // shortest packet: StartSign, CmdId, CmdType, EndSign
+    if( PackSize < 6 ) return PacketBadSign;
+    if( (*((uint16_t *)(PackBuf)) != TiqiaaUsbIr_PackStartSign) || (*((uint16_t *)(PackBuf + PackSize - 2)) != TiqiaaUsbIr_PackEndSign) ) return PacketBadSign;
+    return PacketComplete;
+}
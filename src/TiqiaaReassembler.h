@@ -0,0 +1,63 @@
+/*
+ * Userspace driver for Tiqiaa Tview USB IR Transeiver
+ *
+ * Copyright (c) Xen xen-re[at]tutanota.com
+ *
+ * Report fragment reassembler. Does not depend on libusb, fragments can come
+ * from the device, a recording or a synthetic generator.
+ *
+ * Example:
+ *
+ * TiqiaaUsbIrReassembler Reasm;
+ * if( Reasm.PushFragment(buf, size) == TiqiaaUsbIrReassembler::PacketComplete )
+ *     Process(Reasm.GetPacketData(), Reasm.GetPacketSize());
+ */
+
+#ifndef TIQIAA_REASSEMBLER_H
+#define TIQIAA_REASSEMBLER_H
+
+#include <stdint.h>
+
+#include "TiqiaaUsbProto.h"
+
+class TiqiaaUsbIrReassembler {
+public:
+    //! PushFragment results
+    static const int FragmBad = 0; //!< too short or wrong FragmSize
+    static const int FragmWrongReport = 1; //!< wrong ReportId
+    static const int FragmOutOfOrder = 2; //!< not the expected fragment, current packet dropped
+    static const int FragmDuplicate = 3; //!< repeat of the last accepted fragment, ignored
+    static const int FragmAccepted = 4; //!< appended to current packet
+    static const int FragmRestarted = 5; //!< current packet dropped, fragment started a new one
+    static const int PacketOverflow = 6; //!< packet exceeds MaxUsbPacketSize, dropped
+    static const int PacketBadSign = 7; //!< all fragments received but ST/EN signature is wrong
+    static const int PacketComplete = 8; //!< packet is ready, see GetPacketData()
+
+    //! ReportId: ReportId of accepted fragments
+    TiqiaaUsbIrReassembler(uint8_t ReportId = TiqiaaUsbIr_ReadReportId);
+
+    //! Add received fragment
+    //! fragm: fragment data starting with TiqiaaUsbIr_Report2Header
+    //! size: number of bytes received
+    //! Return: one of Fragm* / Packet* constants
+    int PushFragment(const uint8_t * fragm, int size);
+
+    //! Return: packet data without ST/EN signatures, valid after PacketComplete until next PushFragment
+    const uint8_t * GetPacketData() const { return PackBuf + sizeof(uint16_t); }
+
+    //! Return: size of GetPacketData()
+    int GetPacketSize() const { return PackSize - 2 * sizeof(uint16_t); }
+
+    //! Drop partially received packet
+    void Reset();
+
+private:
+    uint8_t PackBuf[TiqiaaUsbIr_MaxUsbPacketSize];
+    int PackSize;
+    uint8_t ReportId;
+    uint8_t PacketIdx;
+    uint8_t FragmCount; // 0 - not receiving packet
+    uint8_t LastFragmIdx;
+};
+
+#endif
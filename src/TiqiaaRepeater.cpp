@@ -0,0 +1,173 @@
+/*
+ * Userspace driver for Tiqiaa Tview USB IR Transeiver
+ *
+ * Copyright (c) Xen xen-re[at]tutanota.com
+ */
+
+#include "TiqiaaRepeater.h"
+#include "TiqiaaTime.h"
+#include <cstring>
+
+TiqiaaUsbIrRepeater::TiqiaaUsbIrRepeater() {
+    pthread_condattr_t CondAttr;
+
+    Freq = 38000;
+    Filter = NULL;
+    FilterContext = NULL;
+    Rx = NULL;
+    Tx = NULL;
+    Active = false;
+    QueueHead = 0;
+    QueueCount = 0;
+    memset(&Stats, 0, sizeof(Stats));
+
+    pthread_condattr_init(&CondAttr);
+    pthread_condattr_setclock(&CondAttr, CLOCK_MONOTONIC);
+    pthread_cond_init(&Cond, &CondAttr);
+    pthread_condattr_destroy(&CondAttr);
+    pthread_mutex_init(&Mutex, NULL);
+}
+
+TiqiaaUsbIrRepeater::~TiqiaaUsbIrRepeater() {
+    Stop();
+    pthread_mutex_destroy(&Mutex);
+    pthread_cond_destroy(&Cond);
+}
+
+bool TiqiaaUsbIrRepeater::Start(TiqiaaUsbIr * rx, TiqiaaUsbIr * tx) {
+    if( Active || (rx == NULL) || (tx == NULL) || (rx == tx) ) return false;
+    if( !rx->IsOpen() || !tx->IsOpen() ) return false;
+
+    Rx = rx;
+    Tx = tx;
+    QueueHead = 0;
+    QueueCount = 0;
+    ResetStats();
+    PrevOpenLoop = Tx->IrOpenLoop;
+    Tx->IrOpenLoop = true; // next signal can be sent while the previous one plays
+    PrevCallback = Rx->IrRecvCallback;
+    PrevCbContext = Rx->IrRecvCbContext;
+    Rx->IrRecvCbContext = this;
+    Rx->IrRecvCallback = &TiqiaaUsbIrRepeater::RecvCallback;
+
+    Active = true;
+    if( pthread_create(&Thread, NULL, TiqiaaUsbIrRepeater::RunThreadFn, (void*)this) == 0 ) {
+        if( Rx->StartTransceive() ) return true;
+        pthread_mutex_lock(&Mutex);
+        Active = false;
+        pthread_cond_broadcast(&Cond);
+        pthread_mutex_unlock(&Mutex);
+        pthread_join(Thread, NULL);
+    }
+    Active = false;
+    Rx->IrRecvCallback = PrevCallback;
+    Rx->IrRecvCbContext = PrevCbContext;
+    Tx->IrOpenLoop = PrevOpenLoop;
+    return false;
+}
+
+void TiqiaaUsbIrRepeater::Stop() {
+    if( !Active ) return;
+    Rx->StopTransceive();
+    pthread_mutex_lock(&Mutex);
+    Active = false;
+    pthread_cond_broadcast(&Cond);
+    pthread_mutex_unlock(&Mutex);
+    pthread_join(Thread, NULL);
+    Tx->FlushIR();
+
+    Rx->IrRecvCallback = PrevCallback;
+    Rx->IrRecvCbContext = PrevCbContext;
+    Tx->IrOpenLoop = PrevOpenLoop;
+}
+
+void TiqiaaUsbIrRepeater::GetStats(TiqiaaUsbIrRepeater_Stats * stats) {
+    pthread_mutex_lock(&Mutex);
+    *stats = Stats;
+    pthread_mutex_unlock(&Mutex);
+}
+
+void TiqiaaUsbIrRepeater::ResetStats() {
+    pthread_mutex_lock(&Mutex);
+    memset(&Stats, 0, sizeof(Stats));
+    pthread_mutex_unlock(&Mutex);
+}
+
+// Called from the read thread of Rx, only copies the signal
+void TiqiaaUsbIrRepeater::RecvCallback(uint8_t * data, int size, TiqiaaUsbIr * /*IrCls*/, void * context) {
+    TiqiaaUsbIrRepeater * Repeater = (TiqiaaUsbIrRepeater *)context;
+    uint64_t CaptureNs = TiqiaaUsbIr_NowNs();
+    Slot * Dst;
+
+    if( size <= 0 ) return;
+    pthread_mutex_lock(&Repeater->Mutex);
+    Repeater->Stats.Captures++;
+    if( (Repeater->QueueCount < QueueSize) && (size <= TiqiaaUsbIr_MaxCaptureSize) ) {
+        Dst = &Repeater->Queue[(Repeater->QueueHead + Repeater->QueueCount) % QueueSize];
+        Dst->CaptureNs = CaptureNs;
+        Dst->Size = size;
+        memcpy(Dst->Data, data, size);
+        Repeater->QueueCount++;
+        pthread_cond_broadcast(&Repeater->Cond);
+    } else {
+        Repeater->Stats.Dropped++;
+    }
+    pthread_mutex_unlock(&Repeater->Mutex);
+}
+
+void *TiqiaaUsbIrRepeater::RunThreadFn(void *pcls)
+{
+    if( pcls == NULL ) return NULL;
+    TiqiaaUsbIrRepeater* cls = static_cast<TiqiaaUsbIrRepeater*>(pcls);
+    cls->ThreadFn();
+    return 0;
+}
+
+void TiqiaaUsbIrRepeater::ThreadFn() {
+    Slot * Src;
+    uint64_t EmitNs;
+    uint32_t LatencyUs;
+    bool Pass;
+    bool Sent;
+
+    pthread_mutex_lock(&Mutex);
+    while( Active || QueueCount ) {
+        if( QueueCount == 0 ) {
+            pthread_cond_wait(&Cond, &Mutex);
+            continue;
+        }
+        // slot stays queued while sent, the callback only writes free slots
+        Src = &Queue[QueueHead];
+        pthread_mutex_unlock(&Mutex);
+
+        Pass = ((Filter == NULL) || Filter(Src->Data, &Src->Size, FilterContext)) && (Src->Size > 0);
+        Sent = false;
+        if( Pass ) {
+            if( Src->Size <= TiqiaaUsbIrPacketBuilder::MaxIrDataSize ) {
+                Sent = Tx->SendIR(Freq, Src->Data, Src->Size);
+                EmitNs = TiqiaaUsbIr_NowNs();
+            } else {
+                EmitNs = TiqiaaUsbIr_NowNs();
+                Sent = Tx->SendIRStream(Freq, Src->Data, Src->Size);
+            }
+        }
+
+        pthread_mutex_lock(&Mutex);
+        if( !Pass ) {
+            Stats.Filtered++;
+        } else if( !Sent ) {
+            Stats.Failed++;
+        } else {
+            LatencyUs = (EmitNs - Src->CaptureNs) / 1000;
+            if( (Stats.Sent == 0) || (LatencyUs < Stats.LatencyMinUs) ) Stats.LatencyMinUs = LatencyUs;
+            if( LatencyUs > Stats.LatencyMaxUs ) Stats.LatencyMaxUs = LatencyUs;
+            Stats.LatencyLastUs = LatencyUs;
+            Stats.LatencySumUs += LatencyUs;
+            Stats.AirtimeSumUs += TiqiaaUsbIr_GetIrAirtime(Src->Data, Src->Size);
+            Stats.Sent++;
+        }
+        QueueHead = (QueueHead + 1) % QueueSize;
+        QueueCount--;
+    }
+    pthread_mutex_unlock(&Mutex);
+}
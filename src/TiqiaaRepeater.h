@@ -0,0 +1,109 @@
+/*
+ * Userspace driver for Tiqiaa Tview USB IR Transeiver
+ *
+ * Copyright (c) Xen xen-re[at]tutanota.com
+ *
+ * IR repeater: signals captured by one device are sent by another one.
+ * Captured data is already in the format of IR data packets and is sent
+ * without conversion.
+ *
+ * Example:
+ *
+ * TiqiaaUsbIr Rx, Tx;
+ * Rx.Open(0);
+ * Tx.Open(1);
+ * TiqiaaUsbIrRepeater Repeater;
+ * Repeater.Start(&Rx, &Tx);
+ * ...
+ * Repeater.Stop();
+ */
+
+#ifndef TIQIAA_REPEATER_H
+#define TIQIAA_REPEATER_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "TiqiaaUsb.h"
+
+struct TiqiaaUsbIrRepeater_Stats{
+    uint32_t Captures; //!< signals received
+    uint32_t Filtered; //!< signals rejected by Filter
+    uint32_t Dropped; //!< signals lost, queue full
+    uint32_t Sent; //!< signals sent
+    uint32_t Failed; //!< signals that failed to send
+    uint64_t LatencySumUs; //!< sum of capture to emit latency of sent signals
+    uint32_t LatencyMinUs;
+    uint32_t LatencyMaxUs;
+    uint32_t LatencyLastUs;
+    uint64_t AirtimeSumUs; //!< sum of airtime of sent signals
+};
+
+//! Repeater filter, called from the repeater thread
+//! data: captured signal, Tiqiaa signal data, may be changed in place
+//! size: size of data, may be reduced
+//! Return: true - send the signal, false - drop it
+typedef bool TiqiaaUsbIrRepeater_Filter(uint8_t * data, int * size, void * context);
+
+class TiqiaaUsbIrRepeater {
+public:
+    //! Carrier freq of sent signals, see TiqiaaUsbIr::SendIR, default 38000
+    int Freq;
+
+    //! Optional filter of captured signals
+    TiqiaaUsbIrRepeater_Filter * Filter;
+
+    //! Pointer to any user data that will be passed to Filter
+    void * FilterContext;
+
+    TiqiaaUsbIrRepeater();
+    virtual ~TiqiaaUsbIrRepeater();
+
+    //! Start repeating
+    //! rx: opened receiving device, switched to transceive mode, IrRecvCallback is replaced until Stop
+    //! tx: opened sending device, switched to open-loop transmit until Stop
+    //! Return: true - success, false - fail
+    bool Start(TiqiaaUsbIr * rx, TiqiaaUsbIr * tx);
+
+    //! Stop repeating after queued signals are sent, restore device settings
+    void Stop();
+
+    //! Get statistics since Start or ResetStats()
+    //! Note: Latency is measured from the capture callback to the end of the USB write
+    //! of the IR packet, signals longer than one packet - to the start of sending
+    void GetStats(TiqiaaUsbIrRepeater_Stats * stats);
+
+    //! Reset statistics
+    void ResetStats();
+
+private:
+    static const int QueueSize = 8;
+
+    struct Slot {
+        uint64_t CaptureNs;
+        int Size;
+        uint8_t Data[TiqiaaUsbIr_MaxCaptureSize];
+    };
+
+    TiqiaaUsbIr * Rx;
+    TiqiaaUsbIr * Tx;
+    TiqiaaUsbIr_IrRecvCallback * PrevCallback;
+    void * PrevCbContext;
+    bool PrevOpenLoop;
+
+    pthread_t Thread;
+    pthread_mutex_t Mutex;
+    pthread_cond_t Cond;
+    bool Active;
+
+    Slot Queue[QueueSize];
+    int QueueHead;
+    int QueueCount;
+    TiqiaaUsbIrRepeater_Stats Stats;
+
+    static void RecvCallback(uint8_t * data, int size, TiqiaaUsbIr * IrCls, void * context);
+    static void *RunThreadFn(void *pcls);
+    void ThreadFn();
+};
+
+#endif
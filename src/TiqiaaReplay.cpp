@@ -0,0 +1,253 @@
+/*
+ * Userspace driver for Tiqiaa Tview USB IR Transeiver
+ *
+ * Copyright (c) Xen xen-re[at]tutanota.com
+ */
+
+#include "TiqiaaReplay.h"
+#include "TiqiaaTime.h"
+#include <cstring>
+
+// CmdId follows the start sign in the first fragment of a packet
+static const int CmdIdOffs = sizeof(TiqiaaUsbIr_Report2Header) + sizeof(uint16_t);
+static const int PacketIdxOffs = 2;
+
+static bool IsFirstFragm(const uint8_t * data, int size) {
+    return (size > CmdIdOffs) && (((const TiqiaaUsbIr_Report2Header *)data)->FragmIdx == 1);
+}
+
+TiqiaaUsbIrRecorder::TiqiaaUsbIrRecorder() {
+    File = NULL;
+    StartNs = 0;
+    pthread_mutex_init(&Mutex, NULL);
+}
+
+TiqiaaUsbIrRecorder::~TiqiaaUsbIrRecorder() {
+    Close();
+    pthread_mutex_destroy(&Mutex);
+}
+
+bool TiqiaaUsbIrRecorder::Open(const char * fileName) {
+    if( File ) return false;
+    File = fopen(fileName, "w");
+    if( File == NULL ) return false;
+    fprintf(File, "# tiqiaa usb session: W|R usec fragment\n");
+    StartNs = TiqiaaUsbIr_NowNs();
+    return true;
+}
+
+void TiqiaaUsbIrRecorder::Close() {
+    pthread_mutex_lock(&Mutex);
+    if( File ) fclose(File);
+    File = NULL;
+    pthread_mutex_unlock(&Mutex);
+}
+
+bool TiqiaaUsbIrRecorder::IsOpen() {
+    return File != NULL;
+}
+
+void TiqiaaUsbIrRecorder::Add(char dir, const uint8_t * data, int size) {
+    uint64_t TimeUs = (TiqiaaUsbIr_NowNs() - StartNs) / 1000;
+
+    pthread_mutex_lock(&Mutex);
+    if( File ) {
+        fprintf(File, "%c %llu ", dir, (unsigned long long)TimeUs);
+        for( int i = 0; i < size; i++ ) fprintf(File, "%02x", data[i]);
+        fputc('\n', File);
+    }
+    pthread_mutex_unlock(&Mutex);
+}
+
+TiqiaaUsbIrReplay::TiqiaaUsbIrReplay() {
+    pthread_condattr_t CondAttr;
+
+    TimeScale = 1.0;
+    IsOpened = false;
+    OpenNs = 0;
+    WritePos = 0;
+    ReadPos = 0;
+    memset(&Stats, 0, sizeof(Stats));
+    Stats.FirstMismatch = -1;
+
+    pthread_condattr_init(&CondAttr);
+    pthread_condattr_setclock(&CondAttr, CLOCK_MONOTONIC);
+    pthread_cond_init(&Cond, &CondAttr);
+    pthread_condattr_destroy(&CondAttr);
+    pthread_mutex_init(&Mutex, NULL);
+}
+
+TiqiaaUsbIrReplay::~TiqiaaUsbIrReplay() {
+    pthread_mutex_destroy(&Mutex);
+    pthread_cond_destroy(&Cond);
+}
+
+bool TiqiaaUsbIrReplay::Load(const char * fileName) {
+    FILE * f;
+    char Line[512];
+    char Dir;
+    unsigned long long TimeUs;
+    unsigned int Byte;
+    int Offs, n;
+    Fragm Fr;
+    bool res = true;
+
+    if( IsOpened ) return false;
+    f = fopen(fileName, "r");
+    if( f == NULL ) return false;
+    Writes.clear();
+    Reads.clear();
+    while( fgets(Line, sizeof(Line), f) ) {
+        if( (Line[0] == '#') || (Line[0] == '\n') || (Line[0] == '\r') ) continue;
+        if( (sscanf(Line, "%c %llu %n", &Dir, &TimeUs, &Offs) != 2) || ((Dir != 'W') && (Dir != 'R')) ) {
+            res = false;
+            break;
+        }
+        Fr.TimeUs = TimeUs;
+        Fr.Writes = Writes.size();
+        Fr.Size = 0;
+        while( (Fr.Size < (int)sizeof(Fr.Data)) && (sscanf(Line + Offs, "%2x%n", &Byte, &n) == 1) ) {
+            Fr.Data[Fr.Size++] = Byte;
+            Offs += n;
+        }
+        if( Fr.Size < (int)sizeof(TiqiaaUsbIr_Report2Header) ) {
+            res = false;
+            break;
+        }
+        if( Dir == 'W' ) Writes.push_back(Fr); else Reads.push_back(Fr);
+    }
+    fclose(f);
+    if( !res ) {
+        Writes.clear();
+        Reads.clear();
+    }
+    WriteNs.assign(Writes.size(), 0);
+    return res;
+}
+
+int TiqiaaUsbIrReplay::GetWriteCount() {
+    return Writes.size();
+}
+
+int TiqiaaUsbIrReplay::GetReadCount() {
+    return Reads.size();
+}
+
+bool TiqiaaUsbIrReplay::Open() {
+    pthread_mutex_lock(&Mutex);
+    IsOpened = true;
+    OpenNs = TiqiaaUsbIr_NowNs();
+    WritePos = 0;
+    ReadPos = 0;
+    for( int i = 0; i < 256; i++ ) CmdIdMap[i] = i;
+    memset(&Stats, 0, sizeof(Stats));
+    Stats.FirstMismatch = -1;
+    pthread_mutex_unlock(&Mutex);
+    return true;
+}
+
+void TiqiaaUsbIrReplay::Close() {
+    pthread_mutex_lock(&Mutex);
+    IsOpened = false;
+    pthread_cond_broadcast(&Cond);
+    pthread_mutex_unlock(&Mutex);
+}
+
+bool TiqiaaUsbIrReplay::Write(const uint8_t * data, int size) {
+    bool Match;
+
+    pthread_mutex_lock(&Mutex);
+    if( !IsOpened ) {
+        pthread_mutex_unlock(&Mutex);
+        return false;
+    }
+    if( WritePos >= (int)Writes.size() ) {
+        Stats.ExtraWrites++;
+        pthread_mutex_unlock(&Mutex);
+        return true;
+    }
+    const Fragm * Fr = &Writes[WritePos];
+    Match = (Fr->Size == size);
+    for( int i = 0; Match && (i < size); i++ ) {
+        if( (i == PacketIdxOffs) || ((i == CmdIdOffs) && IsFirstFragm(data, size)) ) continue;
+        Match = (Fr->Data[i] == data[i]);
+    }
+    if( Match ) {
+        if( IsFirstFragm(data, size) ) CmdIdMap[Fr->Data[CmdIdOffs]] = data[CmdIdOffs];
+    } else {
+        if( Stats.FirstMismatch < 0 ) Stats.FirstMismatch = WritePos;
+        Stats.Mismatches++;
+    }
+    // replies to a mismatched fragment are replayed anyway, the driver decides what to do with them
+    WriteNs[WritePos] = TiqiaaUsbIr_NowNs();
+    WritePos++;
+    Stats.Writes++;
+    pthread_cond_broadcast(&Cond);
+    pthread_mutex_unlock(&Mutex);
+    return true;
+}
+
+// Mutex is locked
+// Return: replay time the fragment is due, UINT64_MAX - its write did not happen yet
+uint64_t TiqiaaUsbIrReplay::GetReadDueNs(const Fragm * fragm) {
+    uint64_t AnchorNs, AnchorUs;
+
+    if( fragm->Writes > WritePos ) return UINT64_MAX;
+    if( fragm->Writes == 0 ) {
+        AnchorNs = OpenNs;
+        AnchorUs = 0;
+    } else {
+        AnchorNs = WriteNs[fragm->Writes - 1];
+        AnchorUs = Writes[fragm->Writes - 1].TimeUs;
+    }
+    if( fragm->TimeUs <= AnchorUs ) return AnchorNs;
+    return AnchorNs + (uint64_t)((fragm->TimeUs - AnchorUs) * 1000.0 * TimeScale);
+}
+
+int TiqiaaUsbIrReplay::Read(uint8_t * data, int size, unsigned int timeout) {
+    uint64_t Deadline = TiqiaaUsbIr_NowNs() + (uint64_t)timeout * 1000000;
+    uint64_t DueNs, WaitUntil;
+    struct timespec ts;
+    int res;
+
+    pthread_mutex_lock(&Mutex);
+    while( true ) {
+        if( !IsOpened ) {
+            res = -1;
+            break;
+        }
+        uint64_t now = TiqiaaUsbIr_NowNs();
+        DueNs = (ReadPos < (int)Reads.size()) ? GetReadDueNs(&Reads[ReadPos]) : UINT64_MAX;
+        if( DueNs <= now ) {
+            const Fragm * Fr = &Reads[ReadPos];
+            res = (Fr->Size < size) ? Fr->Size : size;
+            memcpy(data, Fr->Data, res);
+            if( (res > CmdIdOffs) && IsFirstFragm(Fr->Data, Fr->Size) ) data[CmdIdOffs] = CmdIdMap[Fr->Data[CmdIdOffs]];
+            ReadPos++;
+            Stats.Reads++;
+            break;
+        }
+        if( (timeout != 0) && (now >= Deadline) ) {
+            res = 0;
+            break;
+        }
+        WaitUntil = (timeout != 0) ? Deadline : UINT64_MAX;
+        if( DueNs < WaitUntil ) WaitUntil = DueNs;
+        if( WaitUntil == UINT64_MAX ) {
+            pthread_cond_wait(&Cond, &Mutex);
+        } else {
+            ts = TiqiaaUsbIr_NsToTimespec(WaitUntil);
+            pthread_cond_timedwait(&Cond, &Mutex, &ts);
+        }
+    }
+    pthread_mutex_unlock(&Mutex);
+    return res;
+}
+
+void TiqiaaUsbIrReplay::GetStats(TiqiaaUsbIrReplay_Stats * stats) {
+    pthread_mutex_lock(&Mutex);
+    *stats = Stats;
+    stats->MissingWrites = Writes.size() - WritePos;
+    stats->MissingReads = Reads.size() - ReadPos;
+    pthread_mutex_unlock(&Mutex);
+}
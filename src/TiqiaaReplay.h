@@ -0,0 +1,123 @@
+/*
+ * Userspace driver for Tiqiaa Tview USB IR Transeiver
+ *
+ * Copyright (c) Xen xen-re[at]tutanota.com
+ *
+ * Record a USB session of a real device and replay it without hardware.
+ *
+ * Session file is text, one fragment per line:
+ * W <usec> <hex> - fragment written by the driver
+ * R <usec> <hex> - fragment read from the device
+ * usec is the time since the recorder was opened, lines starting with # are comments.
+ *
+ * Replay answers every written fragment with the fragments read after it in
+ * the recording, delayed as they were after that write (times TimeScale).
+ * Written fragments are checked against the recording; PacketIdx and CmdId
+ * may differ, CmdId of replies is translated to the one the driver used.
+ * Every Open() of the transport starts the session from the beginning.
+ *
+ * Example:
+ *
+ * TiqiaaUsbIrRecorder Rec;        TiqiaaUsbIrReplay Replay;
+ * Rec.Open("session.txt");        Replay.Load("session.txt");
+ * Ir.Recorder = &Rec;             Ir.Open(&Replay);
+ * Ir.Open();                      Ir.SendNecSignal(0x8002);
+ * Ir.SendNecSignal(0x8002);       Ir.Close();
+ * Ir.Close();                     Replay.GetStats(&Stats);
+ */
+
+#ifndef TIQIAA_REPLAY_H
+#define TIQIAA_REPLAY_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <vector>
+
+#include "TiqiaaUsbProto.h"
+#include "TiqiaaUsbTransport.h"
+
+class TiqiaaUsbIrRecorder {
+public:
+    TiqiaaUsbIrRecorder();
+    virtual ~TiqiaaUsbIrRecorder();
+
+    //! Create session file, session time starts now
+    //! Return: true - success, false - fail
+    bool Open(const char * fileName);
+
+    //! Close session file
+    void Close();
+
+    //! Return: true - recorder is open
+    bool IsOpen();
+
+    //! Append fragment to the session, can be called from any thread
+    //! dir: 'W' - written, 'R' - read
+    void Add(char dir, const uint8_t * data, int size);
+
+private:
+    FILE * File;
+    pthread_mutex_t Mutex;
+    uint64_t StartNs;
+};
+
+struct TiqiaaUsbIrReplay_Stats{
+    uint32_t Writes; //!< recorded fragments written
+    uint32_t Mismatches; //!< written fragments that differ from the recording
+    uint32_t ExtraWrites; //!< fragments written after the recording ended
+    uint32_t MissingWrites; //!< recorded fragments not written yet
+    uint32_t Reads; //!< recorded fragments read
+    uint32_t MissingReads; //!< recorded fragments not read yet
+    int FirstMismatch; //!< index of first mismatched written fragment, -1 - none
+};
+
+class TiqiaaUsbIrReplay : public TiqiaaUsbTransport {
+public:
+    //! Reply time scale, 1 - recorded timing, 0.1 - ten times faster, 0 - instant
+    double TimeScale;
+
+    TiqiaaUsbIrReplay();
+    virtual ~TiqiaaUsbIrReplay();
+
+    //! Load session file
+    //! Return: true - success, false - file not found or malformed
+    bool Load(const char * fileName);
+
+    //! Return: number of recorded fragments written / read
+    int GetWriteCount();
+    int GetReadCount();
+
+    virtual bool Open();
+    virtual void Close();
+    virtual bool Write(const uint8_t * data, int size);
+    virtual int Read(uint8_t * data, int size, unsigned int timeout);
+
+    //! Get statistics of the current or last replay
+    void GetStats(TiqiaaUsbIrReplay_Stats * stats);
+
+private:
+    struct Fragm {
+        uint64_t TimeUs;
+        int Writes; // fragments written before this one was read
+        int Size;
+        uint8_t Data[TiqiaaUsbIr_MaxUsbReadSize];
+    };
+
+    std::vector<Fragm> Writes;
+    std::vector<Fragm> Reads;
+    std::vector<uint64_t> WriteNs; // replay time of every recorded write
+
+    pthread_mutex_t Mutex;
+    pthread_cond_t Cond;
+    bool IsOpened;
+    uint64_t OpenNs;
+    int WritePos;
+    int ReadPos;
+    uint8_t CmdIdMap[256]; // recorded CmdId -> CmdId used by the driver
+    TiqiaaUsbIrReplay_Stats Stats;
+
+    uint64_t GetReadDueNs(const Fragm * fragm);
+};
+
+#endif
@@ -0,0 +1,36 @@
+/*
+ * Userspace driver for Tiqiaa Tview USB IR Transeiver
+ *
+ * Copyright (c) Xen xen-re[at]tutanota.com
+ *
+ * Monotonic time helpers
+ */
+
+#ifndef TIQIAA_TIME_H
+#define TIQIAA_TIME_H
+
+#include <stdint.h>
+#include <time.h>
+
+//! Return: CLOCK_MONOTONIC time, nsec
+static inline uint64_t TiqiaaUsbIr_NowNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+//! Convert CLOCK_MONOTONIC nsec to timespec for pthread_cond_timedwait
+static inline struct timespec TiqiaaUsbIr_NsToTimespec(uint64_t ns) {
+    struct timespec ts;
+    ts.tv_sec = ns / 1000000000ull;
+    ts.tv_nsec = ns % 1000000000ull;
+    return ts;
+}
+
+//! Sleep until CLOCK_MONOTONIC time, nsec
+static inline void TiqiaaUsbIr_SleepUntilNs(uint64_t ns) {
+    struct timespec ts = TiqiaaUsbIr_NsToTimespec(ns);
+    while( clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0 ) {}
+}
+
+#endif
@@ -0,0 +1,152 @@
+/*
+ * Userspace driver for Tiqiaa Tview USB IR Transeiver
+ *
+ * Copyright (c) Xen xen-re[at]tutanota.com
+ */
+
+#include "TiqiaaTrace.h"
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+bool TiqiaaUsbIrTrace::Enabled = false;
+
+namespace {
+
+struct TraceEvent {
+    const char * Name;
+    const char * ArgName;
+    int64_t Arg;
+    uint64_t StartNs;
+    uint64_t DurNs;
+    uint32_t Tid;
+};
+
+// Single writer (owning thread), single reader (WriteJson under FlushMutex)
+struct TraceBuffer {
+    TraceEvent Events[TiqiaaUsbIrTrace::BufferSize];
+    uint64_t Head; // written by owner
+    uint64_t Tail; // written by reader
+    bool Owned; // a live thread records here
+    TraceBuffer * Next;
+};
+
+TraceBuffer * BufferList = NULL; // buffers are never freed, a new thread reuses one left by an exited thread
+uint64_t Dropped = 0;
+pthread_mutex_t FlushMutex = PTHREAD_MUTEX_INITIALIZER;
+
+TraceBuffer * ClaimBuffer() {
+    TraceBuffer * Buf;
+    bool Free;
+
+    for( Buf = __atomic_load_n(&BufferList, __ATOMIC_ACQUIRE); Buf; Buf = Buf->Next ) {
+        Free = false;
+        if( __atomic_compare_exchange_n(&Buf->Owned, &Free, true, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED) ) return Buf;
+    }
+    Buf = new TraceBuffer;
+    Buf->Head = 0;
+    Buf->Tail = 0;
+    Buf->Owned = true;
+    Buf->Next = __atomic_load_n(&BufferList, __ATOMIC_RELAXED);
+    while( !__atomic_compare_exchange_n(&BufferList, &Buf->Next, Buf, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED) ) {}
+    return Buf;
+}
+
+// Buffer of the calling thread, claimed by its first span
+struct ThreadTrace {
+    TraceBuffer * Buf;
+    uint32_t Tid;
+
+    ThreadTrace() : Buf(NULL), Tid(0) {}
+    ~ThreadTrace() { if( Buf ) __atomic_store_n(&Buf->Owned, false, __ATOMIC_RELEASE); }
+};
+
+thread_local ThreadTrace CurThread;
+
+void WriteJsonString(FILE * file, const char * str) {
+    fputc('"', file);
+    for( ; *str; str++ ) {
+        if( (*str == '"') || (*str == '\\') ) fputc('\\', file);
+        if( (unsigned char)*str >= 0x20 ) fputc(*str, file);
+    }
+    fputc('"', file);
+}
+
+}
+
+void TiqiaaUsbIrTrace::Enable(bool enable) {
+    __atomic_store_n(&Enabled, enable, __ATOMIC_RELAXED);
+}
+
+void TiqiaaUsbIrTrace::AddSpan(const char * name, uint64_t startNs, uint64_t endNs, const char * argName, int64_t arg) {
+    ThreadTrace * Cur = &CurThread;
+    TraceEvent * Event;
+    uint64_t Head;
+
+    if( Cur->Buf == NULL ) {
+        Cur->Buf = ClaimBuffer();
+        Cur->Tid = (uint32_t)syscall(SYS_gettid);
+    }
+    Head = Cur->Buf->Head;
+    if( Head - __atomic_load_n(&Cur->Buf->Tail, __ATOMIC_ACQUIRE) >= (uint64_t)BufferSize ) {
+        __atomic_fetch_add(&Dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    Event = &Cur->Buf->Events[Head % BufferSize];
+    Event->Name = name;
+    Event->ArgName = argName;
+    Event->Arg = arg;
+    Event->StartNs = startNs;
+    Event->DurNs = (endNs > startNs) ? endNs - startNs : 0;
+    Event->Tid = Cur->Tid;
+    __atomic_store_n(&Cur->Buf->Head, Head + 1, __ATOMIC_RELEASE);
+}
+
+int TiqiaaUsbIrTrace::WriteJson(FILE * file) {
+    TraceBuffer * Buf;
+    TraceEvent * Event;
+    uint64_t Head;
+    int Pid = getpid();
+    int res = 0;
+
+    pthread_mutex_lock(&FlushMutex);
+    fputs("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[", file);
+    for( Buf = __atomic_load_n(&BufferList, __ATOMIC_ACQUIRE); Buf; Buf = Buf->Next ) {
+        Head = __atomic_load_n(&Buf->Head, __ATOMIC_ACQUIRE);
+        for( uint64_t i = Buf->Tail; i < Head; i++ ) {
+            Event = &Buf->Events[i % BufferSize];
+            fputs(res ? ",\n" : "\n", file);
+            fputs("{\"name\":", file);
+            WriteJsonString(file, Event->Name);
+            // ts and dur are mksec
+            fprintf(file, ",\"cat\":\"tiqiaa\",\"ph\":\"X\",\"pid\":%d,\"tid\":%u,\"ts\":%llu.%03u,\"dur\":%llu.%03u",
+                    Pid, Event->Tid, (unsigned long long)(Event->StartNs / 1000), (unsigned)(Event->StartNs % 1000),
+                    (unsigned long long)(Event->DurNs / 1000), (unsigned)(Event->DurNs % 1000));
+            if( Event->ArgName ) {
+                fputs(",\"args\":{", file);
+                WriteJsonString(file, Event->ArgName);
+                fprintf(file, ":%lld}", (long long)Event->Arg);
+            }
+            fputc('}', file);
+            res++;
+        }
+        __atomic_store_n(&Buf->Tail, Head, __ATOMIC_RELEASE);
+    }
+    fputs("\n]}\n", file);
+    pthread_mutex_unlock(&FlushMutex);
+    return ferror(file) ? -1 : res;
+}
+
+int TiqiaaUsbIrTrace::WriteJson(const char * fileName) {
+    FILE * File = fopen(fileName, "w");
+    int res;
+
+    if( File == NULL ) return -1;
+    res = WriteJson(File);
+    if( fclose(File) != 0 ) res = -1;
+    return res;
+}
+
+uint64_t TiqiaaUsbIrTrace::GetDropped() {
+    return __atomic_load_n(&Dropped, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,72 @@
+/*
+ * Userspace driver for Tiqiaa Tview USB IR Transeiver
+ *
+ * Copyright (c) Xen xen-re[at]tutanota.com
+ *
+ * Trace spans of the send/receive pipeline in Chrome trace-event format,
+ * loadable in Perfetto or chrome://tracing.
+ *
+ * Every thread records into its own ring buffer without locking; a span
+ * costs one flag check while tracing is disabled. Events stay buffered
+ * until WriteJson, a full buffer drops new events.
+ *
+ * Example:
+ *
+ * TiqiaaUsbIrTrace::Enable(true);
+ * Ir.SendNecSignal(0x8002);
+ * TiqiaaUsbIrTrace::WriteJson("trace.json");
+ */
+
+#ifndef TIQIAA_TRACE_H
+#define TIQIAA_TRACE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "TiqiaaTime.h"
+
+class TiqiaaUsbIrTrace {
+public:
+    //! Events buffered per thread
+    static const int BufferSize = 8192;
+
+    //! Start or stop recording, default stopped
+    static void Enable(bool enable);
+
+    //! Return: true - recording
+    static bool IsEnabled() { return __atomic_load_n(&Enabled, __ATOMIC_RELAXED); }
+
+    //! Record complete span
+    //! name, argName: static strings, stored by pointer; argName NULL - no argument
+    //! startNs, endNs: TiqiaaUsbIr_NowNs() values
+    static void AddSpan(const char * name, uint64_t startNs, uint64_t endNs, const char * argName, int64_t arg);
+
+    //! Write buffered events of all threads as trace-event JSON and remove them from the buffers
+    //! file: opened file / fileName: file to create
+    //! Return: number of events written, -1 - file error
+    static int WriteJson(FILE * file);
+    static int WriteJson(const char * fileName);
+
+    //! Return: number of events dropped because a buffer was full
+    static uint64_t GetDropped();
+
+private:
+    static bool Enabled;
+};
+
+//! Span of the enclosing scope, recorded on destruction
+class TiqiaaUsbIrTraceSpan {
+public:
+    //! name, argName: static strings, see TiqiaaUsbIrTrace::AddSpan
+    TiqiaaUsbIrTraceSpan(const char * name, const char * argName = NULL, int64_t arg = 0)
+        : Name(name), ArgName(argName), Arg(arg), StartNs(TiqiaaUsbIrTrace::IsEnabled() ? TiqiaaUsbIr_NowNs() : 0) {}
+    ~TiqiaaUsbIrTraceSpan() { if( StartNs ) TiqiaaUsbIrTrace::AddSpan(Name, StartNs, TiqiaaUsbIr_NowNs(), ArgName, Arg); }
+
+private:
+    const char * Name;
+    const char * ArgName;
+    int64_t Arg;
+    uint64_t StartNs; // 0 - tracing was disabled at start
+};
+
+#endif
@@ -7,25 +7,82 @@
  */
 
 #include "TiqiaaUsb.h"
+#include "TiqiaaTime.h"
+#include "TiqiaaProbes.h"
 #include <cstring>
 #include <stdlib.h>
+#include <signal.h>
+#include <errno.h>
+#include <unistd.h>
 
 #include <libusb-1.0/libusb.h>
 
 #include <cstdio>
 
-#define VENDOR_ID 0x10c4
-#define PRODUCT_ID 0x8468
 
 TiqiaaUsbIr::TiqiaaUsbIr() {
+    pthread_condattr_t CondAttr;
+
+    UsbCtx = NULL;
     dev_h = NULL;
+    Transport = NULL;
     IrRecvCallback = NULL;
     IrRecvCbContext = NULL;
+    Pcap = NULL;
+    Recorder = NULL;
+    UsbBusNum = 0;
+    UsbDevAddr = 0;
+    CaptureIdleGap = 20;
+    CaptureSize = 0;
+    CaptureSpaceTicks = 0;
+    CaptureDeadlineNs = 0;
+    IrStreamPipeline = true;
+    PipeCmdId = 0;
+    PipeAirtime = 0;
+    IdleOnClose = true;
+    IrOpenLoop = false;
+    IrScheduleLead = 5000;
+    IrFlightHead = 0;
+    IrFlightCount = 0;
+    IrFlightFailed = false;
+    memset(&IrSchedStats, 0, sizeof(IrSchedStats));
+    RecvArmed = false;
+    RecvCmdId = 0;
+    TxHead = 0;
+    TxCount = 0;
+    TransceiveActive = false;
+    memset(&TrxStats, 0, sizeof(TrxStats));
+    ModeCmdId = 0;
+    CurOp = OpOther;
+    RoundTripOpen = false;
+    memset(OpStats, 0, sizeof(OpStats));
     PacketIndex = 0;
     CmdId = 0;
     DeviceState = 0;
+    IsWaitingCmdReply = false;
+    memset(ReplyTable, 0, sizeof(ReplyTable));
+    memset(CmdSeq, 0, sizeof(CmdSeq));
+    CmdSeqCounter = 0;
+    LastReplySeq = 0;
+    MaxCmdRetries = 3;
+    AdaptiveTimeouts = true;
+    MinCmdTimeout = 5;
+    MaxCmdTimeout = CmdReplyWaitTimeout;
+    memset(CmdSentNs, 0, sizeof(CmdSentNs));
+    memset(ReplyRecvNs, 0, sizeof(ReplyRecvNs));
+    memset(CmdRttValid, 0, sizeof(CmdRttValid));
+    memset(CmdSentType, 0, sizeof(CmdSentType));
+    ModeSentNs = 0;
+    ResetRttStats();
+    ResetHealthStats();
+    FlightDumpFd = 2;
+    memset(FlightRecs, 0, sizeof(FlightRecs));
+    memset(FlightSeq, 0, sizeof(FlightSeq));
 
-    pthread_cond_init(&read_thread_info.condition, NULL);
+    pthread_condattr_init(&CondAttr);
+    pthread_condattr_setclock(&CondAttr, CLOCK_MONOTONIC);
+    pthread_cond_init(&read_thread_info.condition, &CondAttr);
+    pthread_condattr_destroy(&CondAttr);
     pthread_mutex_init(&read_thread_info.mutex, NULL);
 }
 
@@ -41,171 +98,685 @@ bool TiqiaaUsbIr::InitDevice() {
     return true;
 }
 
-bool TiqiaaUsbIr::Open() {
-    if( IsOpen() ) return false;
+TiqiaaUsbIr::OpScope::OpScope(TiqiaaUsbIr * ir, int op) {
+    Ir = ir;
+    PrevOp = ir->CurOp;
+    StartNs = 0;
+    if( PrevOp == OpOther ) {
+        if( TiqiaaUsbIrTrace::IsEnabled() ) StartNs = TiqiaaUsbIr_NowNs();
+        ir->CurOp = op;
+        ir->OpStats[op].Count++;
+        ir->RoundTripOpen = false;
+    }
+}
 
-    if( libusb_init(NULL) != LIBUSB_SUCCESS ) return false;
+TiqiaaUsbIr::OpScope::~OpScope() {
+    if( StartNs ) TiqiaaUsbIrTrace::AddSpan(GetOpName(Ir->CurOp), StartNs, TiqiaaUsbIr_NowNs(), NULL, 0);
+    Ir->CurOp = PrevOp;
+}
 
-    dev_h = libusb_open_device_with_vid_pid(NULL, VENDOR_ID, PRODUCT_ID);
-    if( dev_h && libusb_reset_device(dev_h) == 0 && InitDevice() ) {
-        IsWaitingCmdReply = false;
-        ReadActive = true;
-        pthread_create(&(read_thread_info.thread_id), NULL, TiqiaaUsbIr::RunReadThreadFn, (void*)this);
+void TiqiaaUsbIr::GetOpStats(int op, TiqiaaUsbIr_OpStats * stats) {
+    if( (op >= 0) && (op < OpCount) ) *stats = OpStats[op]; else memset(stats, 0, sizeof(*stats));
+}
 
-        if( read_thread_info.thread_id ) {
-            if( SendCmdAndWaitReply(CmdVersion, GetCmdId(), CmdReplyWaitTimeout) ) {
-                if( SendCmdAndWaitReply(CmdSendMode, GetCmdId(), CmdReplyWaitTimeout) ) {
-                    return true;
-                }
-            }
-            ReadActive = false;
-            pthread_join(read_thread_info.thread_id, NULL);
+void TiqiaaUsbIr::ResetOpStats() {
+    memset(OpStats, 0, sizeof(OpStats));
+}
+
+const char * TiqiaaUsbIr::GetOpName(int op) {
+    static const char * Names[OpCount] = {
+        "Open", "Close", "SendIR", "SendIRStream", "SendIRBatch", "StartRecvIR", "SetIdleMode", "Transceive", "Other"
+    };
+    if( (op >= 0) && (op < OpCount) ) return Names[op];
+    return "?";
+}
+
+int TiqiaaUsbIr::GetCmdIndex(uint8_t cmdType) {
+    switch( cmdType ) {
+        case CmdVersion: return 0;
+        case CmdIdleMode: return 1;
+        case CmdSendMode: return 2;
+        case CmdRecvMode: return 3;
+        case CmdOutput: return 4;
+        case CmdCancel: return 5;
+        case CmdUnknown: return 6;
+        case CmdData: return 7;
+    }
+    return -1;
+}
+
+bool TiqiaaUsbIr::GetRttStats(uint8_t cmdType, TiqiaaUsbIr_RttStats * stats) {
+    int Idx = GetCmdIndex(cmdType);
+
+    if( Idx < 0 ) return false;
+    *stats = RttStats[Idx];
+    stats->RtoUs = GetReplyTimeout(cmdType, 0, MaxCmdTimeout);
+    return true;
+}
+
+void TiqiaaUsbIr::ResetRttStats() {
+    memset(RttStats, 0, sizeof(RttStats));
+}
+
+const TiqiaaUsbIrHistogram * TiqiaaUsbIr::GetCmdLatency(uint8_t cmdType) {
+    int Idx = GetCmdIndex(cmdType);
+
+    return (Idx < 0) ? NULL : &CmdLatency[Idx];
+}
+
+const TiqiaaUsbIrHistogram * TiqiaaUsbIr::GetFragmWriteLatency() {
+    return &FragmWriteLatency;
+}
+
+const TiqiaaUsbIrHistogram * TiqiaaUsbIr::GetReplyWaitLatency() {
+    return &ReplyWaitLatency;
+}
+
+const TiqiaaUsbIrHistogram * TiqiaaUsbIr::GetModeSwitchLatency() {
+    return &ModeSwitchLatency;
+}
+
+void TiqiaaUsbIr::ResetLatency() {
+    for( int i = 0; i < CmdTypeCount; i++ ) CmdLatency[i].Reset();
+    FragmWriteLatency.Reset();
+    ReplyWaitLatency.Reset();
+    ModeSwitchLatency.Reset();
+}
+
+static inline void AddHealth(uint64_t * counter, uint64_t n = 1) {
+    __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+void TiqiaaUsbIr::GetHealthStats(TiqiaaUsbIr_HealthStats * stats) {
+    const uint64_t * Src = (const uint64_t *)&Health;
+    uint64_t * Dst = (uint64_t *)stats;
+
+    for( size_t i = 0; i < sizeof(Health) / sizeof(uint64_t); i++ ) Dst[i] = __atomic_load_n(&Src[i], __ATOMIC_RELAXED);
+}
+
+void TiqiaaUsbIr::ResetHealthStats() {
+    uint64_t * Dst = (uint64_t *)&Health;
+
+    for( size_t i = 0; i < sizeof(Health) / sizeof(uint64_t); i++ ) __atomic_store_n(&Dst[i], 0, __ATOMIC_RELAXED);
+}
+
+// Reply timeout, mksec: Srtt + 4 * RttVar bounded by MinCmdTimeout..MaxCmdTimeout (RFC 6298),
+// estimate of all commands until the type has own samples, MaxCmdTimeout until the first reply is measured
+uint32_t TiqiaaUsbIr::GetReplyTimeout(uint8_t cmdType, uint32_t airtime, uint32_t maxTimeout) {
+    int Idx = GetCmdIndex(cmdType);
+    uint32_t MaxUs = (uint32_t)maxTimeout * 1000;
+    uint32_t MinUs = (uint32_t)MinCmdTimeout * 1000;
+    uint32_t Rto;
+
+    if( airtime == UnknownAirtime ) return MaxUs;
+    if( !AdaptiveTimeouts ) return MaxUs + airtime;
+    if( MaxUs > (uint32_t)MaxCmdTimeout * 1000 ) MaxUs = (uint32_t)MaxCmdTimeout * 1000;
+    if( (Idx < 0) || (RttStats[Idx].Samples == 0) ) Idx = RttLinkIdx;
+    if( RttStats[Idx].Samples == 0 ) return MaxUs + airtime;
+    Rto = RttStats[Idx].SrttUs + ((4 * RttStats[Idx].RttVarUs > RtoClockUs) ? 4 * RttStats[Idx].RttVarUs : RtoClockUs);
+    if( Rto < MinUs ) Rto = MinUs;
+    if( Rto > MaxUs ) Rto = MaxUs;
+    return Rto + airtime;
+}
+
+static void AddRttSample(TiqiaaUsbIr_RttStats * Rtt, uint32_t RttUs) {
+    uint32_t Delta;
+
+    Rtt->LastUs = RttUs;
+    if( RttUs > Rtt->MaxUs ) Rtt->MaxUs = RttUs;
+    if( Rtt->Samples == 0 ) {
+        Rtt->SrttUs = RttUs;
+        Rtt->RttVarUs = RttUs / 2;
+    } else {
+        Delta = (Rtt->SrttUs > RttUs) ? Rtt->SrttUs - RttUs : RttUs - Rtt->SrttUs;
+        Rtt->RttVarUs = Rtt->RttVarUs - Rtt->RttVarUs / 4 + Delta / 4;
+        Rtt->SrttUs = Rtt->SrttUs - Rtt->SrttUs / 8 + RttUs / 8;
+    }
+    Rtt->Samples++;
+}
+
+// Mutex is locked
+void TiqiaaUsbIr::UpdateRtt(uint8_t cmdType, uint8_t cmdId, uint32_t airtime) {
+    uint64_t RttNs;
+    uint32_t RttUs;
+    int Idx = GetCmdIndex(cmdType);
+
+    // commands queued behind others are not measured, resent commands always get a new CmdId
+    if( (Idx < 0) || (airtime == UnknownAirtime) || !CmdRttValid[cmdId & MaxCmdId] ) return;
+    CmdRttValid[cmdId & MaxCmdId] = false;
+    if( ReplyRecvNs[cmdId & MaxCmdId] < CmdSentNs[cmdId & MaxCmdId] ) return;
+    RttNs = ReplyRecvNs[cmdId & MaxCmdId] - CmdSentNs[cmdId & MaxCmdId];
+    RttUs = (RttNs / 1000 > airtime) ? (uint32_t)(RttNs / 1000) - airtime : 0;
+    AddRttSample(&RttStats[Idx], RttUs);
+    AddRttSample(&RttStats[RttLinkIdx], RttUs);
+}
+
+// Open devices dumped by the SetFlightDumpSignal handler
+static const int MaxFlightDevices = 8;
+static TiqiaaUsbIr * FlightDevices[MaxFlightDevices];
+static int FlightSignalFd = 2;
+
+static void RegisterFlightDevice(TiqiaaUsbIr * ir, bool add) {
+    for( int i = 0; i < MaxFlightDevices; i++ ) {
+        TiqiaaUsbIr * Expected = add ? NULL : ir;
+        if( __atomic_compare_exchange_n(&FlightDevices[i], &Expected, add ? ir : NULL, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED) ) return;
+    }
+}
+
+static void FlightSignalHandler(int /*signum*/) {
+    TiqiaaUsbIr * Ir;
+
+    for( int i = 0; i < MaxFlightDevices; i++ ) {
+        Ir = __atomic_load_n(&FlightDevices[i], __ATOMIC_ACQUIRE);
+        if( Ir ) Ir->DumpFlightRecorder(FlightSignalFd);
+    }
+}
+
+bool TiqiaaUsbIr::SetFlightDumpSignal(int signum, int fd) {
+    struct sigaction Action;
+
+    FlightSignalFd = fd;
+    memset(&Action, 0, sizeof(Action));
+    Action.sa_handler = FlightSignalHandler;
+    sigemptyset(&Action.sa_mask);
+    Action.sa_flags = SA_RESTART;
+    return sigaction(signum, &Action, NULL) == 0;
+}
+
+// Any thread, dir: 0 - written, 1 - read
+void TiqiaaUsbIr::RecordFlight(int dir, const uint8_t * data, int size, bool ok) {
+    uint32_t Seq = __atomic_fetch_add(&FlightSeq[dir], 1, __ATOMIC_RELAXED);
+    FlightRecord * Rec = &FlightRecs[dir][Seq % MaxFlightRecords];
+
+    __atomic_store_n(&Rec->Seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    Rec->Ok = ok;
+    Rec->Size = size;
+    Rec->TimeNs = TiqiaaUsbIr_NowNs();
+    memcpy(Rec->Data, data, (size < FlightDataSize) ? size : FlightDataSize);
+    __atomic_store_n(&Rec->Seq, Seq + 1, __ATOMIC_RELEASE);
+}
+
+// Line buffer for DumpFlightRecorder, only async-signal-safe calls
+struct FlightLine {
+    char Buf[160];
+    int Len;
+
+    FlightLine() : Len(0) {}
+    void Str(const char * str) { while( *str && (Len < (int)sizeof(Buf)) ) Buf[Len++] = *str++; }
+    void Dec(uint64_t val, int minDigits = 1) {
+        char Tmp[20];
+        int n = 0;
+        do { Tmp[n++] = '0' + val % 10; val /= 10; } while( (val > 0) || (n < minDigits) );
+        while( (n > 0) && (Len < (int)sizeof(Buf)) ) Buf[Len++] = Tmp[--n];
+    }
+    void Hex(uint8_t val) {
+        static const char Digits[] = "0123456789abcdef";
+        if( Len + 3 > (int)sizeof(Buf) ) return;
+        Buf[Len++] = ' ';
+        Buf[Len++] = Digits[val >> 4];
+        Buf[Len++] = Digits[val & 15];
+    }
+    void Write(int fd) {
+        Str("\n");
+        for( int i = 0; i < Len; ) {
+            ssize_t n = write(fd, Buf + i, Len - i);
+            if( n <= 0 ) break;
+            i += n;
+        }
+        Len = 0;
+    }
+};
+
+void TiqiaaUsbIr::DumpFlightRecorder(int fd) {
+    FlightRecord Recs[2][MaxFlightRecords];
+    int Count[2];
+    int Pos[2] = {0, 0};
+    uint64_t now = TiqiaaUsbIr_NowNs();
+    uint64_t Age;
+    uint32_t Last;
+    uint32_t Seq;
+    FlightRecord * Rec;
+    FlightLine Line;
+    int Dir;
+
+    // copy records oldest first, skip ones overwritten while copying
+    for( Dir = 0; Dir < 2; Dir++ ) {
+        Count[Dir] = 0;
+        Last = __atomic_load_n(&FlightSeq[Dir], __ATOMIC_ACQUIRE);
+        for( uint32_t n = (Last > (uint32_t)MaxFlightRecords) ? Last - MaxFlightRecords : 0; n < Last; n++ ) {
+            Rec = &FlightRecs[Dir][n % MaxFlightRecords];
+            Seq = __atomic_load_n(&Rec->Seq, __ATOMIC_ACQUIRE);
+            if( Seq != n + 1 ) continue;
+            Recs[Dir][Count[Dir]] = *Rec;
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if( __atomic_load_n(&Rec->Seq, __ATOMIC_RELAXED) == Seq ) Count[Dir]++;
+        }
+    }
+
+    Line.Str("TiqiaaUsbIr flight recorder: state ");
+    Line.Dec(DeviceState);
+    Line.Str(", written ");
+    Line.Dec(FlightSeq[0]);
+    Line.Str(", read ");
+    Line.Dec(FlightSeq[1]);
+    Line.Str(" fragments, last ");
+    Line.Dec(Count[0] + Count[1]);
+    Line.Write(fd);
+    // both directions merged by time
+    while( (Pos[0] < Count[0]) || (Pos[1] < Count[1]) ) {
+        if( Pos[0] >= Count[0] ) Dir = 1;
+        else if( Pos[1] >= Count[1] ) Dir = 0;
+        else Dir = (Recs[1][Pos[1]].TimeNs < Recs[0][Pos[0]].TimeNs) ? 1 : 0;
+        Rec = &Recs[Dir][Pos[Dir]++];
+        Age = (now > Rec->TimeNs) ? (now - Rec->TimeNs) / 1000 : 0;
+        Line.Str(Dir ? "  in  -" : "  out -");
+        Line.Dec(Age / 1000);
+        Line.Str(".");
+        Line.Dec(Age % 1000, 3);
+        Line.Str(" ms ");
+        Line.Str(Rec->Ok ? "ok  " : "FAIL");
+        Line.Str(" size ");
+        Line.Dec(Rec->Size);
+        if( Rec->Size >= (int)sizeof(TiqiaaUsbIr_Report2Header) ) {
+            TiqiaaUsbIr_Report2Header * Hdr = (TiqiaaUsbIr_Report2Header *)Rec->Data;
+            Line.Str(" packet ");
+            Line.Dec(Hdr->PacketIdx);
+            Line.Str(" fragm ");
+            Line.Dec(Hdr->FragmIdx);
+            Line.Str("/");
+            Line.Dec(Hdr->FragmCount);
         }
+        Line.Str(":");
+        for( int i = 0; (i < Rec->Size) && (i < FlightDataSize); i++ ) Line.Hex(Rec->Data[i]);
+        Line.Write(fd);
+    }
+}
+
+bool TiqiaaUsbIr::StartDevice() {
+    IsWaitingCmdReply = false;
+    RecvArmed = false;
+    CaptureSize = 0;
+    CaptureSpaceTicks = 0;
+    CaptureDeadlineNs = 0;
+    ModeCmdId = 0;
+    IrFlightCount = 0;
+    IrFlightFailed = false;
+    DeviceState = 0;
+    ReadActive = true;
+    if( pthread_create(&(read_thread_info.thread_id), NULL, TiqiaaUsbIr::RunReadThreadFn, (void*)this) != 0 ) return false;
+
+    // Version reply carries device state, mode is switched by the first operation that needs it
+    if( SendCmdAndWaitReply(CmdVersion, GetCmdId(), MaxCmdTimeout) ) {
+        RegisterFlightDevice(this, true);
+        return true;
+    }
+    ReadActive = false;
+    pthread_join(read_thread_info.thread_id, NULL);
+    return false;
+}
+
+// Return: opened handle of index-th device, NULL - not found
+libusb_device_handle * TiqiaaUsbIr::OpenUsbDevice(libusb_context * ctx, int index) {
+    libusb_device ** DevList;
+    libusb_device_handle * res = NULL;
+    struct libusb_device_descriptor Desc;
+    ssize_t DevCount;
+
+    DevCount = libusb_get_device_list(ctx, &DevList);
+    if( DevCount < 0 ) return NULL;
+    for( ssize_t i = 0; i < DevCount; i++ ) {
+        if( libusb_get_device_descriptor(DevList[i], &Desc) < 0 ) continue;
+        if( ((Desc.idVendor != DeviceVid1) && (Desc.idVendor != DeviceVid2)) || (Desc.idProduct != DevicePid) ) continue;
+        if( index-- > 0 ) continue;
+        if( libusb_open(DevList[i], &res) < 0 ) res = NULL;
+        break;
+    }
+    libusb_free_device_list(DevList, 1);
+    return res;
+}
+
+int TiqiaaUsbIr::GetDeviceCount() {
+    libusb_context * Ctx;
+    libusb_device ** DevList;
+    struct libusb_device_descriptor Desc;
+    ssize_t DevCount;
+    int res = 0;
+
+    if( libusb_init(&Ctx) != LIBUSB_SUCCESS ) return -1;
+    DevCount = libusb_get_device_list(Ctx, &DevList);
+    if( DevCount < 0 ) {
+        libusb_exit(Ctx);
+        return -1;
+    }
+    for( ssize_t i = 0; i < DevCount; i++ ) {
+        if( libusb_get_device_descriptor(DevList[i], &Desc) < 0 ) continue;
+        if( ((Desc.idVendor == DeviceVid1) || (Desc.idVendor == DeviceVid2)) && (Desc.idProduct == DevicePid) ) res++;
     }
+    libusb_free_device_list(DevList, 1);
+    libusb_exit(Ctx);
+    return res;
+}
+
+bool TiqiaaUsbIr::Open() {
+    return Open(0);
+}
+
+bool TiqiaaUsbIr::Open(int index) {
+    if( IsOpen() || (index < 0) ) return false;
+    OpScope Scope(this, OpOpen);
+
+    if( libusb_init(&UsbCtx) != LIBUSB_SUCCESS ) return false;
 
+    dev_h = OpenUsbDevice(UsbCtx, index);
+    if( dev_h && libusb_reset_device(dev_h) == 0 && InitDevice() ) {
+        UsbBusNum = libusb_get_bus_number(libusb_get_device(dev_h));
+        UsbDevAddr = libusb_get_device_address(libusb_get_device(dev_h));
+        if( StartDevice() ) return true;
+    }
 
-    libusb_close(dev_h);
+    if( dev_h ) libusb_close(dev_h);
     dev_h = NULL;
-    libusb_exit(NULL);
+    libusb_exit(UsbCtx);
+    UsbCtx = NULL;
+
+    return false;
+}
+
+bool TiqiaaUsbIr::Open(TiqiaaUsbTransport * transport) {
+    if( IsOpen() || (transport == NULL) ) return false;
+    OpScope Scope(this, OpOpen);
+    if( !transport->Open() ) return false;
 
+    Transport = transport;
+    UsbBusNum = 0;
+    UsbDevAddr = 1;
+    if( StartDevice() ) return true;
+
+    Transport->Close();
+    Transport = NULL;
     return false;
 }
 
 bool TiqiaaUsbIr::Close() {
     if( !IsOpen() ) return false;
+    RegisterFlightDevice(this, false);
+    StopTransceive();
+    OpScope Scope(this, OpClose);
+    FlushIR();
+    // skipped if already Idle; the reply is not awaited, the read thread is stopped next
+    if( IdleOnClose && RequestMode(CmdIdleMode, StateIdle) ) ModeCmdId = 0;
     ReadActive = false;
-    SetIdleMode();
     pthread_join(read_thread_info.thread_id, NULL);
-    libusb_close(dev_h);
-    dev_h = NULL;
-    libusb_exit(NULL);
+    if( Transport ) {
+        Transport->Close();
+        Transport = NULL;
+    } else {
+        libusb_close(dev_h);
+        dev_h = NULL;
+        libusb_exit(UsbCtx);
+        UsbCtx = NULL;
+    }
     return true;
 }
 
 bool TiqiaaUsbIr::IsOpen() {
-    return dev_h != NULL;
+    return (dev_h != NULL) || (Transport != NULL);
 }
 
-bool TiqiaaUsbIr::SendReport2(void * data, int size) {
-    uint8_t FragmBuf[61];
-    TiqiaaUsbIr_Report2Header * ReportHdr = (TiqiaaUsbIr_Report2Header *)FragmBuf;
-    int RdPtr;
-    int FragmIndex;
-    int FragmSize;
+bool TiqiaaUsbIr::UsbWrite(uint8_t * data, int size) {
+    TiqiaaUsbIrPcap * Cap = Pcap;
+    uint64_t UrbId = 0;
     int UsbTxSize;
+    bool res;
+
+    if( Cap ) {
+        UrbId = Cap->NewUrbId();
+        Cap->AddBulk(UrbId, 'S', UsbBusNum, UsbDevAddr, WritePipeId, data, size, size, 0);
+    }
+    if( Transport ) res = Transport->Write(data, size);
+    else res = libusb_bulk_transfer(dev_h, WritePipeId, data, size, &UsbTxSize, 0) >= 0;
+    RecordFlight(0, data, size, res);
+    if( res && Recorder ) Recorder->Add('W', data, size);
+    if( Cap ) Cap->AddBulk(UrbId, 'C', UsbBusNum, UsbDevAddr, WritePipeId, NULL, 0, res ? size : 0, res ? 0 : -EIO);
+    if( res ) AddHealth(&Health.BytesOut, size); else AddHealth(&Health.WriteErrors);
+    return res;
+}
+
+// Return: number of bytes read, 0 - timeout expired, < 0 - fail
+int TiqiaaUsbIr::UsbRead(uint8_t * data, int size, unsigned int timeout) {
+    int UsbRxSize;
+    int res;
+
+    if( Transport ) {
+        res = Transport->Read(data, size, timeout);
+    } else {
+        res = libusb_bulk_transfer(dev_h, ReadPipeId, data, size, &UsbRxSize, timeout);
+        if( res == LIBUSB_ERROR_TIMEOUT ) res = 0;
+        else if( res >= 0 ) res = UsbRxSize;
+        else res = -1;
+    }
+    if( res > 0 ) {
+        AddHealth(&Health.BytesIn, res);
+        RecordFlight(1, data, res, true);
+        if( Recorder ) Recorder->Add('R', data, res);
+    } else if( res < 0 ) {
+        AddHealth(&Health.ReadErrors);
+    }
+    // read submits are polls, only completions are captured
+    TiqiaaUsbIrPcap * Cap = Pcap;
+    if( Cap && res ) Cap->AddBulk(Cap->NewUrbId(), 'C', UsbBusNum, UsbDevAddr, ReadPipeId, data, res, (res > 0) ? res : 0, (res > 0) ? 0 : -EIO);
+    return res;
+}
+
+bool TiqiaaUsbIr::SendReport2(void * data, int size) {
+    TiqiaaUsbIrPacketBuilder Pack;
+    TiqiaaUsbIr_IrSegment Seg = {data, size};
+
+    if( !Pack.Build(&Seg, 1) ) return false;
+    return SendReport2(&Pack, 0, 0);
+}
 
-    RdPtr = 0;
-    if( (size <= 0) || (size > MaxUsbPacketSize) ) return false;
-    memset(FragmBuf, 0, sizeof(FragmBuf));
-    ReportHdr->ReportId = WriteReportId;
-    ReportHdr->FragmCount = size / MaxUsbFragmSize;
-    if( (size % MaxUsbFragmSize) != 0 ) ReportHdr->FragmCount ++;
+bool TiqiaaUsbIr::SendReport2(TiqiaaUsbIrPacketBuilder * Pack, uint8_t cmdType, uint8_t cmdId) {
+    TiqiaaUsbIrTraceSpan Span("SendReport2", "CmdId", cmdId);
+    uint64_t WriteNs;
+
+    if( Pack->GetFragmCount() <= 0 ) return false;
+    OpStats[CurOp].Packets++;
+    if( !RoundTripOpen ) {
+        OpStats[CurOp].RoundTrips++;
+        RoundTripOpen = true;
+    }
     PacketIndex ++;
     if( PacketIndex > MaxUsbPacketIndex ) PacketIndex = 1;
-    ReportHdr->PacketIdx = PacketIndex;
-    FragmIndex = 0;
-    while( RdPtr < size ) {
-        FragmIndex ++;
-        ReportHdr->FragmIdx = FragmIndex;
-        FragmSize = size - RdPtr;
-        if( FragmSize > MaxUsbFragmSize ) FragmSize = MaxUsbFragmSize;
-        ReportHdr->FragmSize = FragmSize + 3;
-        memcpy(FragmBuf + sizeof(TiqiaaUsbIr_Report2Header), ((uint8_t *)data) + RdPtr, FragmSize);
-        if( libusb_bulk_transfer(dev_h, WritePipeId, FragmBuf, FragmSize + sizeof(TiqiaaUsbIr_Report2Header), &UsbTxSize, 0) < 0 ) return false;
-        RdPtr += FragmSize;
+    Pack->SetPacketIdx(PacketIndex);
+    for( int i = 0; i < Pack->GetFragmCount(); i++ ) {
+        if( i == Pack->GetFragmCount() - 1 ) {
+            // reply time is measured only if nothing else is queued on the device before this command
+            pthread_mutex_lock(&read_thread_info.mutex);
+            CmdSentNs[cmdId & MaxCmdId] = TiqiaaUsbIr_NowNs();
+            CmdRttValid[cmdId & MaxCmdId] = (PipeCmdId == 0) && (IrFlightCount == 0) && ((ModeCmdId == 0) || (ModeCmdId == cmdId));
+            CmdSentType[cmdId & MaxCmdId] = cmdType;
+            pthread_mutex_unlock(&read_thread_info.mutex);
+        }
+        WriteNs = TiqiaaUsbIr_NowNs();
+        TIQIAA_PROBE5(fragm_send, cmdType, cmdId, PacketIndex, i + 1, Pack->GetFragmSize(i));
+        if( !UsbWrite(Pack->GetFragm(i), Pack->GetFragmSize(i)) ) return false;
+        FragmWriteLatency.RecordNs(WriteNs, TiqiaaUsbIr_NowNs());
+        if( TiqiaaUsbIrTrace::IsEnabled() ) TiqiaaUsbIrTrace::AddSpan("Fragment", WriteNs, TiqiaaUsbIr_NowNs(), "FragmIdx", i + 1);
     }
+    AddHealth(&Health.FramesOut);
     return true;
 }
 
 bool TiqiaaUsbIr::SendCmd(uint8_t cmdType, uint8_t cmdId) {
-    TiqiaaUsbIr_SendCmdPack Pack;
+    TiqiaaUsbIrPacketBuilder Pack;
 
-    Pack.StartSign = PackStartSign;
-    Pack.CmdType = cmdType;
-    Pack.CmdId = cmdId;
-    Pack.EndSign = PackEndSign;
-    return SendReport2(&Pack, sizeof(Pack));
+    {
+        TiqiaaUsbIrTraceSpan Span("BuildCmd", "CmdType", cmdType);
+        if( !Pack.BuildCmd(cmdType, cmdId) ) return false;
+    }
+    return SendReport2(&Pack, cmdType, cmdId);
 }
 
-bool TiqiaaUsbIr::SendIRCmd(int freq, void * buffer, int buf_size, uint8_t cmdId) {
-    uint8_t PackBuf[MaxUsbPacketSize];
-    TiqiaaUsbIr_SendIRPackHeader * PackHeader = (TiqiaaUsbIr_SendIRPackHeader *)PackBuf;
-    uint8_t IrFreqId;
-    int PackSize = sizeof(TiqiaaUsbIr_SendIRPackHeader);
+int TiqiaaUsbIr::GetIrFreqId(int freq) {
+    int IrFreqId;
 
-    if( buf_size < 0 ) return false;
-    if( (buf_size + sizeof(TiqiaaUsbIr_SendIRPackHeader) + sizeof(uint16_t)) > MaxUsbPacketSize ) return false;
     if( freq > 255 ) {
         IrFreqId = 0;
         while( (IrFreqId < TiqiaaUsbIr_IrFreqTableSize) && (TiqiaaUsbIr_IrFreqTable[IrFreqId] != freq) ) IrFreqId++;
-        if( IrFreqId >= TiqiaaUsbIr_IrFreqTableSize ) return false;
+        if( IrFreqId >= TiqiaaUsbIr_IrFreqTableSize ) return -1;
     } else {
-        if( freq < TiqiaaUsbIr_IrFreqTableSize ) IrFreqId = freq; else return false;
+        if( (freq >= 0) && (freq < TiqiaaUsbIr_IrFreqTableSize) ) IrFreqId = freq; else return -1;
+    }
+    return IrFreqId;
+}
+
+bool TiqiaaUsbIr::SendIRCmd(int freq, void * buffer, int buf_size, uint8_t cmdId) {
+    TiqiaaUsbIr_IrSegment Seg = {buffer, buf_size};
+
+    return SendIRCmd(freq, &Seg, 1, cmdId);
+}
+
+bool TiqiaaUsbIr::SendIRCmd(int freq, const TiqiaaUsbIr_IrSegment * segs, int segCount, uint8_t cmdId) {
+    int IrFreqId = GetIrFreqId(freq);
+
+    if( IrFreqId < 0 ) return false;
+    {
+        TiqiaaUsbIrTraceSpan Span("BuildIR", "CmdId", cmdId);
+        if( !IrPack.BuildIR(IrFreqId, segs, segCount, cmdId) ) return false;
     }
-    PackHeader->StartSign = PackStartSign;
-    PackHeader->CmdType = 'D';
-    PackHeader->CmdId = cmdId;
-    PackHeader->IrFreqId = IrFreqId;
-    memcpy(PackBuf + PackSize, buffer, buf_size);
-    PackSize += buf_size;
-    *(uint16_t *)(PackBuf + PackSize) = PackEndSign;
-    PackSize += sizeof(uint16_t);
-    return SendReport2(PackBuf, PackSize);
+    return SendReport2(&IrPack, CmdData, cmdId);
 }
 
 bool TiqiaaUsbIr::SendCmdAndWaitReply(uint8_t cmdType, uint8_t cmdId, uint16_t timeout) {
-    if( !StartCmdReplyWaiting(cmdType, cmdId) ) return false;
-    if( SendCmd(cmdType, cmdId) ) {
-        if( WaitCmdReply(timeout) ) return true;
+    if( !IsOpen() ) return false;
+    for( int attempt = 0; attempt <= MaxCmdRetries; attempt++ ) {
+        if( attempt ) {
+            cmdId = GetCmdId();
+            OpStats[CurOp].Retries++;
+        }
+        ClearCmdReply(cmdId);
+        if( !SendCmd(cmdType, cmdId) ) return false;
+        int res = WaitReply(cmdType, cmdId, 0, timeout);
+        if( res == WaitReplyOk ) return true;
+        if( res == WaitReplyTimeout ) return false;
     }
-    CancelCmdReplyWaiting();
     return false;
 }
 
 uint8_t TiqiaaUsbIr::GetCmdId() {
+    uint8_t res;
+
+    pthread_mutex_lock(&read_thread_info.mutex);
     if( CmdId < MaxCmdId ) CmdId ++; else CmdId = 1;
-    return CmdId;
+    CmdSeq[CmdId] = ++CmdSeqCounter;
+    res = CmdId;
+    pthread_mutex_unlock(&read_thread_info.mutex);
+    return res;
+}
+
+void TiqiaaUsbIr::ClearCmdReply(uint8_t cmdId) {
+    pthread_mutex_lock(&read_thread_info.mutex);
+    ReplyTable[cmdId & MaxCmdId] = 0;
+    pthread_mutex_unlock(&read_thread_info.mutex);
+}
+
+// airtime: IR airtime before the reply, mksec
+// maxTimeout: fixed timeout and upper bound of adaptive one, msec
+int TiqiaaUsbIr::WaitReply(uint8_t cmdType, uint8_t cmdId, uint32_t airtime, uint32_t maxTimeout) {
+    TiqiaaUsbIrTraceSpan Span("WaitReply", "CmdId", cmdId);
+    uint64_t now = TiqiaaUsbIr_NowNs();
+    uint64_t StartNs = now;
+    uint64_t Rto = (uint64_t)GetReplyTimeout(cmdType, airtime, maxTimeout) * 1000;
+    uint64_t Deadline = now + Rto;
+    struct timespec ts;
+    int Probes = 0;
+    int Idx = GetCmdIndex(cmdType);
+    int res;
+
+    RoundTripOpen = false;
+    pthread_mutex_lock(&read_thread_info.mutex);
+    while( true ) {
+        if( ReplyTable[cmdId & MaxCmdId] == cmdType ) {
+            res = WaitReplyOk;
+            UpdateRtt(cmdType, cmdId, airtime);
+            break;
+        }
+        if( (int32_t)(LastReplySeq - CmdSeq[cmdId & MaxCmdId]) > 0 ) { // later command already answered
+            res = WaitReplyLost;
+            break;
+        }
+        now = TiqiaaUsbIr_NowNs();
+        if( now >= Deadline ) {
+            if( Probes >= MaxCmdRetries ) {
+                res = WaitReplyTimeout;
+                if( Idx >= 0 ) RttStats[Idx].Timeouts++;
+                AddHealth(&Health.WaitTimeouts);
+                break;
+            }
+            // no reply in time: probe, the wait doubles as after a TCP retransmission
+            pthread_mutex_unlock(&read_thread_info.mutex);
+            SendCmd(CmdUnknown, GetCmdId());
+            pthread_mutex_lock(&read_thread_info.mutex);
+            OpStats[CurOp].Probes++;
+            Probes++;
+            Rto *= 2;
+            Deadline = now + Rto;
+            continue;
+        }
+        ts = TiqiaaUsbIr_NsToTimespec(Deadline);
+        pthread_cond_timedwait(&read_thread_info.condition, &read_thread_info.mutex, &ts);
+    }
+    if( res == WaitReplyLost ) OpStats[CurOp].LostReplies++;
+    CmdRttValid[cmdId & MaxCmdId] = false;
+    pthread_mutex_unlock(&read_thread_info.mutex);
+    now = TiqiaaUsbIr_NowNs();
+    ReplyWaitLatency.RecordNs(StartNs, now);
+    if( res == WaitReplyOk ) TIQIAA_PROBE3(reply_matched, cmdType, cmdId, (now - StartNs) / 1000);
+    else if( res == WaitReplyLost ) TIQIAA_PROBE3(reply_lost, cmdType, cmdId, (now - StartNs) / 1000);
+    else TIQIAA_PROBE3(reply_timeout, cmdType, cmdId, (now - StartNs) / 1000);
+    if( (res == WaitReplyTimeout) && (FlightDumpFd >= 0) ) {
+        char Msg[64];
+        int Len = snprintf(Msg, sizeof(Msg), "TiqiaaUsbIr: no reply to CmdType %c CmdId %u\n", cmdType, cmdId);
+        if( write(FlightDumpFd, Msg, Len) == Len ) DumpFlightRecorder(FlightDumpFd);
+    }
+    return res;
+}
+
+bool TiqiaaUsbIr::WaitIrReply(uint8_t cmdId, uint32_t airtime) {
+    // lost reply of IR packet: a later reply proves the packet was already played
+    return WaitReply(CmdOutput, cmdId, airtime, IrReplyWaitTimeout) != WaitReplyTimeout;
 }
 
 bool TiqiaaUsbIr::StartCmdReplyWaiting(uint8_t cmdType, uint8_t cmdId) {
     if( !IsOpen() ) return false;
 
     pthread_mutex_lock(&read_thread_info.mutex);
-    if( IsWaitingCmdReply ) return false;
+    if( IsWaitingCmdReply ) {
+        pthread_mutex_unlock(&read_thread_info.mutex);
+        return false;
+    }
     WaitCmdId = cmdId;
     WaitCmdType = cmdType;
     IsWaitingCmdReply = true;
     IsCmdReplyReceived = false;
+    ReplyTable[cmdId & MaxCmdId] = 0;
     pthread_mutex_unlock(&read_thread_info.mutex);
 
     return true;
 }
 
 bool TiqiaaUsbIr::WaitCmdReply(uint16_t timeout) {
-    bool res = false;
-    struct timespec now;
-    struct timespec wait_until;
+    bool res;
 
     if( !IsOpen() ) return false;
     if( !IsWaitingCmdReply ) return false;
 
-    clock_gettime(CLOCK_REALTIME, &now);
-    // timeout in msec
-    wait_until.tv_sec = now.tv_sec + timeout / 1000;
-    wait_until.tv_nsec = now.tv_nsec + (timeout % 1000) * 1000000;
-    while( wait_until.tv_nsec > 999999999 ) {
-        wait_until.tv_sec += 1;
-        wait_until.tv_nsec -= 999999999;
-    }
-    pthread_cond_timedwait(&read_thread_info.condition, &read_thread_info.mutex, &wait_until);
-    // Here need to process return and unlock the mutex after that
-    pthread_mutex_unlock(&read_thread_info.mutex);
-
+    // airtime of IR data sent by the caller is unknown, its timeout is used as is
+    res = (WaitReply(WaitCmdType, WaitCmdId, (WaitCmdType == CmdOutput) ? UnknownAirtime : 0, timeout) == WaitReplyOk);
     pthread_mutex_lock(&read_thread_info.mutex);
-    if( IsWaitingCmdReply && IsCmdReplyReceived ) {
-        res = true;
-        IsWaitingCmdReply = false;
-    }
+    if( res ) IsWaitingCmdReply = false;
     pthread_mutex_unlock(&read_thread_info.mutex);
     return res;
 }
@@ -225,39 +796,548 @@ bool TiqiaaUsbIr::CancelCmdReplyWaiting() {
 
 bool TiqiaaUsbIr::SetIdleMode() {
     if( !IsOpen() ) return false;
-    if( DeviceState == StateIdle ) return true;
-    if( SendCmdAndWaitReply(CmdIdleMode, GetCmdId(), CmdReplyWaitTimeout) ) {
-        if( DeviceState == StateIdle ) return true;
-    }
-    return false;
+    OpScope Scope(this, OpSetIdleMode);
+    if( !RequestMode(CmdIdleMode, StateIdle) ) return false;
+    return CompleteModeSwitch();
 }
 
 bool TiqiaaUsbIr::SendIR(int freq, void * buffer, int buf_size) {
+    TiqiaaUsbIr_IrSegment Seg = {buffer, buf_size};
+
+    return SendIR(freq, &Seg, 1);
+}
+
+bool TiqiaaUsbIr::RequestMode(uint8_t cmdType, uint8_t state) {
     if( !IsOpen() ) return false;
-    if( DeviceState != StateSend ) {
-        if( !SendCmdAndWaitReply(CmdSendMode, GetCmdId(), CmdReplyWaitTimeout) ) return false;
+    if( ModeCmdId ) CompleteModeSwitch();
+    if( DeviceState != state ) FlushIR(); // mode switch would cut scheduled packets
+    if( DeviceState == state ) {
+        OpStats[CurOp].ElidedSwitches++;
+        return true;
+    }
+    ModeCmdId = GetCmdId();
+    ModeCmdType = cmdType;
+    ModeState = state;
+    ClearCmdReply(ModeCmdId);
+    ModeSentNs = TiqiaaUsbIr_NowNs();
+    if( SendCmd(cmdType, ModeCmdId) ) return true;
+    ModeCmdId = 0;
+    return false;
+}
+
+bool TiqiaaUsbIr::CompleteModeSwitch() {
+    uint8_t WaitId = ModeCmdId;
+    bool res;
+
+    if( WaitId == 0 ) return true;
+    ModeCmdId = 0;
+    int Wait = WaitReply(ModeCmdType, WaitId, 0, MaxCmdTimeout);
+    if( Wait == WaitReplyTimeout ) return false;
+    if( DeviceState == ModeState ) { // reply or the state of a later reply
+        res = true;
+    } else {
+        if( Wait == WaitReplyOk ) return false;
+        OpStats[CurOp].Retries++;
+        res = SendCmdAndWaitReply(ModeCmdType, GetCmdId(), MaxCmdTimeout) && (DeviceState == ModeState);
     }
-    if( DeviceState != StateSend ) return false;
+    if( res ) ModeSwitchLatency.RecordNs(ModeSentNs, TiqiaaUsbIr_NowNs());
+    return res;
+}
+
+bool TiqiaaUsbIr::SetSendMode() {
+    if( !RequestMode(CmdSendMode, StateSend) ) return false;
+    return CompleteModeSwitch();
+}
+
+bool TiqiaaUsbIr::SendIR(int freq, const TiqiaaUsbIr_IrSegment * segs, int segCount) {
+    OpScope Scope(this, OpSendIR);
+    if( IrOpenLoop ) return ScheduleIRPacket(freq, segs, segCount);
+    FlushIR();
+    // device handles packets in order, IR data can follow the mode switch without waiting for its reply
+    if( !RequestMode(CmdSendMode, StateSend) ) return false;
     uint8_t SendIRCmdId = GetCmdId();
-    if( !StartCmdReplyWaiting(CmdOutput, SendIRCmdId) ) return false;
-    if( SendIRCmd(freq, buffer, buf_size, SendIRCmdId) ) {
-        if( WaitCmdReply(IrReplyWaitTimeout)) return true;
+    uint32_t Airtime = 0;
+    for( int i = 0; i < segCount; i++ ) Airtime += TiqiaaUsbIr_GetIrAirtime((const uint8_t *)segs[i].Data, segs[i].Size);
+    ClearCmdReply(SendIRCmdId);
+    if( !SendIRCmd(freq, segs, segCount, SendIRCmdId) ) {
+        CompleteModeSwitch();
+        return false;
     }
-    CancelCmdReplyWaiting();
-    return false;
+    if( !CompleteModeSwitch() ) return false;
+    return WaitIrReply(SendIRCmdId, Airtime);
+}
+
+bool TiqiaaUsbIr::ScheduleIRPacket(int freq, const TiqiaaUsbIr_IrSegment * segs, int segCount) {
+    IrFlight * Flight;
+    uint64_t SendAt;
+    uint64_t StartNs;
+    uint8_t SendIRCmdId;
+    uint32_t Airtime = 0;
+
+    for( int i = 0; i < segCount; i++ ) Airtime += TiqiaaUsbIr_GetIrAirtime((const uint8_t *)segs[i].Data, segs[i].Size);
+    if( !RequestMode(CmdSendMode, StateSend) ) return false;
+    ReconcileIRFlights(false);
+    if( IrFlightCount >= MaxIrInFlight ) { // replies fall behind, wait for the oldest one
+        IrSchedStats.Stalls++;
+        while( IrFlightCount >= MaxIrInFlight ) ReconcileIRFlights(true);
+    }
+    if( IrFlightCount ) {
+        // arrive just before the last packet ends, but never queue two packets behind the playing one
+        Flight = &IrFlights[(IrFlightHead + IrFlightCount - 1) % MaxIrInFlight];
+        SendAt = (Flight->EndNs > (uint64_t)IrScheduleLead * 1000) ? Flight->EndNs - (uint64_t)IrScheduleLead * 1000 : 0;
+        if( IrFlightCount >= 2 ) {
+            uint64_t PrevEndNs = IrFlights[(IrFlightHead + IrFlightCount - 2) % MaxIrInFlight].EndNs;
+            if( PrevEndNs > SendAt ) SendAt = PrevEndNs;
+        }
+        if( SendAt > TiqiaaUsbIr_NowNs() ) TiqiaaUsbIr_SleepUntilNs(SendAt);
+        ReconcileIRFlights(false);
+    }
+
+    SendIRCmdId = GetCmdId();
+    ClearCmdReply(SendIRCmdId);
+    if( !SendIRCmd(freq, segs, segCount, SendIRCmdId) ) {
+        CompleteModeSwitch();
+        return false;
+    }
+    if( !CompleteModeSwitch() ) return false;
+
+    StartNs = TiqiaaUsbIr_NowNs();
+    if( IrFlightCount ) {
+        Flight = &IrFlights[(IrFlightHead + IrFlightCount - 1) % MaxIrInFlight];
+        if( Flight->EndNs > StartNs ) StartNs = Flight->EndNs;
+    }
+    Flight = &IrFlights[(IrFlightHead + IrFlightCount) % MaxIrInFlight];
+    Flight->CmdId = SendIRCmdId;
+    Flight->Airtime = Airtime;
+    Flight->EndNs = StartNs + (uint64_t)Airtime * 1000;
+    IrFlightCount++;
+    IrSchedStats.Packets++;
+    if( (uint32_t)IrFlightCount > IrSchedStats.MaxInFlight ) IrSchedStats.MaxInFlight = IrFlightCount;
+    RoundTripOpen = false;
+    return true;
+}
+
+// Match replies to open-loop IR packets, oldest first
+// wait: false - only take replies already received, true - wait until the oldest packet is done
+void TiqiaaUsbIr::ReconcileIRFlights(bool wait) {
+    IrFlight * Flight;
+    uint64_t now;
+    uint64_t Deadline;
+    uint64_t EndNs;
+    int64_t EndErr;
+    uint32_t ReplyUs;
+    struct timespec ts;
+    bool Probed = false;
+
+    pthread_mutex_lock(&read_thread_info.mutex);
+    while( IrFlightCount ) {
+        Flight = &IrFlights[IrFlightHead];
+        if( ReplyTable[Flight->CmdId & MaxCmdId] == CmdOutput ) {
+            // reply comes one device reply time after playback end, shift the rest of the schedule by the error
+            UpdateRtt(CmdOutput, Flight->CmdId, Flight->Airtime);
+            ReplyUs = RttStats[GetCmdIndex(CmdOutput)].Samples ? RttStats[GetCmdIndex(CmdOutput)].SrttUs : RttStats[RttLinkIdx].SrttUs;
+            EndNs = ReplyRecvNs[Flight->CmdId & MaxCmdId] - (uint64_t)ReplyUs * 1000;
+            EndErr = (int64_t)(EndNs - Flight->EndNs);
+            for( int i = 1; i < IrFlightCount; i++ ) IrFlights[(IrFlightHead + i) % MaxIrInFlight].EndNs += EndErr;
+            if( EndErr < 0 ) EndErr = -EndErr;
+            IrSchedStats.EndErrSumUs += EndErr / 1000;
+            if( (uint32_t)(EndErr / 1000) > IrSchedStats.EndErrMaxUs ) IrSchedStats.EndErrMaxUs = EndErr / 1000;
+            IrSchedStats.Completed++;
+        } else if( (int32_t)(LastReplySeq - CmdSeq[Flight->CmdId & MaxCmdId]) > 0 ) { // reply lost, packet played
+            OpStats[CurOp].LostReplies++;
+            IrSchedStats.Completed++;
+        } else {
+            if( !wait ) break; // late replies are only given up on by a waiting call, after a probe
+            now = TiqiaaUsbIr_NowNs();
+            Deadline = Flight->EndNs + (uint64_t)GetReplyTimeout(CmdOutput, 0, IrReplyWaitTimeout) * 1000;
+            if( now < Deadline ) {
+                ts = TiqiaaUsbIr_NsToTimespec(Deadline);
+                pthread_cond_timedwait(&read_thread_info.condition, &read_thread_info.mutex, &ts);
+                continue;
+            }
+            if( !Probed && (MaxCmdRetries > 0) ) { // the last reply may be lost, a probe reply proves it
+                pthread_mutex_unlock(&read_thread_info.mutex);
+                SendCmd(CmdUnknown, GetCmdId());
+                pthread_mutex_lock(&read_thread_info.mutex);
+                OpStats[CurOp].Probes++;
+                Probed = true;
+                Flight->EndNs = TiqiaaUsbIr_NowNs();
+                continue;
+            }
+            RttStats[GetCmdIndex(CmdOutput)].Timeouts++;
+            AddHealth(&Health.WaitTimeouts);
+            IrSchedStats.Failed++;
+            IrFlightFailed = true;
+        }
+        CmdRttValid[Flight->CmdId & MaxCmdId] = false;
+        IrFlightHead = (IrFlightHead + 1) % MaxIrInFlight;
+        IrFlightCount--;
+        if( wait ) break;
+    }
+    pthread_mutex_unlock(&read_thread_info.mutex);
+}
+
+bool TiqiaaUsbIr::FlushIR() {
+    bool res;
+
+    while( IrFlightCount ) ReconcileIRFlights(true);
+    res = !IrFlightFailed;
+    IrFlightFailed = false;
+    return res;
+}
+
+void TiqiaaUsbIr::GetIrScheduleStats(TiqiaaUsbIr_IrScheduleStats * stats) {
+    *stats = IrSchedStats;
+}
+
+void TiqiaaUsbIr::ResetIrScheduleStats() {
+    memset(&IrSchedStats, 0, sizeof(IrSchedStats));
+}
+
+bool TiqiaaUsbIr::QueueIRPacket(int freq, const TiqiaaUsbIr_IrSegment * segs, int segCount, uint32_t airtime) {
+    uint8_t SendIRCmdId = GetCmdId();
+
+    ClearCmdReply(SendIRCmdId);
+    if( !SendIRCmd(freq, segs, segCount, SendIRCmdId) ) {
+        FlushIRPackets();
+        return false;
+    }
+    // previous packet ends while this one is already queued on the device
+    if( !FlushIRPackets() ) return false;
+    PipeCmdId = SendIRCmdId;
+    PipeAirtime = airtime;
+    if( !IrStreamPipeline ) return FlushIRPackets();
+    return true;
+}
+
+bool TiqiaaUsbIr::FlushIRPackets() {
+    uint8_t WaitId = PipeCmdId;
+
+    if( WaitId == 0 ) return true;
+    PipeCmdId = 0;
+    return WaitIrReply(WaitId, PipeAirtime);
+}
+
+bool TiqiaaUsbIr::SendIRStream(int freq, void * buffer, int buf_size) {
+    TiqiaaUsbIr_IrSegment Seg;
+
+    if( buf_size <= TiqiaaUsbIrPacketBuilder::MaxIrDataSize ) return SendIR(freq, buffer, buf_size);
+    OpScope Scope(this, OpSendIRStream);
+    FlushIR();
+    if( !SetSendMode() ) return false;
+
+    Seg.Data = buffer;
+    while( buf_size > 0 ) {
+        Seg.Size = buf_size;
+        if( Seg.Size > TiqiaaUsbIrPacketBuilder::MaxIrDataSize ) Seg.Size = TiqiaaUsbIrPacketBuilder::MaxIrDataSize;
+        if( !QueueIRPacket(freq, &Seg, 1, TiqiaaUsbIr_GetIrAirtime((const uint8_t *)Seg.Data, Seg.Size)) ) return false;
+        Seg.Data = (const uint8_t *)Seg.Data + Seg.Size;
+        buf_size -= Seg.Size;
+    }
+    return FlushIRPackets();
+}
+
+// MaxIrSendBlockSize idle ticks per byte, gaps are sent straight from here
+static const uint8_t * GetIrIdleBlocks() {
+    static struct IdleBlocks {
+        uint8_t Buf[TiqiaaUsbIrPacketBuilder::MaxIrDataSize];
+        IdleBlocks() { memset(Buf, 0x7F, sizeof(Buf)); }
+    } Idle;
+    return Idle.Buf;
+}
+
+// Add frame to the batch packet, the packet is queued first if the frame does not fit
+// Return: true - success, false - frame is larger than an IR data packet or queue failed
+bool TiqiaaUsbIr::AddBatchFrame(IrBatch * batch, int freq, const uint8_t * data, int size) {
+    if( (size <= 0) || (size > TiqiaaUsbIrPacketBuilder::MaxIrDataSize) ) {
+        FlushIRPackets();
+        return false;
+    }
+    if( ((batch->PackSize + size) > TiqiaaUsbIrPacketBuilder::MaxIrDataSize) || (batch->SegCount >= MaxBatchSegments) ) {
+        if( !QueueBatch(batch, freq) ) return false;
+    }
+    batch->Segs[batch->SegCount].Data = data;
+    batch->Segs[batch->SegCount].Size = size;
+    batch->SegCount++;
+    batch->PackSize += size;
+    batch->Airtime += TiqiaaUsbIr_GetIrAirtime(data, size);
+    return true;
+}
+
+// Add idle ticks to the batch packet, a gap may be split between packets
+// gap: idle time, mksec
+bool TiqiaaUsbIr::AddBatchGap(IrBatch * batch, int freq, uint32_t gap) {
+    uint32_t GapTicks = (gap + TiqiaaUsbIr_IrTickUs / 2) / TiqiaaUsbIr_IrTickUs;
+    uint32_t SegTicks;
+    int Blocks;
+
+    while( GapTicks > 0 ) {
+        if( (batch->PackSize >= TiqiaaUsbIrPacketBuilder::MaxIrDataSize) || (batch->SegCount >= MaxBatchSegments) ) {
+            if( !QueueBatch(batch, freq) ) return false;
+        }
+        Blocks = GapTicks / MaxIrSendBlockSize;
+        if( Blocks > (TiqiaaUsbIrPacketBuilder::MaxIrDataSize - batch->PackSize) ) Blocks = TiqiaaUsbIrPacketBuilder::MaxIrDataSize - batch->PackSize;
+        if( Blocks > 0 ) {
+            batch->Segs[batch->SegCount].Data = GetIrIdleBlocks();
+            batch->Segs[batch->SegCount].Size = Blocks;
+            SegTicks = Blocks * MaxIrSendBlockSize;
+        } else {
+            batch->GapTail[batch->SegCount] = GapTicks;
+            batch->Segs[batch->SegCount].Data = &batch->GapTail[batch->SegCount];
+            batch->Segs[batch->SegCount].Size = 1;
+            SegTicks = GapTicks;
+        }
+        GapTicks -= SegTicks;
+        batch->Airtime += SegTicks * TiqiaaUsbIr_IrTickUs;
+        batch->PackSize += batch->Segs[batch->SegCount].Size;
+        batch->SegCount++;
+    }
+    return true;
+}
+
+// Queue the batch packet and start a new one
+bool TiqiaaUsbIr::QueueBatch(IrBatch * batch, int freq) {
+    bool res = QueueIRPacket(freq, batch->Segs, batch->SegCount, batch->Airtime);
+
+    batch->SegCount = batch->PackSize = batch->Airtime = 0;
+    return res;
+}
+
+bool TiqiaaUsbIr::SendIRBatch(int freq, const TiqiaaUsbIr_IrFrame * frames, int frameCount) {
+    IrBatch Batch;
+
+    if( frameCount <= 0 ) return false;
+    OpScope Scope(this, OpSendIRBatch);
+    FlushIR();
+    if( !SetSendMode() ) return false;
+
+    Batch.SegCount = Batch.PackSize = Batch.Airtime = 0;
+    for( int i = 0; i < frameCount; i++ ) {
+        if( !AddBatchFrame(&Batch, freq, frames[i].Data, frames[i].Size) ) return false;
+        if( i == frameCount - 1 ) break;
+        if( !AddBatchGap(&Batch, freq, frames[i].Gap) ) return false;
+    }
+    if( !QueueBatch(&Batch, freq) ) return false;
+    return FlushIRPackets();
+}
+
+bool TiqiaaUsbIr::SendNecHold(uint16_t IrCode, uint32_t holdMs) {
+    uint8_t Frame[128];
+    uint8_t Repeat[16];
+    int FrameSize = WriteIrNecSignal(IrCode, Frame);
+    int RepeatSize = WriteIrNecRepeat(Repeat);
+    uint32_t RepeatCount = 0;
+    IrBatch Batch;
+
+    // the frame trailer is replaced by the gap to the first repeat frame
+    while( (FrameSize > 0) && !(Frame[FrameSize - 1] & 0x80) ) FrameSize--;
+    if( (uint64_t)holdMs * 1000 > NecFramePeriod ) RepeatCount = ((uint64_t)holdMs * 1000 - 1) / NecFramePeriod;
+    OpScope Scope(this, OpSendIRBatch);
+    FlushIR();
+    if( !SetSendMode() ) return false;
+
+    Batch.SegCount = Batch.PackSize = Batch.Airtime = 0;
+    if( !AddBatchFrame(&Batch, 38000, Frame, FrameSize) ) return false;
+    for( uint32_t i = 0; i < RepeatCount; i++ ) {
+        uint32_t Airtime = TiqiaaUsbIr_GetIrAirtime((i == 0) ? Frame : Repeat, (i == 0) ? FrameSize : RepeatSize);
+        if( !AddBatchGap(&Batch, 38000, NecFramePeriod - Airtime) ) return false;
+        if( !AddBatchFrame(&Batch, 38000, Repeat, RepeatSize) ) return false;
+    }
+    if( !QueueBatch(&Batch, 38000) ) return false;
+    return FlushIRPackets();
 }
 
 bool TiqiaaUsbIr::StartRecvIR() {
+    uint8_t CancelCmdId = 0;
+    uint8_t OutputCmdId;
+    bool res;
+
     if( !IsOpen() ) return false;
-    if( DeviceState != StateRecv ) {
-        if( !SendCmdAndWaitReply(CmdRecvMode, GetCmdId(), CmdReplyWaitTimeout) ) return false;
-        if( DeviceState != StateRecv ) return false;
-        if( !SendCmdAndWaitReply(CmdCancel, GetCmdId(), CmdReplyWaitTimeout) ) return false;
+    OpScope Scope(this, OpStartRecvIR);
+    if( (DeviceState == StateRecv) && (ModeCmdId == 0) && RecvArmed ) { // already receiving
+        OpStats[CurOp].ElidedSwitches++;
+        return true;
+    }
+    if( !RequestMode(CmdRecvMode, StateRecv) ) return false;
+    if( ModeCmdId ) { // switching: cancel and receive start are pipelined behind the mode command
+        CancelCmdId = GetCmdId();
+        ClearCmdReply(CancelCmdId);
+        if( !SendCmd(CmdCancel, CancelCmdId) ) {
+            CompleteModeSwitch();
+            return false;
+        }
+    }
+    // armed before sending, a capture may arrive before the mode switch is confirmed
+    OutputCmdId = GetCmdId();
+    pthread_mutex_lock(&read_thread_info.mutex);
+    RecvCmdId = OutputCmdId;
+    RecvArmed = true;
+    pthread_mutex_unlock(&read_thread_info.mutex);
+    res = SendCmd(CmdOutput, OutputCmdId);
+    if( CancelCmdId ) {
+        if( !CompleteModeSwitch() ) res = false;
+        else if( WaitReply(CmdCancel, CancelCmdId, 0, MaxCmdTimeout) == WaitReplyTimeout ) res = false;
+    }
+    if( !res ) {
+        pthread_mutex_lock(&read_thread_info.mutex);
+        RecvArmed = false;
+        pthread_mutex_unlock(&read_thread_info.mutex);
     }
-    if( !SendCmd(CmdOutput, GetCmdId()) ) return false;
+    return res;
+}
+
+bool TiqiaaUsbIr::StartTransceive() {
+    if( !IsOpen() || TransceiveActive ) return false;
+    if( !StartRecvIR() ) return false;
+    pthread_mutex_lock(&read_thread_info.mutex);
+    TxHead = 0;
+    TxCount = 0;
+    TransceiveActive = true;
+    pthread_mutex_unlock(&read_thread_info.mutex);
+    if( pthread_create(&TransceiveThread, NULL, TiqiaaUsbIr::RunTransceiveThreadFn, (void*)this) == 0 ) return true;
+    TransceiveActive = false;
+    return false;
+}
+
+bool TiqiaaUsbIr::StopTransceive() {
+    pthread_mutex_lock(&read_thread_info.mutex);
+    if( !TransceiveActive ) {
+        pthread_mutex_unlock(&read_thread_info.mutex);
+        return false;
+    }
+    TransceiveActive = false;
+    pthread_cond_broadcast(&read_thread_info.condition);
+    pthread_mutex_unlock(&read_thread_info.mutex);
+    pthread_join(TransceiveThread, NULL);
     return true;
 }
 
+bool TiqiaaUsbIr::QueueTransmit(int freq, const void * buffer, int buf_size) {
+    TxSlot * Slot;
+    bool res = false;
+
+    if( (buf_size <= 0) || (buf_size > TiqiaaUsbIrPacketBuilder::MaxIrDataSize) || (GetIrFreqId(freq) < 0) ) return false;
+    pthread_mutex_lock(&read_thread_info.mutex);
+    if( TransceiveActive ) {
+        if( TxCount < MaxTxQueue ) {
+            Slot = &TxQueue[(TxHead + TxCount) % MaxTxQueue];
+            Slot->Freq = freq;
+            Slot->Size = buf_size;
+            memcpy(Slot->Data, buffer, buf_size);
+            TxCount++;
+            pthread_cond_broadcast(&read_thread_info.condition);
+            res = true;
+        } else {
+            TrxStats.Dropped++;
+        }
+    }
+    pthread_mutex_unlock(&read_thread_info.mutex);
+    return res;
+}
+
+void TiqiaaUsbIr::GetTransceiveStats(TiqiaaUsbIr_TransceiveStats * stats) {
+    pthread_mutex_lock(&read_thread_info.mutex);
+    *stats = TrxStats;
+    pthread_mutex_unlock(&read_thread_info.mutex);
+}
+
+void TiqiaaUsbIr::ResetTransceiveStats() {
+    pthread_mutex_lock(&read_thread_info.mutex);
+    memset(&TrxStats, 0, sizeof(TrxStats));
+    pthread_mutex_unlock(&read_thread_info.mutex);
+}
+
+void *TiqiaaUsbIr::RunTransceiveThreadFn(void *pcls)
+{
+    if( pcls == NULL ) return NULL;
+    TiqiaaUsbIr* cls = static_cast<TiqiaaUsbIr*>(pcls);
+    cls->TransceiveThreadFn();
+    return 0;
+}
+
+// Send queued signals back to back: IR data follows the mode switch, the next signal is sent while the current one plays
+// Mutex is not locked, slots are freed after their packet is sent
+void TiqiaaUsbIr::SendTxQueue() {
+    TiqiaaUsbIr_IrSegment Seg;
+    TxSlot * Slot;
+    bool Switching;
+    bool Sent;
+
+    OpScope Scope(this, OpTransceive);
+    FlushIR();
+    Sent = RequestMode(CmdSendMode, StateSend);
+    Switching = Sent;
+    pthread_mutex_lock(&read_thread_info.mutex);
+    while( TxCount ) {
+        Slot = &TxQueue[TxHead];
+        pthread_mutex_unlock(&read_thread_info.mutex);
+        if( Sent ) {
+            Seg.Data = Slot->Data;
+            Seg.Size = Slot->Size;
+            Sent = QueueIRPacket(Slot->Freq, &Seg, 1, TiqiaaUsbIr_GetIrAirtime(Slot->Data, Slot->Size));
+            if( Switching ) {
+                Switching = false;
+                if( !CompleteModeSwitch() ) Sent = false;
+            }
+        }
+        pthread_mutex_lock(&read_thread_info.mutex);
+        TxHead = (TxHead + 1) % MaxTxQueue;
+        TxCount--;
+        if( Sent ) TrxStats.Transmits++; else TrxStats.Failed++;
+    }
+    pthread_mutex_unlock(&read_thread_info.mutex);
+    if( !FlushIRPackets() ) {
+        pthread_mutex_lock(&read_thread_info.mutex);
+        TrxStats.Failed++;
+        pthread_mutex_unlock(&read_thread_info.mutex);
+    }
+}
+
+// Owns the device while transceiving: queued signals first, then back to receive
+void TiqiaaUsbIr::TransceiveThreadFn() {
+    uint64_t BlindStartNs = 0;
+    uint32_t BlindUs;
+    struct timespec ts;
+    bool Rearm;
+
+    pthread_mutex_lock(&read_thread_info.mutex);
+    while( TransceiveActive || TxCount ) {
+        if( TxCount ) {
+            pthread_mutex_unlock(&read_thread_info.mutex);
+            if( BlindStartNs == 0 ) BlindStartNs = TiqiaaUsbIr_NowNs();
+            SendTxQueue();
+            pthread_mutex_lock(&read_thread_info.mutex);
+            continue;
+        }
+        if( !RecvArmed ) {
+            Rearm = (BlindStartNs == 0);
+            pthread_mutex_unlock(&read_thread_info.mutex);
+            if( StartRecvIR() ) {
+                pthread_mutex_lock(&read_thread_info.mutex);
+                if( Rearm ) {
+                    TrxStats.Rearms++;
+                } else {
+                    BlindUs = (TiqiaaUsbIr_NowNs() - BlindStartNs) / 1000;
+                    TrxStats.BlindPeriods++;
+                    TrxStats.BlindSumUs += BlindUs;
+                    if( BlindUs > TrxStats.BlindMaxUs ) TrxStats.BlindMaxUs = BlindUs;
+                    BlindStartNs = 0;
+                }
+                continue;
+            }
+            pthread_mutex_lock(&read_thread_info.mutex);
+            if( !TransceiveActive ) break;
+            // device does not answer, retry later
+            ts = TiqiaaUsbIr_NsToTimespec(TiqiaaUsbIr_NowNs() + (uint64_t)ReadPollTimeout * 1000000);
+            pthread_cond_timedwait(&read_thread_info.condition, &read_thread_info.mutex, &ts);
+            continue;
+        }
+        if( !TransceiveActive ) break;
+        pthread_cond_wait(&read_thread_info.condition, &read_thread_info.mutex);
+    }
+    pthread_mutex_unlock(&read_thread_info.mutex);
+}
+
 bool TiqiaaUsbIr::SendNecSignal(uint16_t IrCode) {
     uint8_t Buf[128];
     int BufSize;
@@ -267,64 +1347,106 @@ bool TiqiaaUsbIr::SendNecSignal(uint16_t IrCode) {
 }
 
 
-void TiqiaaUsbIr::WriteIrNecSignalPulse(TqIrWriteData * IrWrData, int PulseCount, bool isSet) {
-    int TickCount;
-    int SendBlockSize;
+// NEC encoder tables. A bit mark or space is at most 3 pulses + remainder < 127 ticks, one
+// send block, so a code byte is always 16 bytes of signal data. They depend only on the byte
+// and on the rounding remainder (PulseTime - SenderTime < IrSendTickSize) carried into it.
+struct TiqiaaUsbIr::NecTables {
+    static const int MaxHeaderSize = 16;
+    static const int MaxTrailerSize = 32;
 
-    IrWrData->PulseTime += PulseCount * NecPulseSize;
-    TickCount = IrWrData->PulseTime - IrWrData->SenderTime;
-    TickCount /= IrSendTickSize;
-    IrWrData->SenderTime += TickCount * IrSendTickSize;
-    while( TickCount > 0 ) {
-        SendBlockSize = TickCount;
-        if( SendBlockSize > MaxIrSendBlockSize ) SendBlockSize = MaxIrSendBlockSize;
-        TickCount -= SendBlockSize;
-        if( isSet ) SendBlockSize |= 0x80;
-        IrWrData->Buf[IrWrData->Size] = SendBlockSize;
-        IrWrData->Size ++;
+    struct ByteEntry {
+        uint8_t Data[16];
+        uint8_t Remainder; // carried to the next byte
+    };
+
+    uint8_t Header[MaxHeaderSize]; // start mark and space
+    int HeaderSize;
+    int HeaderRemainder;
+    ByteEntry Bytes[IrSendTickSize][256];
+    uint8_t Trailer[IrSendTickSize][MaxTrailerSize]; // stop mark and the space up to 108 ms
+    int TrailerSize[IrSendTickSize];
+};
+
+bool TiqiaaUsbIr::BuildNecTables(NecTables * tables) {
+    TqIrWriteData WriteData = {tables->Header, 0, 0, 0};
+
+    TiqiaaNecFrame_WritePulse(&WriteData, 16, true);
+    TiqiaaNecFrame_WritePulse(&WriteData, 8, false);
+    tables->HeaderSize = WriteData.Size;
+    tables->HeaderRemainder = WriteData.PulseTime - WriteData.SenderTime;
+    for( int r = 0; r < IrSendTickSize; r++ ) {
+        for( int b = 0; b < 256; b++ ) {
+            WriteData = {tables->Bytes[r][b].Data, 0, r, 0};
+            for( int i = 0; i < 8; i++ ) {
+                TiqiaaNecFrame_WritePulse(&WriteData, 1, true);
+                TiqiaaNecFrame_WritePulse(&WriteData, ((b >> i) & 1) ? 3 : 1, false);
+            }
+            tables->Bytes[r][b].Remainder = WriteData.PulseTime - WriteData.SenderTime;
+        }
+        WriteData = {tables->Trailer[r], 0, r, 0};
+        TiqiaaNecFrame_WritePulse(&WriteData, 1, true);
+        TiqiaaNecFrame_WritePulse(&WriteData, 72, false);
+        tables->TrailerSize[r] = WriteData.Size;
     }
+    return true;
 }
 
-int TiqiaaUsbIr::WriteIrNecSignal(uint16_t IrCode, uint8_t * OutBuf) {
-    TqIrWriteData WriteData;
-    int i;
-    uint32_t tcode;
+// Tables are built on first use, the static initialization is thread safe
+const TiqiaaUsbIr::NecTables * TiqiaaUsbIr::GetNecTables() {
+    static NecTables Tables;
+    static const bool Built = BuildNecTables(&Tables);
 
-    WriteData.Buf = OutBuf;
-    WriteData.Size = 0;
-    WriteData.PulseTime = 0;
-    WriteData.SenderTime = 0;
+    (void)Built;
+    return &Tables;
+}
 
-    ((uint8_t *)(&tcode))[0] = ((uint8_t *)(&IrCode))[1];
-    ((uint8_t *)(&tcode))[1] = ~((uint8_t *)(&IrCode))[1];
-    ((uint8_t *)(&tcode))[2] = ((uint8_t *)(&IrCode))[0];
-    ((uint8_t *)(&tcode))[3] = ~((uint8_t *)(&IrCode))[0];
+int TiqiaaUsbIr::WriteIrNecSignal(uint16_t IrCode, uint8_t * OutBuf) {
+    TiqiaaUsbIrTraceSpan Span("WriteIrNecSignal", "IrCode", IrCode);
+    const NecTables * Tables = GetNecTables();
+    const NecTables::ByteEntry * Entry;
+    uint8_t CodeBytes[4];
+    int Size, Remainder;
 
-    WriteIrNecSignalPulse(&WriteData, 16, true);
-    WriteIrNecSignalPulse(&WriteData, 8, false);
+    // address, inverted address, command, inverted command; sent LSB first
+    CodeBytes[0] = IrCode >> 8;
+    CodeBytes[1] = ~CodeBytes[0];
+    CodeBytes[2] = IrCode & 0xFF;
+    CodeBytes[3] = ~CodeBytes[2];
 
-    for( i=0; i<32;i++ ) {
-        WriteIrNecSignalPulse(&WriteData, 1, true);
-        WriteIrNecSignalPulse(&WriteData, ((tcode&1) != 0) ? 3 : 1, false);
-        tcode >>= 1;
+    memcpy(OutBuf, Tables->Header, Tables->HeaderSize);
+    Size = Tables->HeaderSize;
+    Remainder = Tables->HeaderRemainder;
+    for( int i = 0; i < 4; i++ ) {
+        Entry = &Tables->Bytes[Remainder][CodeBytes[i]];
+        memcpy(OutBuf + Size, Entry->Data, sizeof(Entry->Data));
+        Size += sizeof(Entry->Data);
+        Remainder = Entry->Remainder;
     }
-    WriteIrNecSignalPulse(&WriteData, 1, true);
-    WriteIrNecSignalPulse(&WriteData, 72, false);
-    return WriteData.Size;
+    memcpy(OutBuf + Size, Tables->Trailer[Remainder], Tables->TrailerSize[Remainder]);
+    return Size + Tables->TrailerSize[Remainder];
 }
 
+int TiqiaaUsbIr::WriteIrNecRepeat(uint8_t * OutBuf) {
+    TqIrWriteData IrWrData;
 
-void TiqiaaUsbIr::ProcessRecvPacket(uint8_t * pack, int size) {
-    if( IsWaitingCmdReply ) {
-        pthread_mutex_lock(&read_thread_info.mutex);
-        if( IsWaitingCmdReply && !IsCmdReplyReceived ) {
-            if( (pack[0] == WaitCmdId) && (pack[1] == WaitCmdType) ) {
-                IsCmdReplyReceived = true;
-                pthread_cond_signal(&read_thread_info.condition);
-            }
-        }
-        pthread_mutex_unlock(&read_thread_info.mutex);
-    }
+    IrWrData.Buf = OutBuf;
+    IrWrData.Size = 0;
+    IrWrData.PulseTime = 0;
+    IrWrData.SenderTime = 0;
+    TiqiaaNecFrame_WritePulse(&IrWrData, 16, true);
+    TiqiaaNecFrame_WritePulse(&IrWrData, 4, false);
+    TiqiaaNecFrame_WritePulse(&IrWrData, 1, true);
+    return IrWrData.Size;
+}
+
+
+void TiqiaaUsbIr::ProcessRecvPacket(uint8_t * pack, int size, uint8_t packetIdx) {
+    uint64_t RecvNs = TiqiaaUsbIr_NowNs();
+    TiqiaaUsbIrTraceSpan Span("ProcessRecvPacket", "CmdType", pack[1]);
+    uint8_t PrevState = DeviceState;
+
+    TIQIAA_PROBE5(packet_recv, pack[0], pack[1], (size > 2) ? pack[2] : 0, size, packetIdx);
+    // state must be updated before waiter is woken up
     switch( pack[1] ) {
         case CmdVersion:
             if( size == (sizeof(TiqiaaUsbIr_VersionPacket) + 2) ) {
@@ -338,12 +1460,82 @@ void TiqiaaUsbIr::ProcessRecvPacket(uint8_t * pack, int size) {
         case CmdOutput:
         case CmdCancel:
         case CmdUnknown:
-            DeviceState = pack[2];
+            if( size > 2 ) DeviceState = pack[2];
             break;
-        case CmdData:
+    }
+    if( DeviceState != PrevState ) TIQIAA_PROBE2(state_change, PrevState, DeviceState);
+
+    pthread_mutex_lock(&read_thread_info.mutex);
+    // captured, or canceled / mode changed by a command sent after receive was started
+    if( (pack[1] == CmdData) || ((pack[1] != CmdOutput) && ((int32_t)(CmdSeq[pack[0] & MaxCmdId] - CmdSeq[RecvCmdId & MaxCmdId]) > 0)) )
+        RecvArmed = false;
+    ReplyTable[pack[0] & MaxCmdId] = pack[1];
+    ReplyRecvNs[pack[0] & MaxCmdId] = RecvNs;
+    if( CmdSentType[pack[0] & MaxCmdId] ) { // first reply only, a receive start gets one per CmdData packet
+        int Idx = GetCmdIndex(CmdSentType[pack[0] & MaxCmdId]);
+        if( Idx >= 0 ) CmdLatency[Idx].RecordNs(CmdSentNs[pack[0] & MaxCmdId], RecvNs);
+        CmdSentType[pack[0] & MaxCmdId] = 0;
+    } else if( pack[1] != CmdData ) { // CmdData follows the first reply of a receive start
+        AddHealth(&Health.UnmatchedReplies);
+    }
+    if( (int32_t)(CmdSeq[pack[0] & MaxCmdId] - LastReplySeq) > 0 ) LastReplySeq = CmdSeq[pack[0] & MaxCmdId];
+    if( IsWaitingCmdReply && (pack[0] == WaitCmdId) && (pack[1] == WaitCmdType) ) IsCmdReplyReceived = true;
+    pthread_cond_broadcast(&read_thread_info.condition);
+    pthread_mutex_unlock(&read_thread_info.mutex);
+
+    if( pack[1] == CmdData ) {
+        if( CaptureIdleGap ) {
+            AppendCapture(pack + 2, size - 2);
+        } else {
             TiqiaaUsbIr_IrRecvCallback * RecvCallback = IrRecvCallback;
-            if( RecvCallback ) RecvCallback(pack + 2, size - 2, this, IrRecvCbContext);
-            break;
+            TiqiaaUsbIrTraceSpan CbSpan("IrRecvCallback", "Size", size - 2);
+            if( RecvCallback ) {
+                TIQIAA_PROBE1(callback_entry, size - 2);
+                RecvCallback(pack + 2, size - 2, this, IrRecvCbContext);
+                TIQIAA_PROBE1(callback_exit, size - 2);
+            }
+        }
+    }
+}
+
+// Read thread only
+void TiqiaaUsbIr::AppendCapture(const uint8_t * data, int size) {
+    uint32_t GapTicks = (uint32_t)CaptureIdleGap * 1000 / TiqiaaUsbIr_IrTickUs;
+
+    for( int i = 0; i < size; i++ ) {
+        if( data[i] & 0x80 ) {
+            CaptureSpaceTicks = 0;
+        } else {
+            if( CaptureSize == 0 ) continue; // idle before the signal
+            CaptureSpaceTicks += data[i];
+        }
+        if( CaptureSize >= TiqiaaUsbIr_MaxCaptureSize ) DeliverCapture();
+        CaptureBuf[CaptureSize++] = data[i];
+        if( CaptureSpaceTicks >= GapTicks ) DeliverCapture();
+    }
+    // device sends full packets while the signal goes on
+    if( size < TiqiaaUsbIr_MaxRecvDataSize ) {
+        if( CaptureSize ) DeliverCapture();
+        CaptureSpaceTicks = 0;
+        CaptureDeadlineNs = 0;
+    } else if( CaptureSize ) {
+        CaptureDeadlineNs = TiqiaaUsbIr_NowNs() + ((uint64_t)TiqiaaUsbIr_GetIrAirtime(data, size) + (uint64_t)CaptureIdleGap * 1000) * 1000;
+    }
+}
+
+// Read thread only
+void TiqiaaUsbIr::DeliverCapture() {
+    TiqiaaUsbIr_IrRecvCallback * RecvCallback = IrRecvCallback;
+    int Size = CaptureSize;
+
+    CaptureSize = 0;
+    CaptureSpaceTicks = 0;
+    CaptureDeadlineNs = 0;
+    if( RecvCallback && Size ) {
+        TiqiaaUsbIrTraceSpan Span("IrRecvCallback", "Size", Size);
+        TIQIAA_PROBE1(callback_entry, Size);
+        RecvCallback(CaptureBuf, Size, this, IrRecvCbContext);
+        TIQIAA_PROBE1(callback_exit, Size);
     }
 }
 
@@ -356,51 +1548,42 @@ void *TiqiaaUsbIr::RunReadThreadFn(void *pcls)
 }
 
 void TiqiaaUsbIr::ReadThreadFn() {
-    uint8_t FragmBuf[64];
-    uint8_t PackBuf[MaxUsbPacketSize];
-    int PackSize;
-    int FragmSize;
-    uint8_t PacketIdx;
-    uint8_t FragmCount;
-    uint8_t LastFragmIdx;
-    TiqiaaUsbIr_Report2Header * ReportHdr = (TiqiaaUsbIr_Report2Header *)FragmBuf;
+    uint8_t FragmBuf[TiqiaaUsbIr_MaxUsbReadSize];
+    TiqiaaUsbIr_Report2Header * FragmHdr = (TiqiaaUsbIr_Report2Header *)FragmBuf;
+    TiqiaaUsbIrReassembler Reasm(ReadReportId);
     int UsbRxSize;
+    int PushRes;
+    uint64_t now;
+    unsigned int Timeout;
 
-    FragmCount = 0; // not receiving packet
     while( ReadActive ) {
-        if( libusb_bulk_transfer(dev_h, ReadPipeId, FragmBuf, 64, &UsbRxSize, 0) < 0 )
-            continue;
-
-        if( !((UsbRxSize > sizeof(TiqiaaUsbIr_Report2Header)) && (ReportHdr->ReportId == ReadReportId) && ((uint32_t)(ReportHdr->FragmSize + 2) <= UsbRxSize)) )
-            continue;
-
-        if( FragmCount ) { // adding data to existing packet
-            if( (ReportHdr->PacketIdx == PacketIdx) && (ReportHdr->FragmCount == FragmCount) && (ReportHdr->FragmIdx == (LastFragmIdx + 1)) ) {
-                LastFragmIdx++;
-            } else { // wrong fragment - drop packet
-                FragmCount = 0;
+        Timeout = ReadPollTimeout;
+        if( CaptureDeadlineNs ) {
+            now = TiqiaaUsbIr_NowNs();
+            if( now >= CaptureDeadlineNs ) {
+                DeliverCapture();
+                continue;
             }
+            if( (CaptureDeadlineNs - now) / 1000000 < Timeout ) Timeout = (CaptureDeadlineNs - now) / 1000000 + 1;
         }
-        if( FragmCount == 0 ) { // new packet
-            if( (ReportHdr->FragmCount > 0) && (ReportHdr->FragmIdx == 1) ) {
-                PacketIdx = ReportHdr->PacketIdx;
-                FragmCount = ReportHdr->FragmCount;
-                PackSize = 0;
-                LastFragmIdx = 1;
-            }
-        }
-        if( FragmCount ) {
-            FragmSize = ReportHdr->FragmSize + 2 - sizeof(TiqiaaUsbIr_Report2Header);
-            if( (PackSize + FragmSize) <= MaxUsbPacketSize ) {
-                memcpy(PackBuf + PackSize, FragmBuf + sizeof(TiqiaaUsbIr_Report2Header), FragmSize);
-                PackSize += FragmSize;
-                if( (ReportHdr->FragmIdx == LastFragmIdx) && (PackSize > 6) ) {
-                    if( (*((uint16_t *)(PackBuf)) == PackStartSign) && (*((uint16_t *)(PackBuf + PackSize - 2)) == PackEndSign) ) {
-                        ProcessRecvPacket(PackBuf + 2, PackSize - 4);
-                    }
-                }
-            } else // buffer overflow - drop packet
-                FragmCount = 0;
+        UsbRxSize = UsbRead(FragmBuf, sizeof(FragmBuf), Timeout);
+        if( UsbRxSize <= 0 )
+            continue;
+
+        PushRes = Reasm.PushFragment(FragmBuf, UsbRxSize);
+        TIQIAA_PROBE5(fragm_recv, FragmHdr->PacketIdx, FragmHdr->FragmIdx, FragmHdr->FragmCount, UsbRxSize, PushRes);
+        switch( PushRes ) {
+            case TiqiaaUsbIrReassembler::PacketComplete:
+                AddHealth(&Health.FramesIn);
+                ProcessRecvPacket((uint8_t *)Reasm.GetPacketData(), Reasm.GetPacketSize(), FragmHdr->PacketIdx);
+                break;
+            case TiqiaaUsbIrReassembler::FragmBad: AddHealth(&Health.BadFragms); break;
+            case TiqiaaUsbIrReassembler::FragmWrongReport: AddHealth(&Health.WrongReportId); break;
+            case TiqiaaUsbIrReassembler::FragmOutOfOrder:
+            case TiqiaaUsbIrReassembler::FragmRestarted: AddHealth(&Health.OutOfOrder); break;
+            case TiqiaaUsbIrReassembler::FragmDuplicate: AddHealth(&Health.Duplicates); break;
+            case TiqiaaUsbIrReassembler::PacketOverflow: AddHealth(&Health.Overflows); break;
+            case TiqiaaUsbIrReassembler::PacketBadSign: AddHealth(&Health.BadSigns); break;
         }
     }
 }
@@ -21,44 +21,90 @@
 
 #include <libusb-1.0/libusb.h>
 
-#pragma pack(1)
-
-struct TiqiaaUsbIr_Report2Header{
-    uint8_t ReportId;
-    uint8_t FragmSize;
-    uint8_t PacketIdx;
-    uint8_t FragmCount;
-    uint8_t FragmIdx;
+#include "TiqiaaUsbProto.h"
+#include "TiqiaaReassembler.h"
+#include "TiqiaaPacketBuilder.h"
+#include "TiqiaaUsbTransport.h"
+#include "TiqiaaHistogram.h"
+#include "TiqiaaTrace.h"
+#include "TiqiaaPcap.h"
+#include "TiqiaaReplay.h"
+#include "TiqiaaNecFrame.h"
+
+//! One frame of SendIRBatch
+struct TiqiaaUsbIr_IrFrame{
+    const uint8_t * Data; //!< Tiqiaa signal data
+    int Size;
+    uint32_t Gap; //!< idle time after the frame, mksec
 };
 
-struct TiqiaaUsbIr_SendCmdPack{
-    uint16_t StartSign;
-    uint8_t CmdId;
-    uint8_t CmdType;
-    uint16_t EndSign;
+//! Per operation USB traffic, see TiqiaaUsbIr::GetOpStats
+struct TiqiaaUsbIr_OpStats{
+    uint32_t Count; //!< number of calls
+    uint32_t Packets; //!< packets sent to device
+    uint32_t RoundTrips; //!< serialized send/reply wait phases, pipelined packets count once
+    uint32_t ElidedSwitches; //!< mode switches skipped because device state was already known
+    uint32_t Probes; //!< state probes sent while waiting for a reply
+    uint32_t LostReplies; //!< replies detected as lost by a reply to a later command
+    uint32_t Retries; //!< commands sent again after a lost reply
 };
 
-struct TiqiaaUsbIr_SendIRPackHeader{
-    uint16_t StartSign;
-    uint8_t CmdId;
-    uint8_t CmdType;
-    uint8_t IrFreqId;
+//! Reply time estimator of one command type, see TiqiaaUsbIr::GetRttStats
+//! CmdOutput times exclude IR airtime, the wait timeout adds the airtime of the packet
+struct TiqiaaUsbIr_RttStats{
+    uint32_t Samples; //!< replies measured
+    uint32_t LastUs; //!< last measured reply time, mksec
+    uint32_t MaxUs; //!< longest measured reply time, mksec
+    uint32_t SrttUs; //!< smoothed reply time, mksec
+    uint32_t RttVarUs; //!< smoothed reply time deviation, mksec
+    uint32_t RtoUs; //!< current reply timeout, mksec
+    uint32_t Timeouts; //!< waits that expired
 };
 
-struct TiqiaaUsbIr_VersionPacket{
-    uint8_t VersionChar;
-    uint8_t VersionInt;
-    uint8_t VersionGuid[0x24];
-    uint8_t State;
+//! Open-loop transmit statistics, see TiqiaaUsbIr::GetIrScheduleStats
+struct TiqiaaUsbIr_IrScheduleStats{
+    uint32_t Packets; //!< IR packets sent without waiting for the previous reply
+    uint32_t Completed; //!< packets whose reply or a later reply arrived
+    uint32_t Failed; //!< packets without any reply before timeout
+    uint32_t Stalls; //!< sends delayed because MaxIrInFlight packets were not answered yet
+    uint32_t MaxInFlight; //!< most packets sent but not answered at once
+    uint64_t EndErrSumUs; //!< sum of |measured - predicted| playback end of answered packets
+    uint32_t EndErrMaxUs;
 };
 
-struct TqIrWriteData{
-    uint8_t * Buf;
-    int Size;
-    int PulseTime;
-    int SenderTime;
+//! Transceive statistics, see TiqiaaUsbIr::GetTransceiveStats
+struct TiqiaaUsbIr_TransceiveStats{
+    uint32_t Transmits; //!< queued signals sent
+    uint32_t Failed; //!< queued signals not sent and sent signals without completion reply
+    uint32_t Dropped; //!< QueueTransmit calls refused, queue full
+    uint32_t Rearms; //!< receive restarts after a capture
+    uint32_t BlindPeriods; //!< receive interruptions, queued signals sent back to back share one
+    uint64_t BlindSumUs; //!< time receive was off for transmits, from leaving Recv to receiving again
+    uint32_t BlindMaxUs; //!< longest receive interruption
 };
 
+//! Driver health counters, see TiqiaaUsbIr::GetHealthStats
+//! Every discarded fragment, packet or reply is counted once, by the first reason found
+struct TiqiaaUsbIr_HealthStats{
+    uint64_t ReadErrors; //!< failed USB reads, expired read timeouts are not counted
+    uint64_t WriteErrors; //!< failed USB fragment writes
+    uint64_t BadFragms; //!< received fragments too short or with wrong FragmSize
+    uint64_t WrongReportId; //!< received fragments with wrong ReportId
+    uint64_t OutOfOrder; //!< unexpected FragmIdx: fragments that do not start a packet and packets cut by a new one
+    uint64_t Duplicates; //!< repeated fragments, ignored
+    uint64_t Overflows; //!< packets larger than the packet buffer
+    uint64_t BadSigns; //!< packets without ST/EN signature
+    uint64_t UnmatchedReplies; //!< replies to a CmdId not sent or already answered
+    uint64_t WaitTimeouts; //!< reply waits that expired, probes included
+    uint64_t BytesIn; //!< received fragment bytes
+    uint64_t BytesOut; //!< written fragment bytes
+    uint64_t FramesIn; //!< complete packets received
+    uint64_t FramesOut; //!< complete packets written
+};
+
+//! Max size of a received signal joined from several CmdData packets
+static const int TiqiaaUsbIr_MaxCaptureSize = 16 * TiqiaaUsbIr_MaxRecvDataSize;
+
 typedef void TiqiaaUsbIr_IrRecvCallback(uint8_t * data, int size, class TiqiaaUsbIr * IrCls, void * context);
 
 // send tick = 16mks, freq = 36700 hz 36.64 meas
@@ -82,37 +128,45 @@ private:
     static const uint16_t DeviceVid2 = 0x45E;
     static const uint16_t DevicePid = 0x8468;
 
-    static const uint8_t CmdUnknown = 'H';
-    static const uint8_t CmdVersion = 'V';
-    static const uint8_t CmdIdleMode = 'L';
-    static const uint8_t CmdSendMode = 'S';
-    static const uint8_t CmdRecvMode = 'R';
-    static const uint8_t CmdData = 'D';
-    static const uint8_t CmdOutput = 'O';
-    static const uint8_t CmdCancel = 'C';
-
-    static const uint8_t StateIdle = 3;
-    static const uint8_t StateSend = 9;
-    static const uint8_t StateRecv = 19;
-
-    static const int MaxUsbFragmSize = 56;
-    static const int MaxUsbPacketSize = 1024;
+    static const uint8_t CmdUnknown = TiqiaaUsbIr_CmdUnknown;
+    static const uint8_t CmdVersion = TiqiaaUsbIr_CmdVersion;
+    static const uint8_t CmdIdleMode = TiqiaaUsbIr_CmdIdleMode;
+    static const uint8_t CmdSendMode = TiqiaaUsbIr_CmdSendMode;
+    static const uint8_t CmdRecvMode = TiqiaaUsbIr_CmdRecvMode;
+    static const uint8_t CmdData = TiqiaaUsbIr_CmdData;
+    static const uint8_t CmdOutput = TiqiaaUsbIr_CmdOutput;
+    static const uint8_t CmdCancel = TiqiaaUsbIr_CmdCancel;
+
+    static const uint8_t StateIdle = TiqiaaUsbIr_StateIdle;
+    static const uint8_t StateSend = TiqiaaUsbIr_StateSend;
+    static const uint8_t StateRecv = TiqiaaUsbIr_StateRecv;
+
+    static const int MaxUsbFragmSize = TiqiaaUsbIrPacketBuilder::MaxFragmSize;
+    static const int MaxUsbPacketSize = TiqiaaUsbIr_MaxUsbPacketSize;
     static const int MaxUsbPacketIndex = 15;
-    static const int MaxCmdId = 0x7F;
-    static const uint16_t PackStartSign = 0x5453; // "ST"
-    static const uint16_t PackEndSign = 0x4e45; // "EN"
+    static const int MaxCmdId = TiqiaaUsbIr_MaxCmdId;
+    static const uint16_t PackStartSign = TiqiaaUsbIr_PackStartSign;
+    static const uint16_t PackEndSign = TiqiaaUsbIr_PackEndSign;
     static const uint8_t WritePipeId = 1;
     static const uint8_t ReadPipeId = 0x81;
-    static const uint8_t WriteReportId = 2;
-    static const uint8_t ReadReportId = 1;
+    static const uint8_t WriteReportId = TiqiaaUsbIr_WriteReportId;
+    static const uint8_t ReadReportId = TiqiaaUsbIr_ReadReportId;
     static const uint16_t CmdReplyWaitTimeout = 500;
     static const uint16_t IrReplyWaitTimeout = 2000;
+    static const unsigned int ReadPollTimeout = 100;
 
-    static const int NecPulseSize = 1125; //562.5 mks
-    static const int IrSendTickSize = 32; //16 mks
-    static const int MaxIrSendBlockSize = 127; //ticks
+    static const int IrSendTickSize = TiqiaaNecFrame_IrSendTickSize;
+    static const int MaxIrSendBlockSize = TiqiaaNecFrame_MaxIrSendBlockSize;
+    static const int MaxBatchSegments = 64;
+    static const uint32_t NecFramePeriod = 108000; // mksec, start of a frame to start of the next
+    static const uint32_t RtoClockUs = 1000; // min margin over smoothed reply time
+    static const uint32_t UnknownAirtime = 0xFFFFFFFF; // WaitReply: fixed timeout, not measured
 
+    libusb_context *UsbCtx; // own context, several devices can be open at once
     libusb_device_handle *dev_h;
+    TiqiaaUsbTransport * Transport;
+    uint16_t UsbBusNum; // address of the device in captures
+    uint8_t UsbDevAddr;
     struct thread_info_t read_thread_info;
     bool ReadActive;
     uint8_t DeviceState;
@@ -123,20 +177,156 @@ private:
     bool IsCmdReplyReceived;
     uint8_t WaitCmdId;
     uint8_t WaitCmdType;
+    uint8_t ReplyTable[MaxCmdId + 1]; // CmdType of received reply for every CmdId, 0 - none
+    uint32_t CmdSeq[MaxCmdId + 1]; // issue order of every CmdId
+    uint32_t CmdSeqCounter;
+    uint32_t LastReplySeq; // newest command that got a reply
+    uint64_t CmdSentNs[MaxCmdId + 1]; // time the last fragment of every CmdId was written
+    uint64_t ReplyRecvNs[MaxCmdId + 1]; // time the reply to every CmdId was received
+    bool CmdRttValid[MaxCmdId + 1]; // CmdId was sent to an idle device, its reply time can be measured
+    uint8_t CmdSentType[MaxCmdId + 1]; // CmdType sent with every CmdId until its first reply, 0 - none
+
+    TiqiaaUsbIrPacketBuilder IrPack;
+    uint8_t PipeCmdId; // last queued IR packet, 0 - none
+    uint32_t PipeAirtime;
+
+    // IR packets sent by open-loop SendIR, oldest first
+    struct IrFlight {
+        uint8_t CmdId;
+        uint32_t Airtime;
+        uint64_t EndNs; // predicted playback end
+    };
+    static const int MaxIrInFlight = 8;
+    IrFlight IrFlights[MaxIrInFlight];
+    int IrFlightHead;
+    int IrFlightCount;
+    bool IrFlightFailed; // a packet failed since last FlushIR
+    TiqiaaUsbIr_IrScheduleStats IrSchedStats;
+
+    // IR data packet being filled by SendIRBatch / SendNecHold
+    struct IrBatch {
+        TiqiaaUsbIr_IrSegment Segs[MaxBatchSegments];
+        uint8_t GapTail[MaxBatchSegments];
+        int SegCount;
+        int PackSize;
+        uint32_t Airtime;
+    };
+
+    // signals queued by QueueTransmit
+    struct TxSlot {
+        int Freq;
+        int Size;
+        uint8_t Data[TiqiaaUsbIrPacketBuilder::MaxIrDataSize];
+    };
+    static const int MaxTxQueue = 8;
+    TxSlot TxQueue[MaxTxQueue];
+    int TxHead;
+    int TxCount;
+    bool TransceiveActive;
+    pthread_t TransceiveThread;
+    TiqiaaUsbIr_TransceiveStats TrxStats;
+
+    // CmdData packets of one signal, joined by the read thread
+    uint8_t CaptureBuf[TiqiaaUsbIr_MaxCaptureSize];
+    int CaptureSize;
+    uint32_t CaptureSpaceTicks; // length of space at the end of CaptureBuf
+    uint64_t CaptureDeadlineNs; // deliver if no more data until then, 0 - none
+
+    bool RecvArmed; // CmdOutput sent in Recv mode, no CmdData yet
+    uint8_t RecvCmdId; // CmdOutput that started receiving
+    uint8_t ModeCmdId; // mode switch sent but not confirmed, 0 - none
+    uint8_t ModeCmdType;
+    uint8_t ModeState;
+    uint64_t ModeSentNs;
 
 public:
+    //! Operations of GetOpStats
+    static const int OpOpen = 0;
+    static const int OpClose = 1;
+    static const int OpSendIR = 2;
+    static const int OpSendIRStream = 3;
+    static const int OpSendIRBatch = 4;
+    static const int OpStartRecvIR = 5;
+    static const int OpSetIdleMode = 6;
+    static const int OpTransceive = 7; //!< signals sent by the transceive thread
+    static const int OpOther = 8; //!< SendCmd etc. called directly, e.g. from IrRecvCallback
+    static const int OpCount = 9;
+
     //! Callback function for received IR signal
     TiqiaaUsbIr_IrRecvCallback * IrRecvCallback;
 
     //! Pointer to any user data that will be passed to IrRecvCallback
     void * IrRecvCbContext;
 
+    //! Opened capture that records every USB fragment, NULL - none (default)
+    //! Can be shared by several devices, they are told apart by bus and device number
+    TiqiaaUsbIrPcap * Pcap;
+
+    //! Opened recorder that writes the USB session for TiqiaaUsbIrReplay, NULL - none (default)
+    TiqiaaUsbIrRecorder * Recorder;
+
+    //! Receive: space that ends a signal, msec, default 20, 0 - every CmdData packet is passed to IrRecvCallback as is
+    //! CmdData packets are joined into one signal of up to TiqiaaUsbIr_MaxCaptureSize bytes; the signal is
+    //! passed to IrRecvCallback once, when a space this long or a not full packet ends it, or when no more
+    //! data arrives in time after a full packet. Spaces at the start of a signal are dropped
+    uint16_t CaptureIdleGap;
+
+    //! SendIRStream, SendIRBatch: send next packet while the current one plays, default true
+    bool IrStreamPipeline;
+
+    //! SendIR: return as soon as the packet is sent, default false
+    //! The next packet is sent IrScheduleLead before the current one is predicted to end,
+    //! predictions come from IR airtime and are corrected by the replies as they arrive;
+    //! replies are checked by later calls, FlushIR waits for all of them
+    bool IrOpenLoop;
+
+    //! Open-loop SendIR: send the next packet this long before the current one ends, mksec, default 5000
+    //! Must cover USB write and device latency, at most one packet waits behind the playing one
+    uint32_t IrScheduleLead;
+
+    //! Derive reply timeouts from measured reply times, default true
+    //! false - fixed timeouts: CmdReplyWaitTimeout, IrReplyWaitTimeout + airtime
+    bool AdaptiveTimeouts;
+
+    //! Bounds of adaptive reply timeout, msec, default 5..500
+    //! CmdOutput timeout is bounded without the airtime of the packet
+    uint16_t MinCmdTimeout;
+    uint16_t MaxCmdTimeout;
+
+    //! Max number of probes per wait and of command resends after a lost reply, default 3
+    //! A state probe is sent when no reply arrived in time, device handles commands in order,
+    //! so a reply to the probe means the awaited reply was lost. The wait time doubles after
+    //! every probe, without probes the wait ends after the first timeout
+    int MaxCmdRetries;
+
+    //! Number of USB fragments kept by the flight recorder per direction
+    static const int MaxFlightRecords = 64;
+
+    //! File descriptor the flight recorder is dumped to when a reply wait times out,
+    //! default 2 (stderr), -1 - never
+    int FlightDumpFd;
+
+    //! Close: switch device to Idle mode, default true
+    //! Skipped when the device is Idle already, Close does not wait for the reply
+    //! Open resets the device, so the switch can be skipped when the device will be reopened
+    bool IdleOnClose;
+
     //! Convert NEC IR code to Tiqiaa signal data
     //! IrCode: Input code
     //! OutBuf: Buffer for signal data, >= 93 bytes
     //! Return: size of signal data
     static int WriteIrNecSignal(uint16_t IrCode, uint8_t * OutBuf);
 
+    //! Write NEC repeat frame: 9 ms mark, 2.25 ms space, 562.5 mks mark
+    //! OutBuf: Buffer for signal data, >= 16 bytes
+    //! Return: size of signal data
+    static int WriteIrNecRepeat(uint8_t * OutBuf);
+
+    //! Get carrier freq ID
+    //! freq: 0..255 - direct freq ID, one of TiqiaaUsbIr_IrFreqTable values - freq in HZ
+    //! Return: index of TiqiaaUsbIr_IrFreqTable, -1 - unknown freq
+    static int GetIrFreqId(int freq);
+
     TiqiaaUsbIr();
     virtual ~TiqiaaUsbIr();
 
@@ -146,8 +336,22 @@ public:
 
     //! Open device
     //! Return: true - success, false - fail
+    //! Note: Device mode is not changed, SendIR and StartRecvIR switch it when needed
     bool Open();
 
+    //! Open one of several connected devices
+    //! index: 0..GetDeviceCount()-1, in libusb enumeration order
+    //! Return: true - success, false - fail
+    bool Open(int index);
+
+    //! Return: number of connected devices, -1 - libusb error
+    static int GetDeviceCount();
+
+    //! Open device using transport instead of libusb
+    //! transport: opened by this function, closed by Close()
+    //! Return: true - success, false - fail
+    bool Open(TiqiaaUsbTransport * transport);
+
     //! Close device
     //! Return: true - success, false - fail
     bool Close();
@@ -170,6 +374,15 @@ public:
     //! Note: This function will not check device mode
     bool SendIRCmd(int freq, void * buffer, int buf_size, uint8_t cmdId);
 
+    //! Send IR data given as segments to device and return immideately
+    //! freq: Carrier freq, see SendIRCmd
+    //! segs: IR signal data segments, sent as if joined in order
+    //! segCount: number of segments
+    //! cmdId: Command ID, can be obtained by GetCmdId()
+    //! Return: true - success, false - fail
+    //! Note: Segment data is copied once, directly into the USB fragments
+    bool SendIRCmd(int freq, const TiqiaaUsbIr_IrSegment * segs, int segCount, uint8_t cmdId);
+
     //! Send command to device and wait for completion
     //! cmdType: Command type, one of Cmd* constant
     //! cmdId: Command ID, can be obtained by GetCmdId()
@@ -205,9 +418,18 @@ public:
     //! buffer: IR signal data
     //! buf_size: size of buffer
     //! Return: true - success, false - fail
-    //! Note: This function will switch device to Send mode
+    //! Note: This function will switch device to Send mode;
+    //! With IrOpenLoop it returns once the packet is sent, see FlushIR
     bool SendIR(int freq, void * buffer, int buf_size);
 
+    //! Send IR data given as segments to device and wait for completion
+    //! freq: Carrier freq, see SendIR
+    //! segs: IR signal data segments, e.g. header, body and repeat tail
+    //! segCount: number of segments
+    //! Return: true - success, false - fail
+    //! Note: This function will switch device to Send mode
+    bool SendIR(int freq, const TiqiaaUsbIr_IrSegment * segs, int segCount);
+
     //! Start receiving of IR signal
     //! Return: true - success, false - fail
     //! Note: This function will switch device to Recv mode;
@@ -217,19 +439,220 @@ public:
     //! Receive can be aborted by calling SetIdleMode, SendIR, SendNecSignal, SendCmd(CmdCancel)
     bool StartRecvIR();
 
+    //! Send IR data of any size to device and wait for completion
+    //! freq: Carrier freq, see SendIR
+    //! buffer: IR signal data
+    //! buf_size: size of buffer
+    //! Return: true - success, false - fail
+    //! Note: This function will switch device to Send mode;
+    //! Signal is split into consecutive IR data packets, with IrStreamPipeline the next
+    //! packet is sent while the previous one plays
+    bool SendIRStream(int freq, void * buffer, int buf_size);
+
+    //! Send several IR frames back to back and wait for completion
+    //! freq: Carrier freq, see SendIR
+    //! frames: frames to send, Gap of every frame except the last is sent as idle ticks
+    //! frameCount: number of frames
+    //! Return: true - success, false - fail
+    //! Note: This function will switch device to Send mode;
+    //! Frames are packed into as few IR data packets as possible; a frame is never split
+    //! between packets, a gap may be. Gap of the last frame is not sent
+    bool SendIRBatch(int freq, const TiqiaaUsbIr_IrFrame * frames, int frameCount);
+
+    //! Wait until all packets sent by open-loop SendIR are played
+    //! Return: true - all packets since last FlushIR were played, false - a packet got no reply
+    //! Note: Any other operation that changes device mode or waits for IR completion flushes first
+    bool FlushIR();
+
+    //! Get open-loop transmit statistics since open or ResetIrScheduleStats()
+    void GetIrScheduleStats(TiqiaaUsbIr_IrScheduleStats * stats);
+
+    //! Reset open-loop transmit statistics
+    void ResetIrScheduleStats();
+
+    //! Start transceive mode: device receives whenever no signal is queued for transmit
+    //! Return: true - success, false - fail
+    //! Note: A worker thread sends queued signals back to back and restarts receiving after
+    //! them and after every capture; IrRecvCallback is called for every capture.
+    //! Until StopTransceive only QueueTransmit and statistics functions may be called
+    bool StartTransceive();
+
+    //! Stop transceive mode after all queued signals are sent, device stays in Recv mode
+    //! Return: true - success, false - transceive mode was not started
+    bool StopTransceive();
+
+    //! Queue IR signal for transmit in transceive mode and return immideately
+    //! freq: Carrier freq, see SendIR
+    //! buffer: IR signal data, copied
+    //! buf_size: size of buffer, up to one IR data packet
+    //! Return: true - queued, false - not in transceive mode, signal too large or queue full
+    //! Note: Can be called from IrRecvCallback
+    bool QueueTransmit(int freq, const void * buffer, int buf_size);
+
+    //! Get transceive statistics since open or ResetTransceiveStats()
+    void GetTransceiveStats(TiqiaaUsbIr_TransceiveStats * stats);
+
+    //! Reset transceive statistics
+    void ResetTransceiveStats();
+
     //! Send NEC IR code signal and wait for completion
     //! IrCode: NEC IR code
     //! Return: true - success, false - fail
     //! Note: This function will switch device to Send mode
     bool SendNecSignal(uint16_t IrCode);
 
+    //! Send NEC IR code signal encoded at compile time and wait for completion
+    //! IrCode: NEC IR code
+    //! Return: true - success, false - fail
+    //! Note: This function will switch device to Send mode
+    template<uint16_t IrCode> bool SendNecSignal() {
+        TiqiaaUsbIr_IrSegment Seg = {TiqiaaNecFrame<IrCode>::Data, TiqiaaNecFrame<IrCode>::Size};
+        return SendIR(38000, &Seg, 1);
+    }
+
+    //! Send NEC IR code as a held button and wait for completion
+    //! IrCode: NEC IR code
+    //! holdMs: time the button is held, ms; one full frame, then a repeat frame every 108 ms
+    //!         while held, at least the full frame is sent
+    //! Return: true - success, false - fail
+    //! Note: This function will switch device to Send mode;
+    //! Frames are packed into as few IR data packets as possible, see SendIRBatch
+    bool SendNecHold(uint16_t IrCode, uint32_t holdMs);
+
+    //! Get USB traffic statistics
+    //! op: one of Op* constants
+    //! stats: statistics since open or ResetOpStats()
+    void GetOpStats(int op, TiqiaaUsbIr_OpStats * stats);
+
+    //! Reset USB traffic statistics
+    void ResetOpStats();
+
+    //! Return: name of Op* constant
+    static const char * GetOpName(int op);
+
+    //! Get reply time estimator state
+    //! cmdType: Command type, one of Cmd* constant, IR data replies are CmdOutput
+    //! stats: estimator state since open or ResetRttStats()
+    //! Return: true - success, false - unknown command type
+    bool GetRttStats(uint8_t cmdType, TiqiaaUsbIr_RttStats * stats);
+
+    //! Reset reply time estimators, timeouts start from MaxCmdTimeout again
+    void ResetRttStats();
+
+    //! Get reply latency histogram of one command type, from the last USB fragment of a command to its first reply
+    //! cmdType: Command type, one of Cmd* constant; CmdData - IR packets, airtime included;
+    //! CmdOutput in Recv mode - until the signal is captured or receiving is canceled
+    //! Return: histogram since open or ResetLatency(), NULL - unknown command type
+    const TiqiaaUsbIrHistogram * GetCmdLatency(uint8_t cmdType);
+
+    //! Return: histogram of single USB fragment writes
+    const TiqiaaUsbIrHistogram * GetFragmWriteLatency();
+
+    //! Return: histogram of reply waits of driver operations, probes included
+    const TiqiaaUsbIrHistogram * GetReplyWaitLatency();
+
+    //! Return: histogram of mode switches, from sending the mode command to its confirmation
+    const TiqiaaUsbIrHistogram * GetModeSwitchLatency();
+
+    //! Reset all latency histograms
+    void ResetLatency();
+
+    //! Get driver health counters
+    //! stats: counters since open or ResetHealthStats(), each counter is read atomically
+    void GetHealthStats(TiqiaaUsbIr_HealthStats * stats);
+
+    //! Reset driver health counters
+    void ResetHealthStats();
+
+    //! Write the last MaxFlightRecords USB fragments of each direction to fd, oldest first
+    //! Note: async-signal-safe, fragments recorded meanwhile may be skipped
+    void DumpFlightRecorder(int fd);
+
+    //! Dump flight recorders of all open devices when a signal arrives
+    //! signum: signal number, e.g. SIGUSR1
+    //! fd: file descriptor to write to
+    //! Return: true - handler installed, false - fail
+    static bool SetFlightDumpSignal(int signum, int fd);
+
 private:
-    static void *RunReadThreadFn(void *pcls);
-    static void WriteIrNecSignalPulse(TqIrWriteData * IrWrData, int PulseCount, bool isSet);
+    static const int WaitReplyOk = 0;
+    static const int WaitReplyLost = 1;
+    static const int WaitReplyTimeout = 2;
+
+    int CurOp;
+    bool RoundTripOpen;
+    TiqiaaUsbIr_OpStats OpStats[OpCount];
+
+    static const int CmdTypeCount = 8;
+    static const int RttLinkIdx = CmdTypeCount; // all command types, used until a type has own samples
+    TiqiaaUsbIr_RttStats RttStats[CmdTypeCount + 1];
+
+    // recorded from any thread without locking
+    TiqiaaUsbIrHistogram CmdLatency[CmdTypeCount];
+    TiqiaaUsbIrHistogram FragmWriteLatency;
+    TiqiaaUsbIrHistogram ReplyWaitLatency;
+    TiqiaaUsbIrHistogram ModeSwitchLatency;
+
+    TiqiaaUsbIr_HealthStats Health; // updated with atomic adds from any thread
+
+    // last USB fragments of each direction, slots are claimed with an atomic add and published by Seq
+    static const int FlightDataSize = 16;
+    struct FlightRecord {
+        uint32_t Seq; // number of the record + 1, 0 - being written
+        bool Ok;
+        uint8_t Size;
+        uint64_t TimeNs;
+        uint8_t Data[FlightDataSize]; // first bytes of the fragment
+    };
+    FlightRecord FlightRecs[2][MaxFlightRecords]; // 0 - written, 1 - read
+    uint32_t FlightSeq[2];
+
+    // Accounts all traffic of the outermost public call to one Op*
+    class OpScope {
+    public:
+        OpScope(TiqiaaUsbIr * ir, int op);
+        ~OpScope();
+    private:
+        TiqiaaUsbIr * Ir;
+        int PrevOp;
+        uint64_t StartNs; // traced outermost call, 0 - none
+    };
 
+    static void *RunReadThreadFn(void *pcls);
+    static void *RunTransceiveThreadFn(void *pcls);
+    struct NecTables;
+    static bool BuildNecTables(NecTables * tables);
+    static const NecTables * GetNecTables();
+
+    static libusb_device_handle * OpenUsbDevice(libusb_context * ctx, int index);
+    void RecordFlight(int dir, const uint8_t * data, int size, bool ok);
+    bool StartDevice();
+    bool UsbWrite(uint8_t * data, int size);
+    int UsbRead(uint8_t * data, int size, unsigned int timeout);
     bool SendReport2(void * data, int size);
-    void ProcessRecvPacket(uint8_t * data, int size);
+    bool SendReport2(TiqiaaUsbIrPacketBuilder * Pack, uint8_t cmdType, uint8_t cmdId);
+    bool SetSendMode();
+    bool RequestMode(uint8_t cmdType, uint8_t state);
+    bool CompleteModeSwitch();
+    bool QueueIRPacket(int freq, const TiqiaaUsbIr_IrSegment * segs, int segCount, uint32_t airtime);
+    bool FlushIRPackets();
+    bool AddBatchFrame(IrBatch * batch, int freq, const uint8_t * data, int size);
+    bool AddBatchGap(IrBatch * batch, int freq, uint32_t gap);
+    bool QueueBatch(IrBatch * batch, int freq);
+    bool ScheduleIRPacket(int freq, const TiqiaaUsbIr_IrSegment * segs, int segCount);
+    void ReconcileIRFlights(bool wait);
+    void ClearCmdReply(uint8_t cmdId);
+    static int GetCmdIndex(uint8_t cmdType);
+    uint32_t GetReplyTimeout(uint8_t cmdType, uint32_t airtime, uint32_t maxTimeout);
+    void UpdateRtt(uint8_t cmdType, uint8_t cmdId, uint32_t airtime);
+    int WaitReply(uint8_t cmdType, uint8_t cmdId, uint32_t airtime, uint32_t maxTimeout);
+    bool WaitIrReply(uint8_t cmdId, uint32_t airtime);
+    void ProcessRecvPacket(uint8_t * data, int size, uint8_t packetIdx);
     void ReadThreadFn();
+    void AppendCapture(const uint8_t * data, int size);
+    void DeliverCapture();
+    void TransceiveThreadFn();
+    void SendTxQueue();
 };
 
 #endif
@@ -0,0 +1,80 @@
+/*
+ * Userspace driver for Tiqiaa Tview USB IR Transeiver
+ *
+ * Copyright (c) Xen xen-re[at]tutanota.com
+ *
+ * Wire format shared by the driver and the transport-independent helpers
+ */
+
+#ifndef TIQIAA_USB_PROTO_H
+#define TIQIAA_USB_PROTO_H
+
+#include <stdint.h>
+
+#pragma pack(push, 1)
+
+struct TiqiaaUsbIr_Report2Header{
+    uint8_t ReportId;
+    uint8_t FragmSize;
+    uint8_t PacketIdx;
+    uint8_t FragmCount;
+    uint8_t FragmIdx;
+};
+
+struct TiqiaaUsbIr_SendCmdPack{
+    uint16_t StartSign;
+    uint8_t CmdId;
+    uint8_t CmdType;
+    uint16_t EndSign;
+};
+
+struct TiqiaaUsbIr_SendIRPackHeader{
+    uint16_t StartSign;
+    uint8_t CmdId;
+    uint8_t CmdType;
+    uint8_t IrFreqId;
+};
+
+struct TiqiaaUsbIr_VersionPacket{
+    uint8_t VersionChar;
+    uint8_t VersionInt;
+    uint8_t VersionGuid[0x24];
+    uint8_t State;
+};
+
+#pragma pack(pop)
+
+static const int TiqiaaUsbIr_MaxUsbPacketSize = 1024;
+static const int TiqiaaUsbIr_MaxUsbReadSize = 64;
+static const uint16_t TiqiaaUsbIr_PackStartSign = 0x5453; // "ST"
+static const uint16_t TiqiaaUsbIr_PackEndSign = 0x4e45; // "EN"
+static const uint8_t TiqiaaUsbIr_WriteReportId = 2;
+static const uint8_t TiqiaaUsbIr_ReadReportId = 1;
+static const int TiqiaaUsbIr_MaxCmdId = 0x7F;
+// CmdData payload of a full packet: StartSign, CmdId, CmdType, EndSign are not counted
+static const int TiqiaaUsbIr_MaxRecvDataSize = TiqiaaUsbIr_MaxUsbPacketSize - 6;
+
+static const uint8_t TiqiaaUsbIr_CmdUnknown = 'H';
+static const uint8_t TiqiaaUsbIr_CmdVersion = 'V';
+static const uint8_t TiqiaaUsbIr_CmdIdleMode = 'L';
+static const uint8_t TiqiaaUsbIr_CmdSendMode = 'S';
+static const uint8_t TiqiaaUsbIr_CmdRecvMode = 'R';
+static const uint8_t TiqiaaUsbIr_CmdData = 'D';
+static const uint8_t TiqiaaUsbIr_CmdOutput = 'O';
+static const uint8_t TiqiaaUsbIr_CmdCancel = 'C';
+
+static const uint8_t TiqiaaUsbIr_StateIdle = 3;
+static const uint8_t TiqiaaUsbIr_StateSend = 9;
+static const uint8_t TiqiaaUsbIr_StateRecv = 19;
+
+// IR signal data: one byte per block, bit 7 - carrier on, bits 0..6 - length in 16 mks ticks
+static const int TiqiaaUsbIr_IrTickUs = 16;
+
+//! Return: airtime of IR signal data, mksec
+static inline uint32_t TiqiaaUsbIr_GetIrAirtime(const uint8_t * data, int size) {
+    uint32_t Ticks = 0;
+    for( int i = 0; i < size; i++ ) Ticks += data[i] & 0x7F;
+    return Ticks * TiqiaaUsbIr_IrTickUs;
+}
+
+#endif
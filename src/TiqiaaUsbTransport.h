@@ -0,0 +1,43 @@
+/*
+ * Userspace driver for Tiqiaa Tview USB IR Transeiver
+ *
+ * Copyright (c) Xen xen-re[at]tutanota.com
+ *
+ * Fragment transport used instead of libusb, e.g. an emulated device:
+ *
+ * TiqiaaUsbIrEmulator Emu;
+ * TiqiaaUsbIr Ir;
+ * Ir.Open(&Emu);
+ */
+
+#ifndef TIQIAA_USB_TRANSPORT_H
+#define TIQIAA_USB_TRANSPORT_H
+
+#include <stdint.h>
+
+class TiqiaaUsbTransport {
+public:
+    virtual ~TiqiaaUsbTransport() {}
+
+    //! Open transport
+    //! Return: true - success, false - fail
+    virtual bool Open() = 0;
+
+    //! Close transport
+    virtual void Close() = 0;
+
+    //! Write one fragment to the write pipe
+    //! data: fragment data, starting with TiqiaaUsbIr_Report2Header
+    //! size: size of fragment
+    //! Return: true - success, false - fail
+    virtual bool Write(const uint8_t * data, int size) = 0;
+
+    //! Read one fragment from the read pipe
+    //! data: buffer for fragment
+    //! size: size of buffer
+    //! timeout: msec, 0 - infinite
+    //! Return: number of bytes read, 0 - timeout expired, < 0 - fail
+    virtual int Read(uint8_t * data, int size, unsigned int timeout) = 0;
+};
+
+#endif
@@ -19,12 +19,12 @@ CTqIrSignal::CTqIrSignal()
     DrawYscale /= 1000 * UnitsInMksec;
 }
 
-bool CTqIrSignal::FromTiqiaa(std::vector<uint8_t> signal)
+bool CTqIrSignal::FromTiqiaa(const std::vector<uint8_t> & signal)
 {
     return FromTiqiaa(signal.data(), signal.size());
 }
 
-bool CTqIrSignal::FromTiqiaa(uint8_t * data, size_t size)
+bool CTqIrSignal::FromTiqiaa(const uint8_t * data, size_t size)
 {
     uint32_t PulseSize;
     bool CurrLvl, NewLvl;
@@ -51,7 +51,14 @@ bool CTqIrSignal::FromTiqiaa(uint8_t * data, size_t size)
 
 std::vector<uint8_t> CTqIrSignal::ToTiqiaa()
 {
-    std::vector<uint8_t> res;
+    std::vector<uint8_t> res(ToTiqiaa(NULL, 0));
+    ToTiqiaa(res.data(), res.size());
+    return res;
+}
+
+size_t CTqIrSignal::ToTiqiaa(uint8_t * buf, size_t size)
+{
+    size_t res = 0;
     int32_t SrcPos = 0;
     int32_t DstPos = 0;
     uint32_t Ps;
@@ -68,18 +75,19 @@ std::vector<uint8_t> CTqIrSignal::ToTiqiaa()
         while (Ps > 0)
         {
             if (Ps > TiqiaaPulseMask){
-                res.push_back(TiqiaaPulseMask | Pb);
+                if (res < size) buf[res] = TiqiaaPulseMask | Pb;
                 Ps -= TiqiaaPulseMask;
             } else {
-                res.push_back(Ps | Pb);
+                if (res < size) buf[res] = Ps | Pb;
                 Ps = 0;
             }
+            res++;
         }
     }
     return res;
 }
 
-bool CTqIrSignal::FromLirc(uint32_t * data, size_t size)
+bool CTqIrSignal::FromLirc(const uint32_t * data, size_t size)
 {
     uint32_t PulseSize;
     bool CurrLvl, NewLvl;
@@ -104,7 +112,7 @@ bool CTqIrSignal::FromLirc(uint32_t * data, size_t size)
     return true;
 }
 
-bool CTqIrSignal::FromLirc(std::vector<uint32_t> signal)
+bool CTqIrSignal::FromLirc(const std::vector<uint32_t> & signal)
 {
     return FromLirc(signal.data(), signal.size());
 }
@@ -144,8 +152,8 @@ bool CTqIrSignal::SignalInRange(uint32_t value, uint32_t needSize, bool needHigh
 }
 
 bool CTqIrSignal::DecodeIrNecSignal(uint16_t * IrCode, uint32_t * RawIrCode){
-    uint32_t CodeRaw, CodeBit;
-    size_t CodeStartOffs;
+    uint32_t CodeRaw = 0, CodeBit = 0;
+    size_t CodeStartOffs = 0;
     int state = 0;
 
     for (size_t i=0; i< SignalData.size(); i++)
@@ -205,23 +213,29 @@ bool CTqIrSignal::DecodeIrNecSignal(uint16_t * IrCode, uint32_t * RawIrCode){
     return false;
 }
 
-std::vector<uint32_t> CTqIrSignal::GetSignal()
+const std::vector<uint32_t> & CTqIrSignal::GetSignal() const
 {
     return SignalData;
 }
 
 std::vector<uint32_t> CTqIrSignal::ToLirc()
 {
-    std::vector<uint32_t> res = SignalData;
-    for (size_t i = 0; i< res.size(); i++)
+    std::vector<uint32_t> res(SignalData.size());
+    ToLirc(res.data(), res.size());
+    return res;
+}
+
+size_t CTqIrSignal::ToLirc(uint32_t * buf, size_t size)
+{
+    for (size_t i = 0; (i < size) && (i < SignalData.size()); i++)
     {
-        uint32_t v = res[i];
+        uint32_t v = SignalData[i];
         bool h = ((v & PulseBit) != 0);
         v &= PulseMask;
         v /= UnitsInMksec;
         if (v > PULSE_MASK) v = PULSE_MASK;
         if (h) v |= PULSE_BIT;
-        res[i] = v;
+        buf[i] = v;
     }
-    return res;
+    return SignalData.size();
 }
@@ -7,6 +7,7 @@
 #ifndef CTQIRSIGNAL_H
 #define CTQIRSIGNAL_H
 
+#include <stddef.h>
 #include <stdint.h>
 #include <vector>
 
@@ -37,15 +38,19 @@ private:
 public:
     CTqIrSignal();
 
-    bool FromTiqiaa(std::vector<uint8_t> sample);
-    bool FromTiqiaa(uint8_t * data, size_t size);
+    bool FromTiqiaa(const std::vector<uint8_t> & sample);
+    bool FromTiqiaa(const uint8_t * data, size_t size);
     std::vector<uint8_t> ToTiqiaa();
-    bool FromLirc(uint32_t * data, size_t size);
-    bool FromLirc(std::vector<uint32_t> signal);
+    // Writes up to size bytes, returns the full size of the signal; no allocation
+    size_t ToTiqiaa(uint8_t * buf, size_t size);
+    bool FromLirc(const uint32_t * data, size_t size);
+    bool FromLirc(const std::vector<uint32_t> & signal);
     std::vector<uint32_t> ToLirc();
+    // Writes up to size values, returns the full size of the signal; no allocation
+    size_t ToLirc(uint32_t * buf, size_t size);
     void WriteIrNecSignal(uint16_t IrCode);
     bool DecodeIrNecSignal(uint16_t * IrCode, uint32_t * RawIrCode);
-    std::vector<uint32_t> GetSignal();
+    const std::vector<uint32_t> & GetSignal() const;
 };
 
 #endif // CTQIRSIGNAL_H
@@ -1,21 +1,224 @@
+#include <chrono>
+#include <csignal>
 #include <cstdint>
 #include <cstdio>
+#include <iomanip>
 #include <iostream>
 #include <ostream>
+#include <string>
 #include <thread>
+#include <vector>
 
 #include "CLI11.hpp"
+#include "TiqiaaEmu.h"
+#include "TiqiaaRepeater.h"
 #include "TiqiaaUsb.h"
 #include "ctqirsignal.h"
 
 static bool waiting;
-static CTqIrSignal signal;
+static CTqIrSignal recvSignal;
+static volatile sig_atomic_t stopRequested;
+
+static void onStopSignal(int) { stopRequested = 1; }
+
+// repeater filter: only signals that decode as NEC
+static bool necFilter(uint8_t *data, int *size, void * /*context*/) {
+  CTqIrSignal sig;
+  uint16_t code;
+  uint32_t rawCode;
+  return sig.FromTiqiaa(data, *size) && sig.DecodeIrNecSignal(&code, &rawCode);
+}
+
+static void printLatency(const char *name, const TiqiaaUsbIrHistogram *hist) {
+  if (hist == nullptr || hist->GetCount() == 0) return;
+  std::cout << std::left << std::setw(12) << name << std::right
+            << std::setw(8) << hist->GetCount() << std::setw(10)
+            << hist->GetMin() << std::setw(10) << hist->GetPercentile(50)
+            << std::setw(10) << hist->GetPercentile(90) << std::setw(10)
+            << hist->GetPercentile(99) << std::setw(10) << hist->GetMax()
+            << std::endl;
+}
+
+// latency of every recorded driver command, us
+static void printLatencyTable(TiqiaaUsbIr &ir) {
+  static const struct {
+    const char *name;
+    uint8_t cmdType;
+  } cmds[] = {{"Version", TiqiaaUsbIr_CmdVersion},
+              {"IdleMode", TiqiaaUsbIr_CmdIdleMode},
+              {"SendMode", TiqiaaUsbIr_CmdSendMode},
+              {"RecvMode", TiqiaaUsbIr_CmdRecvMode},
+              {"Data", TiqiaaUsbIr_CmdData},
+              {"Output", TiqiaaUsbIr_CmdOutput},
+              {"Cancel", TiqiaaUsbIr_CmdCancel},
+              {"Probe", TiqiaaUsbIr_CmdUnknown}};
+
+  std::cout << std::left << std::setw(12) << "Latency, us" << std::right
+            << std::setw(8) << "count" << std::setw(10) << "min"
+            << std::setw(10) << "p50" << std::setw(10) << "p90"
+            << std::setw(10) << "p99" << std::setw(10) << "max" << std::endl;
+  for (const auto &cmd : cmds) {
+    printLatency(cmd.name, ir.GetCmdLatency(cmd.cmdType));
+  }
+  printLatency("FragmWrite", ir.GetFragmWriteLatency());
+  printLatency("ReplyWait", ir.GetReplyWaitLatency());
+  printLatency("ModeSwitch", ir.GetModeSwitchLatency());
+}
+
+// driver health counters, nonzero error counters mean lost data
+static void printHealth(const char *name, TiqiaaUsbIr &ir) {
+  TiqiaaUsbIr_HealthStats stats;
+  ir.GetHealthStats(&stats);
+  std::cout << name << ": frames in " << stats.FramesIn << " / out "
+            << stats.FramesOut << ", bytes in " << stats.BytesIn << " / out "
+            << stats.BytesOut << std::endl;
+  std::cout << "  read errors " << stats.ReadErrors << ", write errors "
+            << stats.WriteErrors << ", bad fragments " << stats.BadFragms
+            << ", wrong report id " << stats.WrongReportId
+            << ", out of order " << stats.OutOfOrder << ", duplicates "
+            << stats.Duplicates << std::endl;
+  std::cout << "  overflows " << stats.Overflows << ", bad signatures "
+            << stats.BadSigns << ", unmatched replies "
+            << stats.UnmatchedReplies << ", timed out waits "
+            << stats.WaitTimeouts << std::endl;
+}
+
+struct benchOptions {
+  bool emulated = false;
+  int count = 20;
+  std::vector<std::string> workloads{"send", "raw", "alternate", "open"};
+  std::vector<int> sizes{64, 256, 1000, 4000};
+  int replyUs = 1000;
+  int writeUs = 125;
+  double airtimeScale = 1.0;
+};
+
+static void printBenchHeader() {
+  std::cout << std::left << std::setw(26) << "Operation" << std::right
+            << std::setw(8) << "ops" << std::setw(10) << "ops/s"
+            << std::setw(10) << "p50, us" << std::setw(10) << "p90, us"
+            << std::setw(10) << "p99, us" << std::setw(10) << "max, us"
+            << std::setw(8) << "failed" << std::endl;
+}
+
+// elapsedNs: wall time of the whole workload loop
+static void printBenchRow(const std::string &name,
+                          const TiqiaaUsbIrHistogram &hist, uint64_t elapsedNs,
+                          int failed) {
+  double opsPerSec =
+      elapsedNs ? hist.GetCount() * 1000000000.0 / elapsedNs : 0.0;
+  std::cout << std::left << std::setw(26) << name << std::right
+            << std::setw(8) << hist.GetCount() << std::setw(10) << std::fixed
+            << std::setprecision(1) << opsPerSec << std::setw(10)
+            << hist.GetPercentile(50) << std::setw(10) << hist.GetPercentile(90)
+            << std::setw(10) << hist.GetPercentile(99) << std::setw(10)
+            << hist.GetMax() << std::setw(8) << failed << std::endl;
+}
+
+// Run workloads on the device or on the built-in emulator, print ops/s and
+// latency percentiles of every operation
+static int runBench(const benchOptions &opt, int device, bool stats) {
+  TiqiaaUsbIrEmulator emu;
+  TiqiaaUsbIr ir;
+
+  emu.AirtimeScale = opt.airtimeScale;
+  emu.ReplyLatency = opt.replyUs;
+  emu.FragmWriteLatency = opt.writeUs;
+  auto openDevice = [&]() {
+    return opt.emulated ? ir.Open(&emu) : ir.Open(device);
+  };
+
+  if (!openDevice()) {
+    std::cout << "Could not open the device." << std::endl;
+    return 1;
+  }
+  printBenchHeader();
+  for (const std::string &workload : opt.workloads) {
+    if (workload == "send") {
+      TiqiaaUsbIrHistogram hist;
+      int failed = 0;
+      uint64_t startNs = TiqiaaUsbIr_NowNs();
+      for (int i = 0; i < opt.count; i++) {
+        uint64_t opNs = TiqiaaUsbIr_NowNs();
+        if (!ir.SendNecSignal(0x8002 + 2 * (i % 3))) failed++;
+        hist.RecordNs(opNs, TiqiaaUsbIr_NowNs());
+      }
+      printBenchRow("SendNecSignal", hist, TiqiaaUsbIr_NowNs() - startNs,
+                    failed);
+    } else if (workload == "raw") {
+      for (int size : opt.sizes) {
+        // 560 us marks and spaces, the NEC bit unit
+        std::vector<uint8_t> buf(size > 0 ? size : 1);
+        for (size_t i = 0; i < buf.size(); i++) {
+          buf[i] = (i % 2) ? 35 : 0x80 | 35;
+        }
+        TiqiaaUsbIrHistogram hist;
+        int failed = 0;
+        uint64_t startNs = TiqiaaUsbIr_NowNs();
+        for (int i = 0; i < opt.count; i++) {
+          uint64_t opNs = TiqiaaUsbIr_NowNs();
+          if (!ir.SendIRStream(38000, buf.data(), buf.size())) failed++;
+          hist.RecordNs(opNs, TiqiaaUsbIr_NowNs());
+        }
+        printBenchRow("SendIR " + std::to_string(buf.size()) + " bytes", hist,
+                      TiqiaaUsbIr_NowNs() - startNs, failed);
+      }
+    } else if (workload == "alternate") {
+      TiqiaaUsbIrHistogram sendHist, recvHist;
+      int sendFailed = 0, recvFailed = 0;
+      uint64_t startNs = TiqiaaUsbIr_NowNs();
+      for (int i = 0; i < opt.count; i++) {
+        uint64_t opNs = TiqiaaUsbIr_NowNs();
+        if (!ir.SendNecSignal(0x8002)) sendFailed++;
+        uint64_t recvNs = TiqiaaUsbIr_NowNs();
+        if (!ir.StartRecvIR()) recvFailed++;
+        sendHist.RecordNs(opNs, recvNs);
+        recvHist.RecordNs(recvNs, TiqiaaUsbIr_NowNs());
+      }
+      uint64_t elapsedNs = TiqiaaUsbIr_NowNs() - startNs;
+      printBenchRow("Alternate: SendNecSignal", sendHist, elapsedNs,
+                    sendFailed);
+      printBenchRow("Alternate: StartRecvIR", recvHist, elapsedNs, recvFailed);
+    } else if (workload == "open") {
+      TiqiaaUsbIrHistogram closeHist, openHist;
+      int closeFailed = 0, openFailed = 0;
+      uint64_t startNs = TiqiaaUsbIr_NowNs();
+      for (int i = 0; i < opt.count; i++) {
+        uint64_t opNs = TiqiaaUsbIr_NowNs();
+        if (!ir.Close()) closeFailed++;
+        uint64_t openNs = TiqiaaUsbIr_NowNs();
+        bool opened = openDevice();
+        closeHist.RecordNs(opNs, openNs);
+        openHist.RecordNs(openNs, TiqiaaUsbIr_NowNs());
+        if (!opened) {
+          openFailed++;
+          break;
+        }
+      }
+      uint64_t elapsedNs = TiqiaaUsbIr_NowNs() - startNs;
+      printBenchRow("Close", closeHist, elapsedNs, closeFailed);
+      printBenchRow("Open", openHist, elapsedNs, openFailed);
+      if (openFailed) {
+        std::cout << "Could not reopen the device." << std::endl;
+        return 1;
+      }
+    }
+  }
+  ir.Close();
+  if (stats) printHealth(opt.emulated ? "Emulated" : "Device", ir);
+  return 0;
+}
 
 void irRecvCallback(uint8_t *data, int size, class TiqiaaUsbIr *IrCls,
                     void *context) {
+  // data is the whole signal, joined from all its CmdData packets
+  uint16_t code;
+  uint32_t rawCode;
   std::cout << "Data: " << (unsigned) *data << " Size: " << size << std::endl;
-  std::cout << "Tiqiaa: " << signal.FromTiqiaa(data, size) << std::endl;
-  std::cout << "Data: " << (unsigned) *data << " Size: " << size << std::endl;
+  std::cout << "Tiqiaa: " << recvSignal.FromTiqiaa(data, size) << std::endl;
+  if (recvSignal.DecodeIrNecSignal(&code, &rawCode)) {
+    std::cout << "NEC: 0x" << std::hex << code << std::dec << std::endl;
+  }
   waiting = false;
 }
 
@@ -30,12 +233,178 @@ int main(int argc, char **argv) {
   CLI::Option *sendNecOpt = app.add_option(
       "-s,--send", sendNec, "Send a NEC code (hexadecimal), e.g.: 0x8002");
 
+  unsigned holdMs = 0;
+  app.add_option("--hold", holdMs,
+                 "Send the -s code as a button held for this time (ms): one "
+                 "frame, then NEC repeat frames every 108 ms")
+      ->needs(sendNecOpt);
+
+  std::vector<uint16_t> macro;
+  CLI::Option *macroOpt = app.add_option(
+      "-m,--macro", macro,
+      "Send several NEC codes back to back, e.g.: 0x8002 0x8004");
+
+  unsigned gapMs = 40;
+  app.add_option("--gap", gapMs, "Gap between --macro codes (ms)");
+
+  int device = 0;
+  app.add_option("-d,--device", device,
+                 "Device index when several are connected (default 0)");
+
+  bool list = false;
+  app.add_flag("-l,--list", list, "Print the number of connected devices");
+
+  std::vector<int> repeat;
+  CLI::Option *repeatOpt =
+      app.add_option("--repeat", repeat,
+                     "Repeat signals received by device RX on device TX "
+                     "until Ctrl+C, e.g.: --repeat 0 1")
+          ->expected(2);
+
+  bool repeatNec = false;
+  app.add_flag("--repeat-nec", repeatNec,
+               "Repeat only signals that decode as NEC");
+
+  bool latency = false;
+  app.add_flag("--latency", latency,
+               "Print command latency percentiles before exit");
+
+  bool stats = false;
+  app.add_flag("--stats", stats,
+               "Print driver health counters (dropped data, errors) before exit");
+
+  std::string traceFile;
+  app.add_option("--trace", traceFile,
+                 "Write Chrome trace-event JSON of the driver pipeline to "
+                 "file, load it in Perfetto");
+
+  std::string pcapFile;
+  app.add_option("--pcap", pcapFile,
+                 "Capture USB traffic to a usbmon pcap file for Wireshark");
+
+  std::string recordFile;
+  app.add_option("--record", recordFile,
+                 "Record the USB session of the device to file for --replay");
+
+  std::string replayFile;
+  CLI::Option *replayOpt = app.add_option(
+      "--replay", replayFile,
+      "Use a session recorded with --record instead of the device");
+
+  double replayScale = 1.0;
+  app.add_option("--replay-scale", replayScale,
+                 "Reply time scale of --replay, e.g. 0.1 is ten times faster, "
+                 "0 is instant");
+
+  benchOptions benchOpt;
+  CLI::App *benchCmd = app.add_subcommand(
+      "bench", "Measure ops/s and latency of driver operations");
+  // -d and --stats are accepted after bench too
+  benchCmd->fallthrough();
+  benchCmd->add_flag("--emulated", benchOpt.emulated,
+                     "Use the built-in emulated device instead of -d");
+  benchCmd->add_option("-n,--count", benchOpt.count,
+                       "Operations per workload (default 20)");
+  benchCmd
+      ->add_option("-w,--workload", benchOpt.workloads,
+                   "Workloads: send (SendNecSignal), raw (SendIR of --sizes), "
+                   "alternate (SendNecSignal + StartRecvIR), open "
+                   "(Close + Open); default all")
+      ->check(CLI::IsMember({"send", "raw", "alternate", "open"}));
+  benchCmd->add_option("--sizes", benchOpt.sizes,
+                       "Raw IR buffer sizes, bytes (default 64 256 1000 4000)");
+  benchCmd->add_option("--reply-us", benchOpt.replyUs,
+                       "Emulated device reply latency (default 1000)");
+  benchCmd->add_option("--write-us", benchOpt.writeUs,
+                       "Emulated device USB fragment write time (default 125)");
+  benchCmd->add_option("--airtime-scale", benchOpt.airtimeScale,
+                       "Emulated IR playback time scale, 0 - instant "
+                       "(default 1)");
+
   CLI11_PARSE(app, argc, argv);
 
+  if (*benchCmd) return runBench(benchOpt, device, stats);
+
+  TiqiaaUsbIrPcap pcap;
+  if (!pcapFile.empty() && !pcap.Open(pcapFile.c_str())) {
+    std::cout << "Could not create " << pcapFile << std::endl;
+    return 1;
+  }
+
+  if (!traceFile.empty()) TiqiaaUsbIrTrace::Enable(true);
+  // kill -USR1 <pid> prints the last USB fragments of every open device
+  TiqiaaUsbIr::SetFlightDumpSignal(SIGUSR1, 2);
+
+  if (list) {
+    std::cout << "Devices: " << TiqiaaUsbIr::GetDeviceCount() << std::endl;
+    return 0;
+  }
+
+  if (*repeatOpt) {
+    TiqiaaUsbIr rx, tx;
+    TiqiaaUsbIrRepeater repeater;
+    TiqiaaUsbIrRepeater_Stats repStats;
+
+    if (pcap.IsOpen()) rx.Pcap = tx.Pcap = &pcap;
+
+    if (!rx.Open(repeat[0]) || !tx.Open(repeat[1])) {
+      std::cout << "Could not open the devices." << std::endl;
+      return 1;
+    }
+    if (repeatNec) repeater.Filter = &necFilter;
+    std::signal(SIGINT, onStopSignal);
+    if (!repeater.Start(&rx, &tx)) {
+      std::cout << "Could not start the repeater." << std::endl;
+      return 1;
+    }
+    std::cerr << "Repeating, Ctrl+C to stop..." << std::endl;
+    while (!stopRequested) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    repeater.Stop();
+    repeater.GetStats(&repStats);
+    std::cout << "Captured " << repStats.Captures << ", sent " << repStats.Sent
+              << ", filtered " << repStats.Filtered << ", dropped "
+              << repStats.Dropped << ", failed " << repStats.Failed
+              << std::endl;
+    if (repStats.Sent) {
+      std::cout << "Capture to emit latency: min " << repStats.LatencyMinUs
+                << " us, avg " << repStats.LatencySumUs / repStats.Sent
+                << " us, max " << repStats.LatencyMaxUs << " us" << std::endl;
+    }
+    if (latency) printLatencyTable(tx);
+    if (stats) {
+      printHealth("RX", rx);
+      printHealth("TX", tx);
+    }
+    if (!traceFile.empty() &&
+        TiqiaaUsbIrTrace::WriteJson(traceFile.c_str()) < 0) {
+      std::cout << "Could not write " << traceFile << std::endl;
+    }
+    return 0;
+  }
+
+  TiqiaaUsbIrRecorder recorder;
+  if (!recordFile.empty() && !recorder.Open(recordFile.c_str())) {
+    std::cout << "Could not create " << recordFile << std::endl;
+    return 1;
+  }
+
+  TiqiaaUsbIrReplay replay;
+  if (*replayOpt) {
+    if (!replay.Load(replayFile.c_str())) {
+      std::cout << "Could not load " << replayFile << std::endl;
+      return 1;
+    }
+    replay.TimeScale = replayScale;
+  }
+
   TiqiaaUsbIr Ir;
   Ir.IrRecvCallback = &irRecvCallback;
+  if (pcap.IsOpen()) Ir.Pcap = &pcap;
+  if (recorder.IsOpen()) Ir.Recorder = &recorder;
 
-  if (!Ir.Open()) {
+  if (*replayOpt ? !Ir.Open(&replay) : !Ir.Open(device)) {
     std::cout << "Could not open the device." << std::endl;
     return 1;
   }
@@ -43,7 +412,7 @@ int main(int argc, char **argv) {
   if (*sendNecOpt) {
     std::cerr << "Sending..." << std::endl;
 
-    if (Ir.SendNecSignal(sendNec)) {
+    if (holdMs ? Ir.SendNecHold(sendNec, holdMs) : Ir.SendNecSignal(sendNec)) {
       std::cout << "Sent code successfully" << std::endl;
     } else {
       std::cout << "Send failure" << std::endl;
@@ -52,6 +421,23 @@ int main(int argc, char **argv) {
     std::cerr << "Sent." << std::endl;
   }
 
+  if (*macroOpt) {
+    std::vector<uint8_t> bufs(macro.size() * 128);
+    std::vector<TiqiaaUsbIr_IrFrame> frames(macro.size());
+    for (size_t i = 0; i < macro.size(); i++) {
+      frames[i].Data = &bufs[i * 128];
+      frames[i].Size = TiqiaaUsbIr::WriteIrNecSignal(macro[i], &bufs[i * 128]);
+      frames[i].Gap = gapMs * 1000;
+    }
+
+    if (Ir.SendIRBatch(38000, frames.data(), frames.size())) {
+      std::cout << "Sent " << frames.size() << " codes successfully"
+                << std::endl;
+    } else {
+      std::cout << "Send failure" << std::endl;
+    }
+  }
+
   if (*receiveNecOpt) {
     std::cerr << "Receiving..." << std::endl;
     waiting = true;
@@ -62,6 +448,30 @@ int main(int argc, char **argv) {
   }
 
   Ir.Close();
+  int exitCode = 0;
+  if (*replayOpt) {
+    // a replay that matches the recording has no mismatched or missing writes
+    // and consumes every recorded read
+    TiqiaaUsbIrReplay_Stats replayStats;
+    replay.GetStats(&replayStats);
+    std::cout << "Replay: written " << replayStats.Writes << ", mismatched "
+              << replayStats.Mismatches << ", extra " << replayStats.ExtraWrites
+              << ", missing " << replayStats.MissingWrites << ", read "
+              << replayStats.Reads << ", unread " << replayStats.MissingReads
+              << std::endl;
+    if (replayStats.FirstMismatch >= 0) {
+      std::cout << "First mismatched fragment: " << replayStats.FirstMismatch
+                << std::endl;
+    }
+    if (replayStats.Mismatches || replayStats.ExtraWrites ||
+        replayStats.MissingWrites || replayStats.MissingReads)
+      exitCode = 1;
+  }
+  if (latency) printLatencyTable(Ir);
+  if (stats) printHealth("Device", Ir);
+  if (!traceFile.empty() && TiqiaaUsbIrTrace::WriteJson(traceFile.c_str()) < 0) {
+    std::cout << "Could not write " << traceFile << std::endl;
+  }
 
-  return 0;
+  return exitCode;
 }